@@ -0,0 +1,85 @@
+#ifndef APP_H
+#define APP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+
+/* Application patterns: an op of the benchmark is a whole lock
+ * acquire/release or lookup, made of verbs that each depend on the
+ * completion of the one before. lock:reads spins with cas on the word at
+ * the location, reads the location reads times while holding it and
+ * releases it with a cas back to 0. chase:hops follows the pointer chain
+ * the server laid out with -chase for hops dependent reads. */
+struct AppPattern {
+    enum class Kind { NONE, LOCK, CHASE } kind;
+    /* lock: reads while held, chase: hops */
+    size_t n;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const AppPattern& app) {
+    switch (app.kind) {
+    case AppPattern::Kind::NONE:
+        out << "none";
+        break;
+    case AppPattern::Kind::LOCK:
+        out << "lock:" << app.n;
+        break;
+    case AppPattern::Kind::CHASE:
+        out << "chase:" << app.n;
+        break;
+    }
+    return out;
+}
+
+/* none | lock[:reads] | chase[:hops] */
+inline std::istream& operator>>(std::istream& in, AppPattern& app) {
+    std::string str;
+    in >> str;
+    std::vector<std::string> fields;
+    boost::split(fields, str, boost::is_any_of(":"));
+    app = {AppPattern::Kind::NONE, 0};
+    if (boost::iequals("none", fields[0]) && fields.size() == 1) {
+        return in;
+    }
+    if (boost::iequals("lock", fields[0])) {
+        app.kind = AppPattern::Kind::LOCK;
+    } else if (boost::iequals("chase", fields[0])) {
+        app.kind = AppPattern::Kind::CHASE;
+        app.n = 4;
+    } else {
+        in.setstate(std::ios_base::failbit);
+        return in;
+    }
+    if (fields.size() > 2) {
+        in.setstate(std::ios_base::failbit);
+    } else if (fields.size() == 2) {
+        std::stringstream ss(fields[1]);
+        if (!(ss >> app.n) || !ss.eof()) {
+            in.setstate(std::ios_base::failbit);
+        }
+    }
+    if (app.kind == AppPattern::Kind::CHASE && !app.n) {
+        in.setstate(std::ios_base::failbit);
+    }
+    return in;
+}
+
+/* An op of a pattern in flight: where its next verb goes and how far it
+ * got. lock: step 0 spins for the lock, 1..reads are the reads while
+ * holding it, reads + 1 is the release. chase: hops done. */
+struct AppOp {
+    uint64_t remote;
+    /* lock: the value that marks it as held by this op, never 0 */
+    uint64_t owner;
+    uint32_t step;
+    /* lock: cas needed to get it */
+    uint32_t attempts;
+};
+
+#endif /* APP_H */
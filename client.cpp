@@ -7,59 +7,2359 @@
 #include <iomanip>
 #include <chrono>
 #include <cstring>
+#include <memory>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <fstream>
+#include <limits>
+#include <cmath>
+#include <map>
+#include <array>
+#include <set>
 
 #include <sys/mman.h>
+#include <sys/resource.h>
 
 #include <rdma/rdma_cma.h>
 
 #include <psl/net.h>
 #include <psl/log.h>
 #include <psl/type_traits.h>
-#include <psl/stats.h>
 #include <psl/terminal.h>
 
 #include <boost/program_options.hpp>
 #include <boost/algorithm/string.hpp>
 
 #include <common.h>
+#include <histogram.h>
+#include <workload.h>
+#include <transport.h>
+#include <rdma_transport.h>
+#include <xverbs.h>
+#include <shm_transport.h>
+#include <cpu.h>
+#include <registration.h>
+#include <server_memory.h>
+#include <verify.h>
+#include <app.h>
+#include <control.h>
+#include <report.h>
+#include <nic_counters.h>
+#include <scenario.h>
+#include <trace.h>
 
-constexpr size_t sample_size = 1e6;
+enum class Type { LAT, BW };
+
+inline std::ostream& operator<<(std::ostream& out, const Type& t) {
+    out << psl::to_underlying(t);
+    return out;
+}
+
+inline std::istream& operator>>(std::istream& in, Type& t) {
+    std::string str;
+    in >> str;
+    if (boost::iequals("lat", str)) {
+        t = Type::LAT;
+    } else if (boost::iequals("bw", str)) {
+        t = Type::BW;
+    }
+    return in;
+}
+
+/* open-loop inter-arrival times */
+enum class Arrival { FIXED, POISSON };
+
+inline std::ostream& operator<<(std::ostream& out, const Arrival& a) {
+    out << (a == Arrival::FIXED ? "fixed" : "poisson");
+    return out;
+}
+
+inline std::istream& operator>>(std::istream& in, Arrival& a) {
+    std::string str;
+    in >> str;
+    if (boost::iequals("fixed", str)) {
+        a = Arrival::FIXED;
+    } else if (boost::iequals("poisson", str)) {
+        a = Arrival::POISSON;
+    } else {
+        in.setstate(std::ios_base::failbit);
+    }
+    return in;
+}
+
+/* -tune goal: the highest ops/sec, or the lowest p99 at a throughput of
+ * at least floor ops/sec */
+struct TuneGoal {
+    enum class Kind { RATE, P99 } kind;
+    double floor;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const TuneGoal& goal) {
+    if (goal.kind == TuneGoal::Kind::RATE) {
+        out << "rate";
+    } else {
+        out << "p99:" << goal.floor;
+    }
+    return out;
+}
+
+/* rate | p99[:floor] */
+inline std::istream& operator>>(std::istream& in, TuneGoal& goal) {
+    std::string str;
+    in >> str;
+    std::vector<std::string> fields;
+    boost::split(fields, str, boost::is_any_of(":"));
+    goal = {TuneGoal::Kind::RATE, 0.0};
+    if (boost::iequals("rate", fields[0]) && fields.size() == 1) {
+        return in;
+    }
+    if (!boost::iequals("p99", fields[0]) || fields.size() > 2) {
+        in.setstate(std::ios_base::failbit);
+        return in;
+    }
+    goal.kind = TuneGoal::Kind::P99;
+    if (fields.size() == 2) {
+        std::stringstream ss(fields[1]);
+        if (!(ss >> goal.floor) || !ss.eof() || goal.floor < 0.0) {
+            in.setstate(std::ios_base::failbit);
+        }
+    }
+    return in;
+}
+
+/* -tune: largest tx depth tried unless -tx says otherwise */
+constexpr size_t default_tune_tx = 256;
+
+/* -tune: a neighbour has to beat the current point by this much to move
+ * there, less is noise between two short trials */
+constexpr double tune_margin = 0.02;
+
+/* Sweep values: a comma separated list of values and lo-hi ranges that
+ * step in powers of two, e.g. 8-4K or 1,4,16. Values take K/M/G. */
+struct ValueList {
+    std::vector<size_t> values;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const ValueList& list) {
+    for (size_t i = 0; i < list.values.size(); i++) {
+        out << (i ? "," : "") << list.values[i];
+    }
+    return out;
+}
+
+inline std::istream& operator>>(std::istream& in, ValueList& list) {
+    std::string str;
+    in >> str;
+    std::vector<std::string> entries;
+    boost::split(entries, str, boost::is_any_of(","));
+    list.values.clear();
+    for (auto& entry : entries) {
+        std::vector<std::string> fields;
+        boost::split(fields, entry, boost::is_any_of("-"));
+        Bytes lo, hi;
+        std::stringstream lo_ss(fields[0]);
+        std::stringstream hi_ss(fields.size() > 1 ? fields[1] : fields[0]);
+        if (fields.size() > 2 || !(lo_ss >> lo) || !(hi_ss >> hi) ||
+            lo.value > hi.value || (!lo.value && hi.value)) {
+            in.setstate(std::ios_base::failbit);
+            return in;
+        }
+        for (size_t v = lo.value; v <= hi.value; v *= 2) {
+            list.values.push_back(v);
+            if (!v) {
+                break;
+            }
+        }
+    }
+    return in;
+}
+
+/* A server of a fan-out, port 0 = the -p port */
+struct Endpoint {
+    psl::net::in_addr ip;
+    psl::net::in_port_t port;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const Endpoint& e) {
+    out << e.ip << ":" << e.port;
+    return out;
+}
+
+/* ip[:port][,ip[:port]...], shm only needs :port */
+struct EndpointList {
+    std::vector<Endpoint> endpoints;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const EndpointList& list) {
+    for (size_t i = 0; i < list.endpoints.size(); i++) {
+        out << (i ? "," : "") << list.endpoints[i];
+    }
+    return out;
+}
+
+inline std::istream& operator>>(std::istream& in, EndpointList& list) {
+    std::string str;
+    in >> str;
+    std::vector<std::string> entries;
+    boost::split(entries, str, boost::is_any_of(","));
+    list.endpoints.clear();
+    for (auto& entry : entries) {
+        std::vector<std::string> fields;
+        boost::split(fields, entry, boost::is_any_of(":"));
+        Endpoint endpoint = {};
+        std::stringstream ip_ss(fields[0]);
+        std::stringstream port_ss(fields.size() > 1 ? fields[1] : "0");
+        if (fields.size() > 2 ||
+            (!fields[0].empty() && !(ip_ss >> endpoint.ip)) ||
+            !(port_ss >> endpoint.port)) {
+            in.setstate(std::ios_base::failbit);
+            return in;
+        }
+        list.endpoints.push_back(endpoint);
+    }
+    if (list.endpoints.size() > max_targets) {
+        in.setstate(std::ios_base::failbit);
+    }
+    return in;
+}
+
+/* how a worker waits for completions */
+enum class CompletionMode { BUSY, EVENT, HYBRID };
+
+inline std::ostream& operator<<(std::ostream& out, const CompletionMode& m) {
+    switch (m) {
+    case CompletionMode::BUSY:
+        out << "busy";
+        break;
+    case CompletionMode::EVENT:
+        out << "event";
+        break;
+    case CompletionMode::HYBRID:
+        out << "hybrid";
+        break;
+    }
+    return out;
+}
+
+inline std::istream& operator>>(std::istream& in, CompletionMode& m) {
+    std::string str;
+    in >> str;
+    if (boost::iequals("busy", str)) {
+        m = CompletionMode::BUSY;
+    } else if (boost::iequals("event", str)) {
+        m = CompletionMode::EVENT;
+    } else if (boost::iequals("hybrid", str)) {
+        m = CompletionMode::HYBRID;
+    } else {
+        in.setstate(std::ios_base::failbit);
+    }
+    return in;
+}
+
+/* -verify: bad stamps printed per worker, the rest is only counted */
+constexpr uint64_t max_verify_reports = 10;
+
+/* longest a worker blocks before it looks at the done flag again */
+constexpr uint64_t event_timeout_ns = 10000000;
+
+struct ClientConfig {
+    ssize_t locations;
+    size_t tx_depth;
+    size_t cq_mod;
+    ibv_wr_opcode opcode;
+    Type type;
+    size_t inline_data;
+    /* -tune: connect with the largest inline size the device allows */
+    bool probe_inline;
+    Bytes size;
+    Bytes alignment;
+    size_t aligned_size;
+    size_t batch;
+    bool echo;
+    /* -op/-s as a single entry mix unless -mix is given */
+    OpMix mix;
+    Distribution distribution;
+    size_t trace_len;
+    /* locations with their own slot in the local buffer */
+    size_t nlocal_locations;
+    /* open-loop ops/sec per worker, 0 = closed loop */
+    double rate;
+    Arrival arrival;
+    /* post and poll through ibv_qp_ex/ibv_cq_ex where supported */
+    bool xverbs;
+    TransportKind transport;
+    CompletionMode completion;
+    /* hybrid: busy poll this long before blocking */
+    uint64_t spin_ns;
+    /* workers are pinned round robin, empty = not pinned */
+    std::vector<int> cpus;
+    /* every worker connects to each of them, ops go by WorkloadOp::target */
+    std::vector<Endpoint> servers;
+    /* connections per server and worker, ops go round robin over them */
+    size_t qps;
+    /* fan-out: one CQ per worker instead of one per QP */
+    bool shared_cq;
+    QpType qp_type;
+    /* echo: receive buffer size, UD needs room for the GRH */
+    size_t recv_stride;
+    /* registration cache entries of reg_chunk bytes, 0 = everything
+     * registered up front */
+    size_t reg_cache;
+    size_t reg_chunk;
+    /* stamp writes, check reads, real cas values (verify.h) */
+    bool verify;
+    /* ops made of dependent verbs (app.h), -cq_mod 1 */
+    AppPattern app;
+    /* -scenario: opcodes of the phases the QPs have to support too */
+    std::vector<ibv_wr_opcode> phase_opcodes;
+    /* -replay: the records of this trace instead of generated ops, one
+     * mix entry per opcode in it */
+    std::shared_ptr<const MappedTrace> replay;
+    ReplayPace replay_pace;
+};
+
+/* Each worker thread owns its connections, local MR slice and workload
+ * trace. Nothing in here is touched by other threads. */
+struct Worker {
+    /* qps connections per server, in ClientConfig::servers order; a run
+     * may use fewer of them (-sweep_qps) */
+    std::vector<std::unique_ptr<Transport>> transports;
+    size_t qps;
+    /* local memory of the worker */
+    void* slice;
+    /* -verify: who wrote a stamp (-app: who holds a lock), and the result
+     * slots of reads and atomics (tx depth per connection, behind the
+     * echo receives) */
+    uint32_t client_id;
+    uint64_t results;
+    /* the slice registered with each connection's protection domain, with
+     * -reg_cache only its echo receive buffers (nullptr without echo) */
+    std::vector<ibv_mr*> mrs;
+    std::vector<WorkloadOp> trace;
+    /* -replay: the worker posts records replay_first, replay_first +
+     * replay_step, ... so the workers together keep the trace's order */
+    size_t replay_first;
+    size_t replay_step;
+    /* echo: receives posted per connection, they stay posted between runs */
+    std::vector<size_t> posted_recvs;
+};
+
+/* wr_id of a work request: the connection index of the run above
+ * target_shift, the ring or receive buffer index below it. The empty write
+ * that drains a send queue after a run is flush_wr_id | connection index. */
+constexpr unsigned target_shift = 32;
+constexpr uint64_t index_mask = (uint64_t{1} << target_shift) - 1;
+constexpr uint64_t flush_wr_id = uint64_t{1} << 63;
+
+/* Written by exactly one worker and read by the time thread, padded so
+ * that workers never share a cache line. */
+struct alignas(cache_line_size) WorkerStats {
+    std::atomic<uint64_t> operations{0};
+    std::atomic<uint64_t> doorbells{0};
+    /* wrs posted and not completed at the last poll */
+    std::atomic<uint64_t> in_flight{0};
+    std::atomic<uint64_t> type_operations[max_op_types] = {};
+    /* open loop: ops due but not posted since the QP is full */
+    std::atomic<uint64_t> backlog{0};
+    std::atomic<uint64_t> max_backlog{0};
+    Histogram latency[max_op_types];
+    /* post to completion as seen by the NIC clock (-xverbs) */
+    Histogram nic_latency;
+    /* -verify: reads checked and failed, cas outcomes, fadds per server */
+    std::atomic<uint64_t> verify_checked{0};
+    std::atomic<uint64_t> verify_errors{0};
+    std::atomic<uint64_t> cas_success{0};
+    std::atomic<uint64_t> cas_failure{0};
+    std::atomic<uint64_t> verify_fadds[max_targets] = {};
+    /* -app: verbs posted for the ops, retries included. lock: cas that
+     * found it taken, most cas one acquire took, releases that found
+     * another owner, and first cas to acquired (-t lat). */
+    std::atomic<uint64_t> app_wrs{0};
+    std::atomic<uint64_t> lock_failures{0};
+    std::atomic<uint64_t> lock_max_attempts{0};
+    std::atomic<uint64_t> lock_errors{0};
+    Histogram lock_acquire;
+    /* -reg_cache lookups of the local buffers */
+    std::atomic<uint64_t> reg_hits{0};
+    std::atomic<uint64_t> reg_misses{0};
+    std::atomic<uint64_t> reg_evictions{0};
+    /* -replay: bytes of the completed records, their sizes vary */
+    std::atomic<uint64_t> replay_bytes{0};
+    /* fan-out: per server over all op types */
+    std::atomic<uint64_t> target_operations[max_targets] = {};
+    Histogram target_latency[max_targets];
+    /* CPU time of the whole run, set when the worker exits */
+    std::atomic<uint64_t> cpu_ns{0};
+};
+
+/* Connects qps QPs to every server, one after the other, and records
+ * how long each connection took to set up. */
+void connect_worker(Worker& worker, const ClientConfig& config,
+                    Histogram& setup_latency) {
+    TransportParams params;
+    params.tx_depth = config.tx_depth;
+    params.inline_data = config.inline_data;
+    params.probe_inline = config.probe_inline;
+    params.send = config.opcode == IBV_WR_SEND;
+    params.echo = config.echo;
+    params.locations = config.locations;
+    for (auto& op_type : config.mix.types) {
+        params.opcodes.push_back(op_type.opcode);
+    }
+    if (config.app.kind == AppPattern::Kind::LOCK && config.app.n) {
+        params.opcodes.push_back(IBV_WR_RDMA_READ);
+    }
+    /* -verify reads the fadd counters back before and after the run */
+    if (config.verify &&
+        std::any_of(config.mix.types.begin(), config.mix.types.end(),
+                    [](const OpType& op_type) {
+                        return is_atomic(op_type.opcode);
+                    })) {
+        params.opcodes.push_back(IBV_WR_RDMA_READ);
+    }
+    params.opcodes.insert(params.opcodes.end(), config.phase_opcodes.begin(),
+                          config.phase_opcodes.end());
+    params.xverbs = config.xverbs;
+    params.events = config.completion != CompletionMode::BUSY;
+    params.cq_qps =
+        config.shared_cq ? config.servers.size() * config.qps : 1;
+    params.qp_type = config.qp_type;
+    const RdmaTransport* first = nullptr;
+    worker.transports.clear();
+    worker.qps = config.qps;
+    for (auto& server : config.servers) {
+        sockaddr_in addr;
+        addr.sin_addr = server.ip;
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(server.port);
+        for (size_t q = 0; q < config.qps; q++) {
+            const uint64_t start = now_ns();
+            if (config.transport == TransportKind::SHM) {
+                worker.transports.emplace_back(
+                    new ShmTransport(params, server.port));
+            } else {
+                RdmaTransport* transport =
+                    new RdmaTransport(params, addr, first);
+                worker.transports.emplace_back(transport);
+                if (!first) {
+                    first = transport;
+                }
+            }
+            setup_latency.record(now_ns() - start);
+        }
+    }
+    worker.posted_recvs.assign(worker.transports.size(), 0);
+}
+
+/* CPU cost of ops operations that took cpu_ns CPU time in wall_ns, the
+ * utilization is summed over threads */
+void print_cpu(std::ostream& out, uint64_t cpu_ns, uint64_t ops,
+               uint64_t wall_ns) {
+    using namespace psl::terminal;
+    out << graphic_format::GREEN << graphic_format::BOLD
+        << "cpu = " << graphic_format::WHITE
+        << (wall_ns ? 100 * cpu_ns / wall_ns : 0) << "%";
+    if (ops) {
+        out << " " << cpu_ns / ops << "ns/op";
+        if (cycles_per_ns() > 0.0) {
+            out << " " << static_cast<uint64_t>(cpu_ns * cycles_per_ns() / ops)
+                << " cycles/op";
+        }
+    }
+    out << graphic_format::RESET;
+}
+
+void run_worker(Worker& worker, WorkerStats& stats, const ClientConfig& config,
+                const std::atomic<bool>& done) {
+    const Type type = config.type;
+    const size_t tx_depth = config.tx_depth;
+    const size_t cq_mod = config.cq_mod;
+    const size_t aligned_size = config.aligned_size;
+    const size_t nservers = config.servers.size();
+    const size_t nqps = config.qps;
+    const size_t ntargets = nservers * nqps;
+    const WorkloadOp* const trace_begin = worker.trace.data();
+    const WorkloadOp* const trace_end = trace_begin + worker.trace.size();
+    const WorkloadOp* trace_op = trace_begin;
+    const uint64_t local_addr = reinterpret_cast<uint64_t>(worker.slice);
+    const bool local_locations = config.nlocal_locations > 1;
+
+    /* -replay: a record is checked against the server's memory when it is
+     * posted, a bad one ends the run instead of the connection */
+    const MappedTrace* const replay = config.replay.get();
+    const bool replay_paced = replay && config.replay_pace.timestamps;
+    const TraceRecord* const records = replay ? replay->records() : nullptr;
+    const size_t nrecords = replay ? replay->size() : 0;
+    size_t record_index = replay ? worker.replay_first % nrecords : 0;
+    size_t next_prefetch = record_index;
+    const uint64_t replay_limit =
+        replay ? worker.transports[0]->server_conn_data.size : 0;
+    /* the mix entry of every TraceOp */
+    uint16_t replay_types[trace_ops] = {};
+    for (size_t t = 0; replay && t < config.mix.types.size(); t++) {
+        TraceOp op;
+        if (to_trace_op(config.mix.types[t].opcode, op)) {
+            replay_types[static_cast<size_t>(op)] = t;
+        }
+    }
+    /* ts pacing: the trace loops after its span and one mean gap, so the
+     * last record is not due at the same time as the first */
+    double replay_span = 0.0, replay_base = 0.0, replay_gap = 0.0;
+    if (replay_paced) {
+        const TraceHeader& header = replay->header();
+        const double span = header.last_ns - header.first_ns;
+        const double gap = nrecords > 1 ? span / (nrecords - 1) : 0.0;
+        replay_span = (span + gap) / config.replay_pace.speed;
+        replay_gap = std::max(replay_span * worker.replay_step / nrecords, 1.0);
+    }
+    auto record_due = [&]() {
+        return replay_base + (records[record_index].timestamp_ns -
+                              replay->header().first_ns) /
+                                 config.replay_pace.speed;
+    };
+
+    /* per op type constants, indexed by WorkloadOp::type */
+    struct PostType {
+        ibv_wr_opcode opcode;
+        uint32_t length;
+        bool atomic;
+        unsigned send_flags;
+    };
+    const size_t ntypes = config.mix.types.size();
+    PostType post_types[max_op_types];
+    for (size_t t = 0; t < ntypes; t++) {
+        const OpType& op_type = config.mix.types[t];
+        post_types[t].opcode = op_type.opcode;
+        post_types[t].atomic = is_atomic(op_type.opcode);
+        post_types[t].length = post_types[t].atomic ? 8 : op_type.size;
+        post_types[t].send_flags =
+            (config.inline_data && op_type.size <= config.inline_data &&
+             (op_type.opcode == IBV_WR_RDMA_WRITE ||
+              op_type.opcode == IBV_WR_SEND))
+                ? IBV_SEND_INLINE
+                : 0;
+    }
+
+    /* open loop: ops are due on a precomputed timeline (ns since start, a
+     * double is too coarse for epoch ns), latency is taken from the
+     * intended send time so stalls are not omitted */
+    const bool open_loop = config.rate > 0.0 || replay_paced;
+    const double mean_gap =
+        replay_paced ? replay_gap : open_loop ? 1e9 / config.rate : 0.0;
+    std::vector<double> gaps(config.rate > 0.0 ? 1 << 16 : 0, mean_gap);
+    if (config.rate > 0.0 && config.arrival == Arrival::POISSON) {
+        std::mt19937_64 r(std::random_device{}());
+        std::exponential_distribution<double> exp_dist(1.0 / mean_gap);
+        for (auto& gap : gaps) {
+            gap = exp_dist(r);
+        }
+    }
+    size_t gap_index = 0;
+    const uint64_t start_ns = now_ns();
+    double next_intended = replay_paced ? record_due() : 0.0;
+    uint64_t max_backlog = 0;
+    /* -replay: on to the worker's next record, the window ahead of it is
+     * read in the background */
+    auto next_record = [&]() {
+        record_index += worker.replay_step;
+        while (record_index >= nrecords) {
+            record_index -= nrecords;
+            replay_base += replay_span;
+            next_prefetch = record_index;
+        }
+        if (record_index >= next_prefetch) {
+            replay->prefetch(record_index);
+            next_prefetch = record_index + MappedTrace::prefetch_records / 2;
+        }
+        if (replay_paced) {
+            next_intended = record_due();
+        }
+    };
+
+    const bool echo = config.echo;
+    const size_t sq_depth = echo ? 2 * tx_depth : tx_depth;
+    /* the connections of this run: the first nqps of each server */
+    auto connection = [&](size_t t) {
+        return (t / nqps) * worker.qps + t % nqps;
+    };
+    bool nic_timestamps = type == Type::LAT;
+    for (size_t t = 0; t < ntargets; t++) {
+        nic_timestamps &= worker.transports[connection(t)]->nic_timestamps;
+    }
+
+    /* Per connection state. Completions of one QP arrive in post order and
+     * an unsignaled wr is only known to be done once a later signaled one
+     * of the same QP is, so depth, cq_mod and the rings are per QP. */
+    struct Target {
+        Transport* transport;
+        size_t server;
+        uint64_t remote_addr;
+        uint32_t rkey;
+        size_t in_flight;
+        size_t sq_used;
+        size_t posted;
+        /* -xverbs: the wrs of a batch go straight into this QP between
+         * ibv_wr_start and ibv_wr_complete, nullptr = the chain below */
+        ibv_qp_ex* qpx;
+        /* preallocated chain, posted with a single doorbell per batch;
+         * with qpx only wr_id (the ring entry) and the sges are used */
+        std::vector<ibv_send_wr> wrs;
+        std::vector<ibv_sge> sges;
+        size_t chain;
+        /* rings in post order: post time and op type of every request */
+        std::vector<uint64_t> in_flight_times;
+        std::vector<uint32_t> in_flight_types;
+        /* -replay only */
+        std::vector<uint32_t> in_flight_sizes;
+        /* NIC clock at post, only with nic_timestamps. The clock is read
+         * once per pass of the posting loop, at its first doorbell. */
+        std::vector<uint64_t> nic_post_times;
+        uint64_t nic_clock;
+        uint64_t nic_clock_pass;
+        /* -verify only */
+        std::vector<VerifyOp> in_flight_verify;
+        /* -reg_cache: the chunk an op pins, RegistrationCache::none = none */
+        std::vector<size_t> in_flight_chunks;
+        size_t times_index;
+        size_t retire_index;
+        /* -app: the op of every ring entry. Entries retire out of order
+         * then and are handed out from free_slots. The verbs that follow
+         * up on the completions of a poll are chained and posted with one
+         * doorbell. */
+        std::vector<AppOp> app_ops;
+        std::vector<uint32_t> free_slots;
+        std::vector<ibv_send_wr> next_wrs;
+        std::vector<ibv_sge> next_sges;
+        size_t next_chain;
+        /* remote bytes per location, the node stride with -app chase */
+        uint64_t stride;
+    };
+    const AppPattern app = config.app;
+    const bool app_mode = app.kind != AppPattern::Kind::NONE;
+    const bool lock = app.kind == AppPattern::Kind::LOCK;
+    const size_t batch = config.batch;
+    std::vector<Target> targets(ntargets);
+    for (size_t i = 0; i < ntargets; i++) {
+        Target& target = targets[i];
+        target.transport = worker.transports[connection(i)].get();
+        target.server = i / nqps;
+        target.remote_addr = target.transport->server_conn_data.address;
+        target.rkey = target.transport->server_conn_data.rkey;
+        target.in_flight = 0;
+        target.sq_used = 0;
+        target.posted = 1;
+        target.qpx = target.transport->qp_ex();
+        target.wrs.resize(batch);
+        target.sges.resize(batch);
+        for (size_t j = 0; j < batch; j++) {
+            ibv_send_wr& wr = target.wrs[j];
+            ibv_sge& sge = target.sges[j];
+            wr = {};
+            ibv_mr* mr = worker.mrs[connection(i)];
+            sge.lkey = mr ? mr->lkey : 0;
+            wr.sg_list = &sge;
+            wr.num_sge = 1;
+            wr.next = j + 1 < batch ? &target.wrs[j + 1] : nullptr;
+        }
+        target.chain = 0;
+        target.in_flight_times.resize(tx_depth);
+        target.in_flight_types.resize(tx_depth);
+        target.in_flight_sizes.resize(replay ? tx_depth : 0);
+        target.nic_post_times.resize(nic_timestamps ? tx_depth : 0);
+        target.nic_clock = 0;
+        target.nic_clock_pass = 0;
+        target.in_flight_verify.resize(config.verify ? tx_depth : 0);
+        target.in_flight_chunks.assign(config.reg_cache ? tx_depth : 0,
+                                       size_t{RegistrationCache::none});
+        target.times_index = 0;
+        target.retire_index = 0;
+        target.app_ops.resize(app_mode ? tx_depth : 0);
+        target.free_slots.clear();
+        for (size_t j = app_mode ? tx_depth : 0; j-- > 0;) {
+            target.free_slots.push_back(j);
+        }
+        target.next_wrs.resize(app_mode ? tx_depth : 0);
+        target.next_sges.resize(app_mode ? tx_depth : 0);
+        for (size_t j = 0; j < target.next_wrs.size(); j++) {
+            target.next_wrs[j] = {};
+            target.next_wrs[j].sg_list = &target.next_sges[j];
+            target.next_wrs[j].num_sge = 1;
+            target.next_wrs[j].next =
+                j + 1 < tx_depth ? &target.next_wrs[j + 1] : nullptr;
+        }
+        target.next_chain = 0;
+        target.stride =
+            app.kind == AppPattern::Kind::CHASE
+                ? target.transport->server_conn_data.chase_stride
+                : aligned_size;
+    }
+
+    /* echo: one receive per outstanding request and connection, placed
+     * behind the local locations in the worker's slice. They outlive the
+     * run, so their wr_id carries the connection, not the run's index. */
+    ibv_recv_wr recv_wr = {};
+    ibv_sge recv_sge;
+    recv_sge.length = config.recv_stride;
+    recv_wr.sg_list = &recv_sge;
+    recv_wr.num_sge = 1;
+    const uint64_t recv_addr =
+        local_addr + config.nlocal_locations * aligned_size;
+    auto post_recv = [&](size_t target, uint64_t buf) {
+        int ret;
+        const size_t c = connection(target);
+        recv_wr.wr_id = (uint64_t{c} << target_shift) | buf;
+        recv_sge.addr =
+            recv_addr + (c * tx_depth + buf) * config.recv_stride;
+        recv_sge.lkey = worker.mrs[c]->lkey;
+        LOG_ERR_EXIT((ret = targets[target].transport->post_recv(&recv_wr)),
+                     ret, std::system_category());
+    };
+    /* receives stay posted across runs on the same connection */
+    for (size_t i = 0; echo && i < ntargets; i++) {
+        size_t& posted_recvs = worker.posted_recvs[connection(i)];
+        for (; posted_recvs < tx_depth; posted_recvs++) {
+            post_recv(i, posted_recvs);
+        }
+    }
+
+    /* the CQs to poll, fewer than targets when they are shared */
+    std::vector<Transport*> cqs;
+    for (auto& target : targets) {
+        if (!target.transport->shares_cq) {
+            cqs.push_back(target.transport);
+        }
+    }
+
+    uint64_t operations = 0;
+    uint64_t type_operations[max_op_types] = {};
+    uint64_t server_operations[max_targets] = {};
+    uint64_t doorbells = 0;
+    uint64_t replay_bytes = 0;
+    /* wrs posted and not completed yet, over all targets */
+    uint64_t in_flight = 0;
+    const int ncqe = (sq_depth + tx_depth) * ntargets;
+    ibv_wc* wc = new ibv_wc[ncqe];
+
+    /* -verify: checked when retired, after the latency was taken. cas
+     * compares with the value last seen at its location. */
+    const bool verify = config.verify;
+    uint32_t max_trace_location = 0;
+    for (size_t i = 0; verify && i < worker.trace.size(); i++) {
+        max_trace_location =
+            std::max(max_trace_location, worker.trace[i].location);
+    }
+    const size_t nverify_locations = size_t{max_trace_location} + 1;
+    std::vector<uint64_t> expected(verify ? nservers * nverify_locations : 0);
+    uint64_t write_seq = 0, cas_seq = 0;
+    uint64_t verify_checked = 0, verify_errors = 0;
+    uint64_t cas_success = 0, cas_failure = 0;
+    /* counted when posted, the unsignaled ones left at the end of the run
+     * are never retired but still executed */
+    uint64_t verify_fadds[max_targets] = {};
+    auto publish_verify = [&]() {
+        stats.verify_checked.store(verify_checked, std::memory_order_relaxed);
+        stats.verify_errors.store(verify_errors, std::memory_order_relaxed);
+        stats.cas_success.store(cas_success, std::memory_order_relaxed);
+        stats.cas_failure.store(cas_failure, std::memory_order_relaxed);
+        for (size_t t = 0; t < nservers; t++) {
+            stats.verify_fadds[t].store(verify_fadds[t],
+                                        std::memory_order_relaxed);
+        }
+    };
+    auto check = [&](const Target& target, const VerifyOp& op,
+                     ibv_wr_opcode opcode) {
+        switch (opcode) {
+        case IBV_WR_RDMA_READ: {
+            VerifyStamp stamp;
+            verify_checked++;
+            if (!check_stamp(op.result, op.location, stamp) &&
+                verify_errors++ < max_verify_reports) {
+                std::cerr << "verify: " << config.servers[target.server]
+                          << " location " << op.location
+                          << ": bad stamp (client = " << stamp.client
+                          << " seq = " << stamp.seq
+                          << " checksum = " << stamp.checksum << ")\n";
+            }
+            break;
+        }
+        case IBV_WR_ATOMIC_CMP_AND_SWP: {
+            uint64_t old;
+            std::memcpy(&old, reinterpret_cast<const void*>(op.result),
+                        sizeof(old));
+            uint64_t& value =
+                expected[target.server * nverify_locations + op.location];
+            if (old == op.compare) {
+                cas_success++;
+                value = op.swap;
+            } else {
+                cas_failure++;
+                value = old;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    };
+
+    /* -app: every verb of an op is signaled and lands in the op's result
+     * slot, the next one is built from what the last one returned */
+    uint64_t app_wrs = 0, lock_failures = 0, lock_max_attempts = 0,
+             lock_errors = 0;
+    auto publish_app = [&]() {
+        stats.app_wrs.store(app_wrs, std::memory_order_relaxed);
+        stats.lock_failures.store(lock_failures, std::memory_order_relaxed);
+        stats.lock_max_attempts.store(lock_max_attempts,
+                                      std::memory_order_relaxed);
+        stats.lock_errors.store(lock_errors, std::memory_order_relaxed);
+    };
+    auto result_slot = [&](size_t t, size_t index) {
+        return worker.results + (t * tx_depth + index) * aligned_size;
+    };
+    /* the next verb of the op in ring entry index of target t */
+    auto build_app = [&](ibv_send_wr& wr, ibv_sge& sge, size_t t,
+                         size_t index) {
+        const Target& target = targets[t];
+        const AppOp& op = target.app_ops[index];
+        wr.wr_id = (uint64_t{t} << target_shift) | index;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        sge.addr = result_slot(t, index);
+        sge.lkey = worker.mrs[connection(t)]->lkey;
+        if (lock && (op.step == 0 || op.step > app.n)) {
+            /* acquire: 0 -> owner, release: owner -> 0 */
+            const bool acquire = op.step == 0;
+            wr.opcode = IBV_WR_ATOMIC_CMP_AND_SWP;
+            sge.length = 8;
+            wr.wr.atomic.remote_addr = op.remote;
+            wr.wr.atomic.rkey = target.rkey;
+            wr.wr.atomic.compare_add = acquire ? 0 : op.owner;
+            wr.wr.atomic.swap = acquire ? op.owner : 0;
+        } else {
+            wr.opcode = IBV_WR_RDMA_READ;
+            sge.length = config.size.value;
+            wr.wr.rdma.remote_addr = op.remote;
+            wr.wr.rdma.rkey = target.rkey;
+        }
+    };
+    /* targets with follow-up verbs to post */
+    std::vector<Target*> next_pending;
+    next_pending.reserve(ntargets);
+    /* Advances the op of ring entry index once its verb completed. True
+     * when the op is done, else its next verb is queued. */
+    auto step_app = [&](Target& target, size_t t, size_t index,
+                        uint64_t now) {
+        AppOp& op = target.app_ops[index];
+        uint64_t value;
+        std::memcpy(&value,
+                    reinterpret_cast<const void*>(result_slot(t, index)),
+                    sizeof(value));
+        if (lock) {
+            if (op.step == 0) {
+                if (value) {
+                    /* held by someone else, spin */
+                    lock_failures++;
+                    op.attempts++;
+                } else {
+                    lock_max_attempts =
+                        std::max<uint64_t>(lock_max_attempts, op.attempts);
+                    if (type == Type::LAT) {
+                        stats.lock_acquire.record(
+                            now - target.in_flight_times[index]);
+                    }
+                    op.step = 1;
+                }
+            } else if (op.step <= app.n) {
+                op.step++;
+            } else {
+                /* released, it has to have been ours up to here */
+                if (value != op.owner) {
+                    lock_errors++;
+                }
+                return true;
+            }
+        } else {
+            /* the offset of the next node, anything else means the
+             * chain was overwritten */
+            LOG_ERR_EXIT(value % target.stride ||
+                             value + target.stride >
+                                 target.transport->server_conn_data.size,
+                         EPROTO, std::system_category());
+            if (++op.step == app.n) {
+                return true;
+            }
+            op.remote = target.remote_addr + value;
+        }
+        if (target.next_chain == 0) {
+            next_pending.push_back(&target);
+        }
+        const size_t j = target.next_chain++;
+        build_app(target.next_wrs[j], target.next_sges[j], t, index);
+        return false;
+    };
+    /* posts the follow-ups of a poll, one doorbell per target */
+    auto post_app = [&]() {
+        for (Target* target : next_pending) {
+            const size_t n = target->next_chain;
+            target->next_wrs[n - 1].next = nullptr;
+            int ret = target->transport->post_send(target->next_wrs.data());
+            LOG_ERR_EXIT(ret, ret, std::system_category());
+            target->next_wrs[n - 1].next =
+                n < tx_depth ? &target->next_wrs[n] : nullptr;
+            target->sq_used += n;
+            target->next_chain = 0;
+            app_wrs += n;
+            doorbells++;
+        }
+        next_pending.clear();
+    };
+
+    /* on demand registration, starts cold every run. All connections of a
+     * worker are in one domain then, so any of them can register. */
+    std::unique_ptr<RegistrationCache> reg_cache;
+    if (config.reg_cache) {
+        reg_cache.reset(new RegistrationCache(
+            *worker.transports[0], local_addr,
+            config.nlocal_locations * aligned_size, config.reg_chunk,
+            config.reg_cache, default_mr_access));
+    }
+    auto retire = [&](Target& target, size_t n) {
+        server_operations[target.server] += n;
+        while (n--) {
+            const uint32_t op_type =
+                target.in_flight_types[target.retire_index];
+            type_operations[op_type]++;
+            if (replay) {
+                replay_bytes += target.in_flight_sizes[target.retire_index];
+            }
+            if (verify) {
+                check(target, target.in_flight_verify[target.retire_index],
+                      post_types[op_type].opcode);
+            }
+            if (reg_cache) {
+                size_t& chunk = target.in_flight_chunks[target.retire_index];
+                if (chunk != RegistrationCache::none) {
+                    reg_cache->unpin(chunk);
+                    chunk = RegistrationCache::none;
+                }
+            }
+            if (++target.retire_index == tx_depth) {
+                target.retire_index = 0;
+            }
+        }
+    };
+    std::vector<uint64_t> nic_completion_times(nic_timestamps ? ncqe : 0);
+    uint64_t* const nic_ts =
+        nic_timestamps ? nic_completion_times.data() : nullptr;
+    /* now: when the batch of completions was polled */
+    auto record_latency = [&](size_t t, size_t index, int i, uint64_t now) {
+        const Target& target = targets[t];
+        const uint64_t latency = now - target.in_flight_times[index];
+        stats.latency[target.in_flight_types[index]].record(latency);
+        if (nservers > 1) {
+            stats.target_latency[target.server].record(latency);
+        }
+        if (nic_timestamps) {
+            uint64_t cycles = (nic_ts[i] - target.nic_post_times[index]) &
+                              target.transport->timestamp_mask;
+            stats.nic_latency.record(cycles *
+                                     target.transport->ns_per_cycle);
+        }
+    };
+    auto poll = [&]() {
+        int polled = 0;
+        for (Transport* cq : cqs) {
+            int n = cq->poll_cq(ncqe - polled, wc + polled,
+                                nic_ts ? nic_ts + polled : nullptr);
+            LOG_ERR_EXIT(n < 0, errno, std::system_category());
+            polled += n;
+        }
+        return polled;
+    };
+    /* Nothing polled: spin (hybrid) and then block on a completion event
+     * until the deadline (ns). Returns what was polled afterwards. The
+     * CQs of a worker share one completion channel where they are on the
+     * same device, else only the first one wakes the wait early. */
+    auto wait = [&](uint64_t deadline) {
+        int polled;
+        uint64_t now = now_ns();
+        if (config.completion == CompletionMode::HYBRID) {
+            const uint64_t spin_end = std::min(now + config.spin_ns, deadline);
+            do {
+                if ((polled = poll())) {
+                    return polled;
+                }
+            } while ((now = now_ns()) < spin_end);
+        }
+        if (deadline <= now) {
+            return poll();
+        }
+        for (Transport* cq : cqs) {
+            int ret;
+            LOG_ERR_EXIT((ret = cq->req_notify_cq()), ret,
+                         std::system_category());
+        }
+        /* a completion may have arrived before the CQs were armed */
+        if ((polled = poll())) {
+            return polled;
+        }
+        const uint64_t timeout = deadline - now;
+        timespec ts = {static_cast<time_t>(timeout / 1000000000),
+                       static_cast<long>(timeout % 1000000000)};
+        LOG_ERR_EXIT(cqs[0]->wait_cq_event(&ts) < 0, errno,
+                     std::system_category());
+        return poll();
+    };
+    size_t flushed = 0;
+    auto complete = [&](int polled) {
+        const uint64_t now = polled && type == Type::LAT ? now_ns() : 0;
+        for (int i = 0; i < polled; i++) {
+            LOG_ERR_EXIT(wc[i].status != IBV_WC_SUCCESS, wc[i].status,
+                         ibv_wc_error_category());
+            if (wc[i].wr_id & flush_wr_id) {
+                flushed++;
+                continue;
+            }
+            size_t t = wc[i].wr_id >> target_shift;
+            const size_t index = wc[i].wr_id & index_mask;
+            if (wc[i].opcode == IBV_WC_RECV) {
+                t = (t / worker.qps) * nqps + t % worker.qps;
+            }
+            Target& target = targets[t];
+            if (app_mode) {
+                target.sq_used--;
+                if (!step_app(target, t, index, now)) {
+                    continue;
+                }
+                target.in_flight--;
+                in_flight--;
+                if (type == Type::LAT) {
+                    record_latency(t, index, i, now);
+                }
+                operations++;
+                server_operations[target.server]++;
+                type_operations[target.in_flight_types[index]]++;
+                target.free_slots.push_back(index);
+                continue;
+            }
+            if (echo) {
+                if (wc[i].opcode != IBV_WC_RECV) {
+                    /* frees send queue slots only, the reply completes */
+                    target.sq_used -= cq_mod;
+                    continue;
+                }
+                /* replies of one QP arrive in request order */
+                post_recv(t, index);
+                target.in_flight--;
+                in_flight--;
+                if (type == Type::LAT) {
+                    record_latency(t, target.retire_index, i, now);
+                }
+                operations++;
+                retire(target, 1);
+                continue;
+            }
+            target.in_flight -= cq_mod;
+            in_flight -= cq_mod;
+            target.sq_used -= cq_mod;
+            if (type == Type::LAT) {
+                record_latency(t, index, i, now);
+            }
+            operations += cq_mod;
+            retire(target, cq_mod);
+        }
+        if (!next_pending.empty()) {
+            post_app();
+        }
+    };
+    /* passes of the posting loop, from 1 */
+    uint64_t pass = 0;
+    /* posts the chain built up for a server with one doorbell */
+    auto ring = [&](Target& target) {
+        const size_t n = target.chain;
+        if (type == Type::LAT && !open_loop) {
+            /* the whole chain leaves with the doorbell below */
+            uint64_t t = now_ns();
+            for (size_t j = 0; j < n; j++) {
+                target.in_flight_times[target.wrs[j].wr_id & index_mask] = t;
+            }
+        }
+        if (nic_timestamps) {
+            /* actual post, also in open loop. Reading the clock is a
+             * query to the device, so later doorbells of the same pass
+             * reuse the first one's: less than a pass too early. */
+            if (target.nic_clock_pass != pass) {
+                int ret = target.transport->read_clock(target.nic_clock);
+                LOG_ERR_EXIT(ret, ret, std::system_category());
+                target.nic_clock_pass = pass;
+            }
+            for (size_t j = 0; j < n; j++) {
+                target.nic_post_times[target.wrs[j].wr_id & index_mask] =
+                    target.nic_clock;
+            }
+        }
+        int ret;
+        if (target.qpx) {
+            ret = ibv_wr_complete(target.qpx);
+        } else {
+            target.wrs[n - 1].next = nullptr;
+            ret = target.transport->post_send(target.wrs.data());
+            target.wrs[n - 1].next = n < batch ? &target.wrs[n] : nullptr;
+        }
+        LOG_ERR_EXIT(ret, ret, std::system_category());
+        target.in_flight += n;
+        in_flight += n;
+        target.sq_used += n;
+        target.chain = 0;
+        doorbells++;
+    };
+    /* targets with a chain that still has to be posted */
+    std::vector<Target*> pending;
+    pending.reserve(ntargets);
+    /* next connection of each server */
+    size_t next_qp[max_targets] = {};
+    while (!done.load(std::memory_order_relaxed)) {
+        pass++;
+
+        /* 1. post the trace in order: an op whose server is out of send
+         * queue holds back the ones behind it, like a stalled destination
+         * holds back an application */
+        const uint64_t now = open_loop ? now_ns() - start_ns : 0;
+        for (;;) {
+            if (open_loop && next_intended > now) {
+                break;
+            }
+            WorkloadOp op;
+            const TraceRecord* record = nullptr;
+            if (replay) {
+                record = records + record_index;
+                const bool fits = valid_record(*record, replay_limit);
+                if (!fits) {
+                    std::cerr << "replay: record " << record_index
+                              << " is not a valid op on the server's "
+                              << replay_limit << " bytes\n";
+                }
+                LOG_ERR_EXIT(!fits, ERANGE, std::system_category());
+                op = {0, replay_types[record->op], 0};
+            } else {
+                op = *trace_op;
+            }
+            const size_t t = op.target * nqps + next_qp[op.target];
+            Target& target = targets[t];
+            if (target.in_flight + target.chain == tx_depth ||
+                target.sq_used + target.chain == sq_depth) {
+                break;
+            }
+            if (nqps > 1 && ++next_qp[op.target] == nqps) {
+                next_qp[op.target] = 0;
+            }
+            /* ring entry of the op, -app ops retire out of order */
+            size_t index = target.times_index;
+            if (app_mode) {
+                index = target.free_slots.back();
+                target.free_slots.pop_back();
+            } else if (++target.times_index == tx_depth) {
+                target.times_index = 0;
+            }
+            if (open_loop) {
+                target.in_flight_times[index] =
+                    start_ns + static_cast<uint64_t>(next_intended);
+            }
+            if (replay) {
+                target.in_flight_sizes[index] = record->size;
+                next_record();
+            } else {
+                if (open_loop) {
+                    next_intended += gaps[gap_index];
+                    if (++gap_index == gaps.size()) {
+                        gap_index = 0;
+                    }
+                }
+                if (++trace_op == trace_end) {
+                    trace_op = trace_begin;
+                }
+            }
+            ibv_send_wr& wr = target.wrs[target.chain];
+            ibv_sge& sge = target.sges[target.chain];
+            const PostType& post_type = post_types[op.type];
+            sge.length = record ? record->size : post_type.length;
+            /* a record inlines whatever fits, not only the largest size */
+            unsigned send_flags = post_type.send_flags;
+            if (record && post_type.opcode == IBV_WR_RDMA_WRITE &&
+                record->size <= config.inline_data) {
+                send_flags |= IBV_SEND_INLINE;
+            }
+            /* local location */
+            sge.addr = local_addr;
+            if (local_locations) {
+                sge.addr += op.location * aligned_size;
+            }
+            /* -verify: writes carry a stamp, everything else lands in the
+             * result slot of its ring entry */
+            VerifyOp* verify_op = nullptr;
+            if (verify) {
+                verify_op = &target.in_flight_verify[index];
+                verify_op->location = op.location;
+                if (post_type.opcode == IBV_WR_RDMA_WRITE) {
+                    write_stamp(sge.addr, worker.client_id, ++write_seq,
+                                op.location);
+                } else {
+                    if (post_type.opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) {
+                        verify_fadds[op.target]++;
+                    }
+                    verify_op->result = result_slot(t, index);
+                    sge.addr = verify_op->result;
+                    sge.lkey = worker.mrs[connection(t)]->lkey;
+                }
+            }
+            if (reg_cache && !app_mode &&
+                !(send_flags & IBV_SEND_INLINE) &&
+                !(verify && post_type.opcode != IBV_WR_RDMA_WRITE)) {
+                size_t& chunk = target.in_flight_chunks[index];
+                chunk = reg_cache->chunk(sge.addr);
+                sge.lkey = reg_cache->pin(chunk);
+            }
+            /* remote location */
+            uint64_t remote_addr =
+                target.remote_addr +
+                (record ? record->offset : target.stride * op.location);
+            uint64_t compare_add = 1, swap = 1;
+            if (verify && post_type.opcode == IBV_WR_ATOMIC_CMP_AND_SWP) {
+                verify_op->compare =
+                    expected[op.target * nverify_locations + op.location];
+                verify_op->swap = (uint64_t{worker.client_id} << 32) |
+                                  static_cast<uint32_t>(++cas_seq);
+                compare_add = verify_op->compare;
+                swap = verify_op->swap;
+            }
+            if (target.posted % cq_mod == 0) {
+                send_flags |= IBV_SEND_SIGNALED;
+            }
+            wr.wr_id = (uint64_t{t} << target_shift) | index;
+            if (target.qpx && target.chain == 0) {
+                ibv_wr_start(target.qpx);
+            }
+            if (app_mode) {
+                /* the first verb of the op, the others follow its
+                 * completions */
+                AppOp& app_op = target.app_ops[index];
+                app_op.remote = remote_addr;
+                app_op.owner = (uint64_t{worker.client_id} << 32) |
+                               (t * tx_depth + index + 1);
+                app_op.step = 0;
+                app_op.attempts = 1;
+                build_app(wr, sge, t, index);
+                app_wrs++;
+                if (target.qpx) {
+                    add_wr_ex(target.qpx, wr);
+                }
+            } else if (target.qpx) {
+                add_wr_ex(target.qpx, wr.wr_id, send_flags, post_type.opcode,
+                          target.rkey, remote_addr, compare_add, swap, &sge);
+            } else {
+                wr.opcode = post_type.opcode;
+                if (post_type.atomic) {
+                    wr.wr.atomic.remote_addr = remote_addr;
+                    wr.wr.atomic.rkey = target.rkey;
+                    wr.wr.atomic.compare_add = compare_add;
+                    wr.wr.atomic.swap = swap;
+                } else {
+                    wr.wr.rdma.remote_addr = remote_addr;
+                    wr.wr.rdma.rkey = target.rkey;
+                }
+                wr.send_flags = send_flags;
+            }
+            target.in_flight_types[index] = op.type;
+            target.posted++;
+            if (target.chain++ == 0) {
+                pending.push_back(&target);
+            }
+            if (target.chain == batch) {
+                ring(target);
+            }
+        }
+        for (Target* target : pending) {
+            if (target->chain) {
+                ring(*target);
+            }
+        }
+        pending.clear();
+        stats.doorbells.store(doorbells, std::memory_order_relaxed);
+        if (open_loop) {
+            uint64_t backlog =
+                next_intended <= now
+                    ? static_cast<uint64_t>((now - next_intended) / mean_gap) +
+                          1
+                    : 0;
+            stats.backlog.store(backlog, std::memory_order_relaxed);
+            if (backlog > max_backlog) {
+                max_backlog = backlog;
+                stats.max_backlog.store(max_backlog,
+                                        std::memory_order_relaxed);
+            }
+        }
+
+        /* 2. poll, open loop must get back to posting on schedule */
+        int polled = poll();
+        if (config.completion == CompletionMode::BUSY) {
+            while (polled == 0 && !open_loop &&
+                   !done.load(std::memory_order_relaxed)) {
+                polled = poll();
+            }
+        } else if (polled == 0) {
+            polled = wait(
+                open_loop ? start_ns + static_cast<uint64_t>(next_intended)
+                          : now_ns() + event_timeout_ns);
+        }
+        complete(polled);
+        /* single writer: a plain store is enough, no lock prefix */
+        stats.operations.store(operations, std::memory_order_relaxed);
+        stats.in_flight.store(in_flight, std::memory_order_relaxed);
+        for (size_t t = 0; t < ntypes; t++) {
+            stats.type_operations[t].store(type_operations[t],
+                                           std::memory_order_relaxed);
+        }
+        for (size_t t = 0; nservers > 1 && t < nservers; t++) {
+            stats.target_operations[t].store(server_operations[t],
+                                             std::memory_order_relaxed);
+        }
+        if (replay) {
+            stats.replay_bytes.store(replay_bytes, std::memory_order_relaxed);
+        }
+        if (verify) {
+            publish_verify();
+        }
+        if (app_mode) {
+            publish_app();
+        }
+        if (reg_cache) {
+            stats.reg_hits.store(reg_cache->hits(), std::memory_order_relaxed);
+            stats.reg_misses.store(reg_cache->misses(),
+                                   std::memory_order_relaxed);
+            stats.reg_evictions.store(reg_cache->evictions(),
+                                      std::memory_order_relaxed);
+        }
+    }
+
+    /* Leave the QPs idle so the connections can be reused by another run:
+     * wait for outstanding replies and -app ops (no lock stays held), then
+     * post a signaled empty write to each. It completes after everything
+     * posted before it on its QP, including unsignaled wrs that would
+     * otherwise still hold send queue slots. UD has no writes, but every
+     * send is signaled there, so it is enough to wait for the send queue
+     * to run empty. */
+    const bool ud = config.qp_type == QpType::UD;
+    for (size_t t = 0; t < ntargets; t++) {
+        Target& target = targets[t];
+        while (((echo || app_mode) && target.in_flight) ||
+               (ud ? target.sq_used > 0 : target.sq_used == sq_depth)) {
+            complete(poll());
+        }
+        if (ud) {
+            flushed++;
+            continue;
+        }
+        ibv_send_wr flush_wr = {};
+        flush_wr.wr_id = flush_wr_id | t;
+        flush_wr.opcode = IBV_WR_RDMA_WRITE;
+        flush_wr.send_flags = IBV_SEND_SIGNALED;
+        flush_wr.wr.rdma.remote_addr = target.remote_addr;
+        flush_wr.wr.rdma.rkey = target.rkey;
+        int ret = target.transport->post_send(&flush_wr);
+        LOG_ERR_EXIT(ret, ret, std::system_category());
+    }
+    while (flushed < ntargets) {
+        complete(poll());
+    }
+    delete[] wc;
+    if (verify) {
+        publish_verify();
+    }
+    if (app_mode) {
+        publish_app();
+    }
+
+    rusage usage;
+    LOG_ERR_EXIT(getrusage(RUSAGE_THREAD, &usage), errno,
+                 std::system_category());
+    stats.cpu_ns.store((usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+                               1000000000ull +
+                           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) *
+                               1000ull,
+                       std::memory_order_relaxed);
+}
+
+/* One thread per worker, pinned round robin to config.cpus */
+std::vector<std::thread> start_workers(std::vector<Worker>& workers,
+                                       WorkerStats* stats,
+                                       const ClientConfig& config,
+                                       const std::atomic<bool>& done) {
+    std::vector<std::thread> worker_threads;
+    for (size_t t = 0; t < workers.size(); t++) {
+        worker_threads.emplace_back(run_worker, std::ref(workers[t]),
+                                    std::ref(stats[t]), std::cref(config),
+                                    std::cref(done));
+        if (!config.cpus.empty()) {
+            int ret = pin_thread(worker_threads.back(),
+                                 config.cpus[t % config.cpus.size()]);
+            LOG_ERR_EXIT(ret, ret, std::system_category());
+        }
+    }
+    return worker_threads;
+}
+
+/* The ops a worker cycles through, sharded over the servers. uniform/seq:
+ * one pass over all locations, skewed ones need enough samples to show the
+ * skew, mixes enough ops to show the weights (unless -trace_len). */
+std::vector<WorkloadOp> make_trace(const ClientConfig& config,
+                                   ShardPolicy shard, uint32_t seed) {
+    const ssize_t locations = config.locations;
+    size_t trace_len = config.trace_len;
+    if (!trace_len) {
+        if (locations > 0 &&
+            (config.distribution.kind == Distribution::Kind::ZIPF ||
+             config.distribution.kind == Distribution::Kind::HOTSPOT)) {
+            trace_len = std::max<size_t>(config.nlocal_locations, 1 << 20);
+        } else {
+            trace_len = config.nlocal_locations;
+        }
+        if (config.mix.types.size() > 1) {
+            trace_len = std::max<size_t>(trace_len, 1 << 16);
+        }
+    }
+    std::vector<WorkloadOp> trace =
+        generate_trace(config.distribution, config.nlocal_locations,
+                       config.mix, trace_len, seed);
+    if (locations <= 0) {
+        for (auto& op : trace) {
+            op.location = -locations;
+        }
+    }
+    const size_t max_location = locations <= 0 ? (-locations + 1) : locations;
+    shard_trace(trace, shard, max_location, config.servers.size());
+    return trace;
+}
+
+struct SweepConfig {
+    ValueList sizes;
+    ValueList tx_depths;
+    ValueList cq_mods;
+    ValueList inline_data;
+    /* connections per server and worker, at most the connected ones */
+    ValueList qps;
+    /* per point (seconds) */
+    size_t warmup;
+    size_t window;
+};
+
+/* false for a sweep or tune point the connected QPs cannot run */
+bool valid_point(const ClientConfig& point) {
+    const size_t ntypes = point.mix.types.size();
+    const size_t size = point.size.value;
+    const bool inlinable = point.opcode == IBV_WR_RDMA_WRITE ||
+                           point.opcode == IBV_WR_SEND;
+    return point.tx_depth && point.cq_mod && point.cq_mod <= point.tx_depth &&
+           point.batch && point.batch <= point.tx_depth &&
+           !((point.qp_type == QpType::UD ||
+              point.app.kind != AppPattern::Kind::NONE) &&
+             point.cq_mod != 1) &&
+           !(point.verify && ntypes == 1 && !is_atomic(point.opcode) &&
+             size < verify_stamp_size) &&
+           !(ntypes == 1 && is_atomic(point.opcode) &&
+             point.app.kind != AppPattern::Kind::LOCK && size != 8) &&
+           !(ntypes == 1 && point.inline_data &&
+             (point.inline_data < size || !inlinable));
+}
+
+/* What a sweep or tune point did in its measurement window, over all
+ * threads and op types */
+struct PointResult {
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t cpu_ns;
+    double seconds;
+    /* -t lat only */
+    HistogramSnapshot latency;
+
+    uint64_t rate() const { return static_cast<uint64_t>(ops / seconds); }
+};
+
+/* Runs point on the connected workers for warmup seconds and then for
+ * the window that is measured */
+PointResult measure_point(std::vector<Worker>& workers,
+                          const ClientConfig& point, size_t warmup,
+                          size_t window) {
+    using namespace std::chrono;
+    const size_t nthreads = workers.size();
+    const size_t ntypes = point.mix.types.size();
+    std::unique_ptr<WorkerStats[]> stats(new WorkerStats[nthreads]);
+    std::atomic<bool> done{false};
+    std::vector<std::thread> worker_threads =
+        start_workers(workers, stats.get(), point, done);
+
+    auto sample = [&](PointResult& result) {
+        HistogramSnapshot thread_latency;
+        result.ops = result.bytes = result.cpu_ns = 0;
+        result.latency.clear();
+        for (size_t t = 0; t < nthreads; t++) {
+            result.cpu_ns += thread_cpu_ns(worker_threads[t]);
+            for (size_t i = 0; i < ntypes; i++) {
+                uint64_t n = stats[t].type_operations[i].load(
+                    std::memory_order_relaxed);
+                result.ops += n;
+                result.bytes += n * point.mix.types[i].size;
+                if (point.type == Type::LAT) {
+                    stats[t].latency[i].snapshot(thread_latency);
+                    result.latency += thread_latency;
+                }
+            }
+        }
+    };
+    PointResult begin, end;
+    std::this_thread::sleep_for(seconds(warmup));
+    auto begin_time = steady_clock::now();
+    sample(begin);
+    std::this_thread::sleep_for(seconds(window));
+    sample(end);
+    auto end_time = steady_clock::now();
+    done = true;
+    for (auto& worker_thread : worker_threads) {
+        worker_thread.join();
+    }
+    end.ops -= begin.ops;
+    end.bytes -= begin.bytes;
+    end.cpu_ns -= begin.cpu_ns;
+    end.latency.subtract(begin.latency);
+    end.seconds =
+        duration_cast<duration<double>>(end_time - begin_time).count();
+    return end;
+}
+
+/* cycles/op column, - without ops or a cycle rate */
+void print_cycles(std::ostream& out, const PointResult& result) {
+    if (result.ops && cycles_per_ns() > 0.0) {
+        out << std::setw(12)
+            << static_cast<uint64_t>(result.cpu_ns * cycles_per_ns() /
+                                     result.ops);
+    } else {
+        out << std::setw(12) << "-";
+    }
+}
+
+/* Runs every valid point of the cartesian product on the connected
+ * workers and prints one row per point. config carries the largest size,
+ * tx depth, inline size and connection count the QPs and MRs were created
+ * for, so locations keep the stride of the largest size throughout. */
+void run_sweep(std::vector<Worker>& workers, const ClientConfig& config,
+               const SweepConfig& sweep) {
+    using namespace std::chrono;
+    const size_t ntypes = config.mix.types.size();
+
+    std::vector<ClientConfig> points;
+    size_t skipped = 0;
+    for (size_t size : sweep.sizes.values) {
+        for (size_t tx_depth : sweep.tx_depths.values) {
+            for (size_t cq_mod : sweep.cq_mods.values) {
+                for (size_t inline_data : sweep.inline_data.values) {
+                    ClientConfig point = config;
+                    point.tx_depth = tx_depth;
+                    point.cq_mod = cq_mod;
+                    point.inline_data = inline_data;
+                    point.batch = std::min(config.batch, tx_depth);
+                    /* a mix keeps its own sizes, no -sweep_s then */
+                    if (ntypes == 1) {
+                        point.size.value = size;
+                        point.mix.types[0].size = size;
+                    }
+                    if (!valid_point(point)) {
+                        skipped++;
+                        continue;
+                    }
+                    points.push_back(point);
+                }
+            }
+        }
+    }
+    /* the connection count varies fastest, so consecutive rows show how
+     * a point scales with the number of QPs */
+    std::vector<ClientConfig> qps_points;
+    for (auto& point : points) {
+        for (size_t qps : sweep.qps.values) {
+            if (!qps) {
+                skipped++;
+                continue;
+            }
+            qps_points.push_back(point);
+            qps_points.back().qps = qps;
+        }
+    }
+    points.swap(qps_points);
+    std::cout << "sweep: " << points.size() << " points";
+    if (skipped) {
+        std::cout << " (" << skipped << " invalid combinations skipped)";
+    }
+    std::cout << ", " << sweep.warmup << "s warmup + " << sweep.window
+              << "s per point\n";
+
+    const char* const columns[] = {"size",      "tx",      "cq_mod",
+                                   "inline",    "qps",     "ops/sec",
+                                   "MB/s",      "p50(ns)", "p99(ns)",
+                                   "p99.9(ns)", "max(ns)", "cycles/op"};
+    for (auto column : columns) {
+        std::cout << std::setw(12) << column;
+    }
+    std::cout << '\n';
+
+    for (auto& point : points) {
+        const PointResult result =
+            measure_point(workers, point, sweep.warmup, sweep.window);
+        std::cout << std::setw(12) << point.size << std::setw(12)
+                  << point.tx_depth << std::setw(12) << point.cq_mod
+                  << std::setw(12) << point.inline_data << std::setw(12)
+                  << point.qps << std::setw(12) << result.rate()
+                  << std::setw(12) << std::fixed << std::setprecision(1)
+                  << result.bytes / result.seconds / 1e6;
+        if (point.type == Type::LAT) {
+            std::cout << std::setw(12) << result.latency.percentile(50.0)
+                      << std::setw(12) << result.latency.percentile(99.0)
+                      << std::setw(12) << result.latency.percentile(99.9)
+                      << std::setw(12) << result.latency.max();
+        } else {
+            for (size_t i = 0; i < 4; i++) {
+                std::cout << std::setw(12) << "-";
+            }
+        }
+        print_cycles(std::cout, result);
+        std::cout << std::endl;
+    }
+}
+
+/* Hill climbing for -tune over tx depth, cq_mod and batch in powers of
+ * two and the inline sizes that make a difference: off, or each size of
+ * an inlinable op of the mix (and -i) up to what every connected QP can
+ * inline. It starts from a depth the device suggests
+ * (max_qp_rd_atom for reads and atomics, which a QP cannot have more of in
+ * flight), every step measures the neighbours of the current point (one
+ * knob one step up or down) and moves to the best one that beats it by
+ * tune_margin. Every point is measured once. config carries the largest tx
+ * depth the QPs were created with. At the end it
+ * prints the frontier of everything it measured: ops/sec against p99
+ * (-t lat) or against tx depth, and the best point for the goal. */
+void run_tune(std::vector<Worker>& workers, const ClientConfig& config,
+              const TuneGoal& goal, size_t warmup, size_t window) {
+    const Transport& transport = *workers[0].transports[0];
+    const bool lat = config.type == Type::LAT;
+    unsigned max_tx = 63 - __builtin_clzll(config.tx_depth);
+    unsigned start_tx = std::min(4u, max_tx);
+    std::string device;
+    ibv_device_attr dev_attr;
+    if (transport.query_device(device, dev_attr)) {
+        std::cout << "tune: " << device
+                  << " max_qp_wr = " << dev_attr.max_qp_wr
+                  << " max_qp_rd_atom = " << dev_attr.max_qp_rd_atom;
+        max_tx = std::min<unsigned>(
+            max_tx, 63 - __builtin_clzll(std::max(dev_attr.max_qp_wr, 1)));
+        bool reads = false;
+        for (auto& op_type : config.mix.types) {
+            reads |= op_type.opcode == IBV_WR_RDMA_READ ||
+                     is_atomic(op_type.opcode);
+        }
+        if (reads && dev_attr.max_qp_rd_atom > 0) {
+            start_tx = std::min<unsigned>(
+                max_tx, 63 - __builtin_clzll(dev_attr.max_qp_rd_atom));
+        }
+    } else {
+        std::cout << "tune: " << config.transport;
+    }
+    size_t max_inline = SIZE_MAX;
+    for (auto& worker : workers) {
+        for (auto& t : worker.transports) {
+            max_inline = std::min(max_inline, t->max_inline);
+        }
+    }
+    std::vector<size_t> inline_sizes = {0};
+    for (auto& op_type : config.mix.types) {
+        if (op_type.opcode == IBV_WR_RDMA_WRITE ||
+            op_type.opcode == IBV_WR_SEND) {
+            inline_sizes.push_back(op_type.size);
+        }
+    }
+    inline_sizes.push_back(config.inline_data);
+    std::sort(inline_sizes.begin(), inline_sizes.end());
+    inline_sizes.erase(std::unique(inline_sizes.begin(), inline_sizes.end()),
+                       inline_sizes.end());
+    inline_sizes.erase(std::upper_bound(inline_sizes.begin(),
+                                        inline_sizes.end(), max_inline),
+                       inline_sizes.end());
+    std::cout << " max inline = ";
+    if (max_inline == SIZE_MAX) {
+        std::cout << "unlimited\n";
+    } else {
+        std::cout << max_inline << "\n";
+    }
+    std::cout << "tune: goal " << goal << ", tx <= " << (size_t{1} << max_tx)
+              << ", inline ";
+    for (size_t i = 0; i < inline_sizes.size(); i++) {
+        std::cout << (i ? "," : "") << inline_sizes[i];
+    }
+    std::cout << ", " << warmup << "s warmup + " << window
+              << "s per point\n";
+
+    /* tx, cq_mod and batch as powers of two, an index into inline_sizes */
+    using Knobs = std::array<unsigned, 4>;
+    auto to_point = [&](const Knobs& knobs) {
+        ClientConfig point = config;
+        point.tx_depth = size_t{1} << knobs[0];
+        point.cq_mod = size_t{1} << knobs[1];
+        point.batch = size_t{1} << knobs[2];
+        point.inline_data = inline_sizes[knobs[3]];
+        return point;
+    };
+    auto in_range = [&](const Knobs& knobs) {
+        return knobs[0] <= max_tx && knobs[1] <= knobs[0] &&
+               knobs[2] <= knobs[0] && knobs[3] < inline_sizes.size() &&
+               valid_point(to_point(knobs));
+    };
+    /* strictly better for the goal, by at least margin */
+    auto better = [&](const PointResult& a, const PointResult& b,
+                      double margin) {
+        if (goal.kind == TuneGoal::Kind::RATE) {
+            return a.rate() > b.rate() * (1.0 + margin);
+        }
+        const bool a_meets = a.rate() >= goal.floor;
+        const bool b_meets = b.rate() >= goal.floor;
+        if (a_meets != b_meets) {
+            return a_meets;
+        }
+        if (!a_meets) {
+            return a.rate() > b.rate() * (1.0 + margin);
+        }
+        return a.latency.percentile(99.0) * (1.0 + margin) <
+               b.latency.percentile(99.0);
+    };
+
+    const char* const columns[] = {"tx",      "cq_mod",  "batch",
+                                   "inline",  "ops/sec", "MB/s",
+                                   "p50(ns)", "p99(ns)", "cycles/op"};
+    auto print_row = [&](const Knobs& knobs, const PointResult& result) {
+        const ClientConfig point = to_point(knobs);
+        std::cout << std::setw(12) << point.tx_depth << std::setw(12)
+                  << point.cq_mod << std::setw(12) << point.batch
+                  << std::setw(12) << point.inline_data << std::setw(12)
+                  << result.rate() << std::setw(12) << std::fixed
+                  << std::setprecision(1)
+                  << result.bytes / result.seconds / 1e6;
+        if (lat) {
+            std::cout << std::setw(12) << result.latency.percentile(50.0)
+                      << std::setw(12) << result.latency.percentile(99.0);
+        } else {
+            std::cout << std::setw(12) << "-" << std::setw(12) << "-";
+        }
+        print_cycles(std::cout, result);
+        std::cout << std::endl;
+    };
+    for (auto column : columns) {
+        std::cout << std::setw(12) << column;
+    }
+    std::cout << '\n';
+
+    std::map<Knobs, PointResult> trials;
+    auto measure = [&](const Knobs& knobs) -> const PointResult& {
+        auto trial = trials.find(knobs);
+        if (trial == trials.end()) {
+            trial = trials
+                        .insert({knobs, measure_point(workers, to_point(knobs),
+                                                      warmup, window)})
+                        .first;
+            print_row(knobs, trial->second);
+        }
+        return trial->second;
+    };
+
+    Knobs current = {start_tx, 0, 0, 0};
+    if (!in_range(current)) {
+        std::cout << "tune: no valid point\n";
+        return;
+    }
+    measure(current);
+    for (;;) {
+        Knobs best = current;
+        for (size_t knob = 0; knob < current.size(); knob++) {
+            for (int step : {-1, 1}) {
+                Knobs next = current;
+                if (!next[knob] && step < 0) {
+                    continue;
+                }
+                next[knob] += step;
+                if (in_range(next) &&
+                    better(measure(next), measure(best), tune_margin)) {
+                    best = next;
+                }
+            }
+        }
+        if (best == current) {
+            break;
+        }
+        current = best;
+    }
+
+    /* not beaten on ops/sec and on p99 (-t lat) or tx depth by any other */
+    std::cout << "frontier (" << trials.size() << " points measured)\n";
+    for (auto& trial : trials) {
+        const PointResult& a = trial.second;
+        bool dominated = false;
+        for (auto& other : trials) {
+            const PointResult& b = other.second;
+            const bool cheaper =
+                lat ? b.latency.percentile(99.0) <= a.latency.percentile(99.0)
+                    : other.first[0] <= trial.first[0];
+            const bool strictly =
+                b.rate() > a.rate() ||
+                (lat ? b.latency.percentile(99.0) < a.latency.percentile(99.0)
+                     : other.first[0] < trial.first[0]);
+            dominated |= &other != &trial && b.rate() >= a.rate() &&
+                         cheaper && strictly;
+        }
+        if (!dominated) {
+            print_row(trial.first, a);
+        }
+    }
+    auto best = trials.begin();
+    for (auto trial = trials.begin(); trial != trials.end(); trial++) {
+        if (better(trial->second, best->second, 0.0)) {
+            best = trial;
+        }
+    }
+    const ClientConfig point = to_point(best->first);
+    std::cout << "best\t-tx " << point.tx_depth << " -cq_mod "
+              << point.cq_mod << " -batch " << point.batch << " -i "
+              << point.inline_data << "\t" << best->second.rate()
+              << " ops/sec";
+    if (lat) {
+        std::cout << " p99 = " << best->second.latency.percentile(99.0)
+                  << "ns";
+    }
+    if (goal.kind == TuneGoal::Kind::P99 &&
+        best->second.rate() < goal.floor) {
+        std::cout << " (no point reached " << goal.floor << " ops/sec)";
+    }
+    std::cout << '\n';
+}
 
-inline std::istream& operator>>(std::istream& in, ibv_wr_opcode& op) {
-    std::string str;
-    in >> str;
-    if (boost::iequals("read", str)) {
-        op = IBV_WR_RDMA_READ;
-    } else if (boost::iequals("write", str)) {
-        op = IBV_WR_RDMA_WRITE;
-    } else if (boost::iequals("fadd", str)) {
-        op = IBV_WR_ATOMIC_FETCH_AND_ADD;
-    } else if (boost::iequals("cas", str)) {
-        op = IBV_WR_ATOMIC_CMP_AND_SWP;
-    } else if (boost::iequals("send", str)) {
-        op = IBV_WR_SEND;
-    } else {
-        in.setstate(std::ios_base::failbit);
+/* -scenario: rates over a phase or the measured ones, ops and bytes per
+ * second of wall time */
+void print_scenario_total(std::ostream& out, uint64_t ops, uint64_t bytes,
+                          uint64_t cpu_ns, uint64_t wall_ns,
+                          const HistogramSnapshot* latency) {
+    using namespace psl::terminal;
+    const double seconds = wall_ns / 1e9;
+    out << graphic_format::GREEN << graphic_format::BOLD
+        << "throughput = " << graphic_format::WHITE
+        << static_cast<uint64_t>(seconds > 0.0 ? ops / seconds : 0)
+        << " ops/sec "
+        << static_cast<uint64_t>(seconds > 0.0 ? bytes / seconds / 1e6 : 0)
+        << " MB/s" << graphic_format::RESET << " ";
+    print_cpu(out, cpu_ns, ops, wall_ns);
+    out << " (" << ops << " ops)\n";
+    if (latency) {
+        out << "\t";
+        print_latency(out, *latency);
     }
-    return in;
 }
 
-enum class Type { LAT, BW };
+/* -scenario: the config of a phase. The op, mix, size, tx depth, batch,
+ * rate, arrival and dist of the command line with the phase's settings on
+ * top, the rest (connections, stride of the locations) stays as connected.
+ * false on an unknown key or a bad value, or an op that does not fit. */
+bool phase_config(const Phase& phase, const ClientConfig& command_line,
+                  size_t nthreads, ClientConfig& config, size_t& duration) {
+    auto parse = [](const std::string& str, auto& value) {
+        std::stringstream ss(str);
+        return (ss >> value) && (ss >> std::ws).eof();
+    };
+    config.opcode = command_line.opcode;
+    config.size = command_line.size;
+    config.mix = command_line.mix;
+    config.tx_depth = command_line.tx_depth;
+    config.batch = command_line.batch;
+    config.rate = command_line.rate;
+    config.arrival = command_line.arrival;
+    config.distribution = command_line.distribution;
+    /* -op/-s make a single entry mix, like on the command line */
+    bool single = false, mixed = false;
+    for (auto& setting : phase.settings) {
+        const std::string& key = setting.first;
+        const std::string& value = setting.second;
+        bool ok;
+        if (key == "d") {
+            ok = parse(value, duration);
+        } else if (key == "op") {
+            ok = parse(value, config.opcode);
+            single = true;
+        } else if (key == "s") {
+            ok = parse(value, config.size);
+            single = true;
+        } else if (key == "mix") {
+            ok = parse(value, config.mix);
+            mixed = true;
+        } else if (key == "tx") {
+            ok = parse(value, config.tx_depth);
+        } else if (key == "batch") {
+            ok = parse(value, config.batch);
+        } else if (key == "rate") {
+            double rate;
+            ok = parse(value, rate) && rate >= 0.0;
+            config.rate = rate / nthreads;
+        } else if (key == "arrival") {
+            ok = parse(value, config.arrival);
+        } else if (key == "dist") {
+            ok = parse(value, config.distribution);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    if (mixed) {
+        if (single) {
+            return false;
+        }
+        config.opcode = config.mix.types[0].opcode;
+        config.size.value = 0;
+        for (auto& op_type : config.mix.types) {
+            config.size.value = std::max(config.size.value, op_type.size);
+        }
+    } else if (single) {
+        config.mix.types = {{config.opcode, config.size.value, 1}};
+    }
+    /* what main checks for the command line, the QPs have to be set up
+     * for send/echo in every phase or in none */
+    const bool send = command_line.opcode == IBV_WR_SEND;
+    for (auto& op_type : config.mix.types) {
+        if ((op_type.opcode == IBV_WR_SEND) != send ||
+            (is_atomic(op_type.opcode) && op_type.size != 8) ||
+            !qp_type_supports(config.qp_type, op_type.opcode) ||
+            (config.mix.types.size() == 1 && config.inline_data &&
+             (op_type.size > config.inline_data || is_atomic(op_type.opcode) ||
+              op_type.opcode == IBV_WR_RDMA_READ))) {
+            return false;
+        }
+    }
+    return duration && config.tx_depth && config.cq_mod <= config.tx_depth &&
+           config.batch && config.batch <= config.tx_depth &&
+           config.size.value <= config.aligned_size;
+}
 
-inline std::ostream& operator<<(std::ostream& out, const Type& t) {
-    out << psl::to_underlying(t);
-    return out;
+/* Runs the phases back to back on the connected workers, with a line per
+ * second, a summary per phase and one over the measured phases. Workers
+ * stop between phases, so every phase starts with an idle send queue. A
+ * phase gets a new trace when it changes the ops or their locations. */
+void run_scenario(std::vector<Worker>& workers, const ClientConfig& config,
+                  const ClientConfig& command_line,
+                  const std::vector<Phase>& phases, size_t default_duration,
+                  ShardPolicy shard) {
+    using namespace std::chrono;
+    using namespace psl::terminal;
+    const size_t nthreads = workers.size();
+    std::random_device rd;
+    std::string last_trace;
+    uint64_t measured_ops = 0, measured_bytes = 0, measured_cpu = 0,
+             measured_ns = 0;
+    size_t measured_phases = 0;
+    HistogramSnapshot measured_latency;
+
+    for (size_t p = 0; p < phases.size(); p++) {
+        const Phase& phase = phases[p];
+        ClientConfig point = config;
+        size_t duration = default_duration;
+        phase_config(phase, command_line, nthreads, point, duration);
+        const size_t ntypes = point.mix.types.size();
+        std::ostringstream trace_key;
+        trace_key << point.mix << " " << point.distribution;
+        if (trace_key.str() != last_trace) {
+            for (auto& worker : workers) {
+                worker.trace = make_trace(point, shard, rd());
+            }
+            last_trace = trace_key.str();
+        }
+        std::cout << "phase " << p + 1 << "/" << phases.size() << " "
+                  << phase.name << (phase.measured ? "" : " (warmup)")
+                  << ": " << duration << "s " << point.mix << " tx "
+                  << point.tx_depth << " " << point.distribution;
+        if (point.rate > 0.0) {
+            std::cout << " rate " << point.rate * nthreads << " "
+                      << point.arrival;
+        }
+        std::cout << '\n';
+
+        std::unique_ptr<WorkerStats[]> stats(new WorkerStats[nthreads]);
+        std::atomic<bool> done{false};
+        const uint64_t start_ns = now_ns();
+        const steady_clock::time_point start = steady_clock::now();
+        std::vector<std::thread> worker_threads =
+            start_workers(workers, stats.get(), point, done);
+
+        /* totals over all threads and op types */
+        auto sample = [&](uint64_t& ops, uint64_t& bytes, uint64_t& cpu_ns,
+                          HistogramSnapshot& latency) {
+            HistogramSnapshot thread_latency;
+            ops = bytes = cpu_ns = 0;
+            latency.clear();
+            for (size_t t = 0; t < nthreads; t++) {
+                cpu_ns += thread_cpu_ns(worker_threads[t]);
+                for (size_t i = 0; i < ntypes; i++) {
+                    uint64_t n = stats[t].type_operations[i].load(
+                        std::memory_order_relaxed);
+                    ops += n;
+                    bytes += n * point.mix.types[i].size;
+                    if (point.type == Type::LAT) {
+                        stats[t].latency[i].snapshot(thread_latency);
+                        latency += thread_latency;
+                    }
+                }
+            }
+        };
+        uint64_t last_ops = 0, last_bytes = 0, last_cpu = 0;
+        uint64_t last_tick_ns = start_ns;
+        HistogramSnapshot last_latency, latency, interval;
+        for (size_t tick = 1; tick <= duration; tick++) {
+            std::this_thread::sleep_until(start + seconds(tick));
+            uint64_t ops, bytes, cpu_ns;
+            sample(ops, bytes, cpu_ns, latency);
+            const uint64_t tick_ns = now_ns();
+            std::cout << phase.name << " " << tick << "s\t";
+            if (point.type == Type::LAT) {
+                interval = latency;
+                interval.subtract(last_latency);
+                print_latency(std::cout, interval);
+                std::cout << "\t";
+            }
+            std::cout << graphic_format::GREEN << graphic_format::BOLD
+                      << "throughput = " << graphic_format::WHITE
+                      << ops - last_ops << " ops/sec "
+                      << (bytes - last_bytes) / 1000000 << " MB/s"
+                      << graphic_format::RESET << " ";
+            print_cpu(std::cout, cpu_ns - last_cpu, ops - last_ops,
+                      tick_ns - last_tick_ns);
+            std::cout << '\n';
+            last_ops = ops;
+            last_bytes = bytes;
+            last_cpu = cpu_ns;
+            last_tick_ns = tick_ns;
+            last_latency = latency;
+        }
+        done = true;
+        for (auto& worker_thread : worker_threads) {
+            worker_thread.join();
+        }
+        const uint64_t wall_ns = now_ns() - start_ns;
+        uint64_t ops = 0, bytes = 0, cpu_ns = 0;
+        for (size_t t = 0; t < nthreads; t++) {
+            cpu_ns += stats[t].cpu_ns.load();
+            for (size_t i = 0; i < ntypes; i++) {
+                const uint64_t n = stats[t].type_operations[i].load();
+                ops += n;
+                bytes += n * point.mix.types[i].size;
+            }
+        }
+        HistogramSnapshot thread_latency;
+        latency.clear();
+        for (size_t t = 0; point.type == Type::LAT && t < nthreads; t++) {
+            for (size_t i = 0; i < ntypes; i++) {
+                stats[t].latency[i].snapshot(thread_latency);
+                latency += thread_latency;
+            }
+        }
+        std::cout << "phase\t" << phase.name << "\t";
+        print_scenario_total(std::cout, ops, bytes, cpu_ns, wall_ns,
+                             point.type == Type::LAT ? &latency : nullptr);
+        if (phase.measured) {
+            measured_phases++;
+            measured_ops += ops;
+            measured_bytes += bytes;
+            measured_cpu += cpu_ns;
+            measured_ns += wall_ns;
+            measured_latency += latency;
+        }
+    }
+    std::cout << "measured\t" << measured_phases << " phases\t";
+    print_scenario_total(std::cout, measured_ops, measured_bytes,
+                         measured_cpu, measured_ns,
+                         config.type == Type::LAT ? &measured_latency
+                                                  : nullptr);
 }
 
-inline std::istream& operator>>(std::istream& in, Type& t) {
-    std::string str;
-    in >> str;
-    if (boost::iequals("lat", str)) {
-        t = Type::LAT;
-    } else if (boost::iequals("bw", str)) {
-        t = Type::BW;
+struct RegBenchConfig {
+    ValueList sizes;
+    std::vector<PageSize> pages;
+    std::vector<MrAccess> accesses;
+    /* warm registrations per point */
+    size_t iters;
+};
+
+/* Registration cost on the device of transport, one row per size, page
+ * size and access: the first registration of a fresh mapping (cold, it
+ * faults and pins every page), then iters register/deregister pairs of
+ * the same, now resident, buffer. */
+void run_reg_bench(Transport& transport, const RegBenchConfig& bench) {
+    using namespace std::chrono;
+    const char* const columns[] = {"pages",     "access",     "size",
+                                   "cold(ns)",  "reg p50",    "reg p99",
+                                   "dereg p50", "dereg p99",  "regs/sec",
+                                   "GB/s"};
+    for (auto column : columns) {
+        std::cout << std::setw(12) << column;
     }
-    return in;
+    std::cout << '\n';
+
+    for (PageSize pages : bench.pages) {
+        for (const MrAccess& access : bench.accesses) {
+            for (size_t size : bench.sizes.values) {
+                std::cout << std::setw(12) << pages << std::setw(12)
+                          << access << std::setw(12) << size;
+                const size_t map_size = align(size, page_bytes(pages));
+                void* buffer = map_pages(map_size, pages);
+                if (buffer == MAP_FAILED) {
+                    std::cout << "  " << std::system_category().message(errno)
+                              << '\n';
+                    continue;
+                }
+                auto start = steady_clock::now();
+                ibv_mr* mr = transport.reg_mr(buffer, size, access.flags);
+                auto cold = steady_clock::now() - start;
+                if (!mr) {
+                    std::cout << "  " << std::system_category().message(errno)
+                              << '\n';
+                    munmap(buffer, map_size);
+                    continue;
+                }
+                int ret;
+                LOG_ERR_EXIT((ret = transport.dereg_mr(mr)), ret,
+                             std::system_category());
+
+                Histogram reg, dereg;
+                for (size_t i = 0; i < bench.iters; i++) {
+                    start = steady_clock::now();
+                    LOG_ERR_EXIT(
+                        !(mr = transport.reg_mr(buffer, size, access.flags)),
+                        errno, std::system_category());
+                    auto registered = steady_clock::now();
+                    LOG_ERR_EXIT((ret = transport.dereg_mr(mr)), ret,
+                                 std::system_category());
+                    auto deregistered = steady_clock::now();
+                    reg.record(
+                        duration_cast<nanoseconds>(registered - start)
+                            .count());
+                    dereg.record(duration_cast<nanoseconds>(deregistered -
+                                                            registered)
+                                     .count());
+                }
+                munmap(buffer, map_size);
+
+                HistogramSnapshot reg_snapshot, dereg_snapshot;
+                reg.snapshot(reg_snapshot);
+                dereg.snapshot(dereg_snapshot);
+                const double cycle_ns =
+                    reg_snapshot.mean() + dereg_snapshot.mean();
+                std::cout << std::setw(12)
+                          << duration_cast<nanoseconds>(cold).count()
+                          << std::setw(12) << reg_snapshot.percentile(50.0)
+                          << std::setw(12) << reg_snapshot.percentile(99.0)
+                          << std::setw(12) << dereg_snapshot.percentile(50.0)
+                          << std::setw(12) << dereg_snapshot.percentile(99.0)
+                          << std::setw(12)
+                          << static_cast<uint64_t>(1e9 /
+                                                   std::max(cycle_ns, 1.0))
+                          << std::setw(12) << std::fixed
+                          << std::setprecision(2)
+                          << size / std::max(reg_snapshot.mean(), 1.0)
+                          << std::defaultfloat << std::endl;
+            }
+        }
+    }
+}
+
+/* -verify: sum of the 8 byte counters at the marked locations (stride
+ * bytes apart) of a server, read in large one-sided reads over the
+ * worker's first connection to it. The connections are idle between
+ * runs. */
+uint64_t read_counters(Worker& worker, size_t server,
+                       const std::vector<bool>& locations, size_t stride) {
+    Transport& transport = *worker.transports[server * worker.qps];
+    Transport& cq = transport.shares_cq ? *worker.transports[0] : transport;
+    const size_t per_read = std::max<size_t>((1 << 20) / stride, 1);
+    const size_t length = std::min(per_read, locations.size()) * stride;
+    void* buffer;
+    LOG_ERR_EXIT(posix_memalign(&buffer, alloc_alignment, length), errno,
+                 std::system_category());
+    ibv_mr* mr;
+    LOG_ERR_EXIT(!(mr = transport.reg_mr(buffer, length, default_mr_access)),
+                 errno, std::system_category());
+
+    uint64_t sum = 0;
+    for (size_t first = 0; first < locations.size(); first += per_read) {
+        const size_t n = std::min(per_read, locations.size() - first);
+        if (std::none_of(locations.begin() + first,
+                         locations.begin() + first + n,
+                         [](bool b) { return b; })) {
+            continue;
+        }
+        ibv_sge sge;
+        sge.addr = reinterpret_cast<uint64_t>(buffer);
+        sge.length = n * stride;
+        sge.lkey = mr->lkey;
+        ibv_send_wr wr = {};
+        wr.wr_id = flush_wr_id;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_RDMA_READ;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.wr.rdma.remote_addr =
+            transport.server_conn_data.address + first * stride;
+        wr.wr.rdma.rkey = transport.server_conn_data.rkey;
+        int ret;
+        LOG_ERR_EXIT((ret = transport.post_send(&wr)), ret,
+                     std::system_category());
+        ibv_wc wc;
+        while ((ret = cq.poll_cq(1, &wc, nullptr)) == 0) {
+        }
+        LOG_ERR_EXIT(ret < 0, errno, std::system_category());
+        LOG_ERR_EXIT(wc.status != IBV_WC_SUCCESS, wc.status,
+                     ibv_wc_error_category());
+        for (size_t i = 0; i < n; i++) {
+            if (locations[first + i]) {
+                uint64_t counter;
+                std::memcpy(&counter, static_cast<char*>(buffer) + i * stride,
+                            sizeof(counter));
+                sum += counter;
+            }
+        }
+    }
+    transport.dereg_mr(mr);
+    free(buffer);
+    return sum;
+}
+
+/* hit rate of the registration cache over a number of lookups */
+void print_reg_cache(std::ostream& out, uint64_t hits, uint64_t misses) {
+    using namespace psl::terminal;
+    const uint64_t lookups = hits + misses;
+    out << graphic_format::GREEN << graphic_format::BOLD
+        << "reg cache hit = " << graphic_format::WHITE
+        << (lookups ? 100 * hits / lookups : 100) << "% (" << misses
+        << " misses)" << graphic_format::RESET;
+}
+
+/* -app: verbs per op and, for locks, the share of acquiring cas that
+ * found the lock held */
+void print_app(std::ostream& out, const AppPattern& app, uint64_t ops,
+               uint64_t wrs, uint64_t failures) {
+    using namespace psl::terminal;
+    std::ostringstream per_op;
+    per_op << std::fixed << std::setprecision(2)
+           << (ops ? static_cast<double>(wrs) / ops : 0.0);
+    out << graphic_format::GREEN << graphic_format::BOLD
+        << "wrs/op = " << graphic_format::WHITE << per_op.str();
+    if (app.kind == AppPattern::Kind::LOCK) {
+        const uint64_t cas = ops + failures;
+        out << graphic_format::GREEN << " cas failed = "
+            << graphic_format::WHITE << (cas ? 100 * failures / cas : 0)
+            << "%";
+    }
+    out << graphic_format::RESET;
+}
+
+/* -report: what was run, on what device (of the first connection) */
+ReportRecord run_record(const ClientConfig& config, size_t nthreads,
+                        size_t duration, const Transport& transport) {
+    ReportRecord record;
+    record.add("record", "run")
+        .add("time_ns", report_time_ns())
+        .add("transport", config.transport)
+        .add("servers", EndpointList{config.servers})
+        .add("threads", nthreads)
+        .add("qps", config.qps)
+        .add("qp", config.qp_type)
+        .add("opcode", opcode_name(config.opcode))
+        .add("mix", config.mix)
+        .add("app", config.app)
+        .add("type", config.type == Type::LAT ? "lat" : "bw")
+        .add("size", config.size.value)
+        .add("alignment", config.alignment.value)
+        .add("tx", config.tx_depth)
+        .add("cq_mod", config.cq_mod)
+        .add("inline", config.inline_data)
+        .add("batch", config.batch)
+        .add("locations", config.locations)
+        .add("dist", config.distribution)
+        .add("rate", config.rate * nthreads)
+        .add("arrival", config.arrival)
+        .add("completion", config.completion)
+        .add("xverbs", config.xverbs)
+        .add("verify", config.verify)
+        .add("replay_records", config.replay ? config.replay->size() : 0)
+        .add("replay_pace", config.replay_pace)
+        .add("duration", duration)
+        .add("clock", tsc_clock().tsc ? "tsc" : "clock_gettime");
+    std::string name;
+    ibv_device_attr dev_attr;
+    if (!transport.query_device(name, dev_attr)) {
+        return record;
+    }
+    record.add("device", name)
+        .add("dev_fw_ver", std::string(dev_attr.fw_ver))
+        .add("dev_vendor_id", dev_attr.vendor_id)
+        .add("dev_vendor_part_id", dev_attr.vendor_part_id)
+        .add("dev_hw_ver", dev_attr.hw_ver)
+        .add("dev_phys_port_cnt", dev_attr.phys_port_cnt)
+        .add("dev_cap_flags", dev_attr.device_cap_flags)
+        .add("dev_atomic_cap", static_cast<int>(dev_attr.atomic_cap))
+        .add("dev_max_mr_size", dev_attr.max_mr_size)
+        .add("dev_max_qp", dev_attr.max_qp)
+        .add("dev_max_qp_wr", dev_attr.max_qp_wr)
+        .add("dev_max_sge", dev_attr.max_sge)
+        .add("dev_max_cq", dev_attr.max_cq)
+        .add("dev_max_cqe", dev_attr.max_cqe)
+        .add("dev_max_mr", dev_attr.max_mr)
+        .add("dev_max_pd", dev_attr.max_pd)
+        .add("dev_max_qp_rd_atom", dev_attr.max_qp_rd_atom)
+        .add("dev_max_qp_init_rd_atom", dev_attr.max_qp_init_rd_atom);
+    return record;
+}
+
+/* -report: an interval (or the total, interval = duration) of the run.
+ * Both have the same fields, latency only with -t lat; in_flight are the
+ * wrs outstanding at the tick (total: the mean over the ticks). */
+ReportRecord interval_record(const char* kind, size_t interval,
+                             uint64_t ops, uint64_t bytes, uint64_t in_flight,
+                             uint64_t cpu_ns, uint64_t wall_ns,
+                             const HistogramSnapshot* latency) {
+    const double seconds = wall_ns / 1e9;
+    ReportRecord record;
+    record.add("record", kind)
+        .add("interval", interval)
+        .add("time_ns", report_time_ns())
+        .add("wall_ns", wall_ns)
+        .add("ops", ops)
+        .add("ops_per_sec", seconds > 0.0 ? ops / seconds : 0.0)
+        .add("bytes", bytes)
+        .add("bytes_per_sec", seconds > 0.0 ? bytes / seconds : 0.0)
+        .add("in_flight", in_flight)
+        .add("cpu_percent", wall_ns ? 100.0 * cpu_ns / wall_ns : 0.0)
+        .add("cpu_ns_per_op", ops ? cpu_ns / ops : 0);
+    if (!latency) {
+        return record;
+    }
+    record.add("lat_count", latency->count())
+        .add("lat_mean_ns", latency->mean());
+    for (auto& p : latency_percentiles) {
+        std::string name = std::string("lat_") + p.first + "_ns";
+        std::replace(name.begin(), name.end(), '.', '_');
+        record.add(name.c_str(), latency->percentile(p.second));
+    }
+    record.add("lat_max_ns", latency->max());
+    return record;
 }
 
 int main(int argc, char* argv[]) {
@@ -71,20 +2371,127 @@ int main(int argc, char* argv[]) {
         ("help", "produce this message")
         ("l", bop::value<ssize_t>()->default_value(1),
         "locations to access (random order) or <=0 index to location")
+        ("dist", bop::value<Distribution>()->default_value(
+            {Distribution::Kind::UNIFORM, 0.99, 0.2, 0.8, 1}),
+         "location distribution (l > 0): uniform, zipf[:theta], "
+         "hotspot[:hot set:hot ops], seq[:stride]")
+        ("mix", bop::value<OpMix>(),
+         "weighted op mix op:size:weight,... e.g. read:64:90,cas:8:10 "
+         "(overrides -op/-s)")
+        ("trace_len", bop::value<size_t>()->default_value(0),
+         "precomputed ops per worker (0 = auto)")
         ("tx", bop::value<size_t>()->default_value(1), "tx depth")
         ("cq_mod", bop::value<size_t>()->default_value(1),
          "signaled wr every nth (<tx depth)")
         ("op", bop::value<ibv_wr_opcode>()->default_value(IBV_WR_RDMA_WRITE),
         "opcode: read/write/fadd/cas/send")
         ("t", bop::value<Type>()->default_value(Type::BW), "lat/bw")
-        ("ip", bop::value<psl::net::in_addr>()->required(), "server ip")
+        ("ip", bop::value<psl::net::in_addr>(), "server ip (rdma)")
         ("p", bop::value<psl::net::in_port_t>()->default_value(default_port),
         "port")
+        ("servers", bop::value<EndpointList>(),
+         "fan-out: ip[:port],... (shm :port,...) every worker connects to "
+         "each server, overrides -ip")
+        ("shard", bop::value<ShardPolicy>()->default_value(ShardPolicy::RANGE),
+         "fan-out: range (contiguous location slices per server) or hash")
+        ("shared_cq", "fan-out: one CQ per worker for all its QPs (rdma, "
+         "same device)")
+        ("qps", bop::value<size_t>()->default_value(1),
+         "connections per server and worker, ops go round robin over them")
+        ("qp", bop::value<QpType>()->default_value(QpType::RC),
+         "rdma QP type: rc, uc (write/send), ud (send, -cq_mod 1) or xrc "
+         "(one-sided)")
         ("d", bop::value<size_t>()->default_value(10), "duration (seconds)")
         ("i", bop::value<size_t>()->default_value(0),
          "inline data size (bytes)")
         ("s", bop::value<Bytes>()->default_value({8}), "size")
         ("a", bop::value<Bytes>()->default_value({64}), "alignment")
+        ("threads", bop::value<size_t>()->default_value(1),
+         "worker threads (one connection each)")
+        ("batch", bop::value<size_t>()->default_value(1),
+         "work requests posted per doorbell (<= tx depth)")
+        ("rate", bop::value<double>()->default_value(0),
+         "open loop: target ops/sec over all threads (0 = closed loop)")
+        ("arrival", bop::value<Arrival>()->default_value(Arrival::FIXED),
+         "open loop inter-arrival times: fixed/poisson")
+        ("transport",
+         bop::value<TransportKind>()->default_value(TransportKind::RDMA),
+         "rdma or shm (one-sided ops emulated on a local server's shared "
+         "memory)")
+        ("completion",
+         bop::value<CompletionMode>()->default_value(CompletionMode::BUSY),
+         "busy (poll), event (block on a completion channel) or hybrid "
+         "(poll -spin_us, then block)")
+        ("spin_us", bop::value<size_t>()->default_value(20),
+         "hybrid: busy poll time before blocking (us)")
+        ("cpus", bop::value<CpuList>(),
+         "pin worker threads round robin to these cpus, e.g. 0-3,8")
+        ("xverbs", "post/poll with extended verbs, NIC completion timestamps "
+         "where supported")
+        ("echo", "send: wait for the server's echo of every message (RPC)")
+        ("sweep_s", bop::value<ValueList>(),
+         "sweep sizes, e.g. 8-4K (powers of two) or 64,1K")
+        ("sweep_tx", bop::value<ValueList>(), "sweep tx depths")
+        ("sweep_cq_mod", bop::value<ValueList>(), "sweep cq_mod values")
+        ("sweep_i", bop::value<ValueList>(), "sweep inline data sizes")
+        ("sweep_qps", bop::value<ValueList>(),
+         "sweep connections per server and worker, e.g. 1-1K")
+        ("scenario", bop::value<std::string>(),
+         "run the phases of this file back to back on the same "
+         "connections: lines of warmup|measure and d, op, mix, s, tx, "
+         "batch, rate, arrival, dist settings")
+        ("tune", bop::value<TuneGoal>(),
+         "search tx depth (up to -tx, default 256), cq_mod, batch and "
+         "inline (0 or -i) for: rate (highest ops/sec) or p99:<ops/sec> "
+         "(lowest p99 at that rate, -t lat)")
+        ("replay", bop::value<std::string>(),
+         "post the records of this trace file (tools/trace_convert) "
+         "instead of generated ops: opcode, server offset and size each")
+        ("replay_pace",
+         bop::value<ReplayPace>()->default_value({false, 1.0}),
+         "replay: asap (as fast as the QPs take them) or ts[:speed] (at "
+         "the recorded timestamps, speed times as fast)")
+        ("warmup", bop::value<size_t>()->default_value(1),
+         "sweep/tune: warmup per point (seconds)")
+        ("window", bop::value<size_t>()->default_value(2),
+         "sweep/tune: measurement window per point (seconds)")
+        ("app", bop::value<AppPattern>()->default_value(
+            {AppPattern::Kind::NONE, 0}),
+         "ops of dependent verbs, overrides -op: lock[:reads] (cas "
+         "spinlock on the location, reads of -s bytes while held) or "
+         "chase[:hops] (reads along the server's -chase chain), -cq_mod 1")
+        ("verify", "stamp writes and check reads, cas with real expected "
+         "values, reconcile fadds with the server's counters")
+        ("reg_bench", "measure ibv_reg_mr/ibv_dereg_mr on the first "
+         "connection's device instead of running ops (sizes: -sweep_s or -s)")
+        ("reg_pages", bop::value<OptionList<PageSize>>()->default_value(
+            {{PageSize::BASE}}),
+         "reg_bench: page sizes, e.g. 4K,2M (hugetlbfs)")
+        ("reg_access", bop::value<OptionList<MrAccess>>()->default_value(
+            {{mr_accesses[2]}}),
+         "reg_bench: access flags local/remote/atomic/odp, e.g. local,atomic")
+        ("reg_iters", bop::value<size_t>()->default_value(100),
+         "reg_bench: register/deregister pairs per point")
+        ("reg_cache", bop::value<size_t>()->default_value(0),
+         "register local buffers on first use through an LRU cache of this "
+         "many chunks (0 = all up front)")
+        ("reg_chunk", bop::value<Bytes>()->default_value({65536}),
+         "reg_cache: chunk size, a multiple of the aligned op size")
+        ("control", bop::value<psl::net::in_port_t>(),
+         "coordinated run: register with the coordinator of the (first) "
+         "server on this TCP port, start with its group and upload the "
+         "stats")
+        ("counters", "sample the sysfs port and hardware counters of the "
+         "connections' ports every interval (rdma)")
+        ("report", bop::value<std::string>(),
+         "write the configuration, every interval and the total as records "
+         "to this file")
+        ("report_format",
+         bop::value<ReportFormat>()->default_value(ReportFormat::JSONL),
+         "report: jsonl (an object per line) or csv (run record as # "
+         "comments)")
+        ("hist_file", bop::value<std::string>(),
+         "dump cumulative latency histogram to file at exit (-t lat)")
         ("h", "enable hugepages (madvise)");
     // clang-format on
 
@@ -103,138 +2510,594 @@ int main(int argc, char* argv[]) {
     }
     bop::notify(vm);
 
-    ssize_t locations = vm["l"].as<ssize_t>();
-    std::vector<size_t> location_indices;
-    if (locations <= 0) {
-        location_indices.push_back(-locations);
+    ClientConfig config;
+    config.locations = vm["l"].as<ssize_t>();
+    config.tx_depth = vm["tx"].as<size_t>();
+    config.cq_mod = vm["cq_mod"].as<size_t>();
+    config.opcode = vm["op"].as<ibv_wr_opcode>();
+    config.type = vm["t"].as<Type>();
+    config.inline_data = vm["i"].as<size_t>();
+    config.probe_inline = false;
+    config.size = vm["s"].as<Bytes>();
+    config.alignment = vm["a"].as<Bytes>();
+    config.aligned_size = align(config.size.value, config.alignment.value);
+    config.batch = vm["batch"].as<size_t>();
+    config.echo = vm.count("echo");
+    config.distribution = vm["dist"].as<Distribution>();
+    config.trace_len = vm["trace_len"].as<size_t>();
+    if (vm.count("mix")) {
+        config.mix = vm["mix"].as<OpMix>();
+        size_t max_size = 0;
+        for (auto& op_type : config.mix.types) {
+            LOG_ERR_EXIT(is_atomic(op_type.opcode) && op_type.size != 8,
+                         EINVAL, std::system_category());
+            max_size = std::max(max_size, op_type.size);
+        }
+        config.opcode = config.mix.types[0].opcode;
+        config.size.value = max_size;
+        config.aligned_size = align(max_size, config.alignment.value);
     } else {
-        location_indices.resize(locations);
-        std::iota(location_indices.begin(), location_indices.end(), 0);
-        std::mt19937_64 r(std::random_device{}());
-        std::shuffle(location_indices.begin(), location_indices.end(), r);
+        config.mix.types.push_back({config.opcode, config.size.value, 1});
+    }
+    /* -app replaces -op, -s stays the size of its reads */
+    config.app = vm["app"].as<AppPattern>();
+    const bool app = config.app.kind != AppPattern::Kind::NONE;
+    const bool lock = config.app.kind == AppPattern::Kind::LOCK;
+    if (app) {
+        LOG_ERR_EXIT(vm.count("mix"), EINVAL, std::system_category());
+        config.opcode = lock ? IBV_WR_ATOMIC_CMP_AND_SWP : IBV_WR_RDMA_READ;
+        config.mix.types[0].opcode = config.opcode;
     }
-    const size_t max_location = locations <= 0 ? (-locations + 1) : locations;
-    auto location_index = location_indices.cbegin();
-
-    rdma_cm_id* id;
-    LOG_ERR_EXIT(rdma_create_id(nullptr, &id, nullptr, RDMA_PS_TCP), errno,
-                 std::system_category());
-
-    psl::net::in_addr ip = vm["ip"].as<psl::net::in_addr>();
-    psl::net::in_port_t port = vm["p"].as<psl::net::in_port_t>();
-    sockaddr_in addr;
-    addr.sin_addr = ip;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
 
-    LOG_ERR_EXIT(
-        rdma_resolve_addr(id, NULL, reinterpret_cast<sockaddr*>(&addr), 1000),
-        errno, std::system_category());
+    /* sweep: connect and register for the largest point, parameters that
+     * are not swept keep their plain option value */
+    config.qps = vm["qps"].as<size_t>();
+    LOG_ERR_EXIT(!config.qps, EINVAL, std::system_category());
+    const bool reg_bench = vm.count("reg_bench");
+    const bool sweep =
+        !reg_bench && (vm.count("sweep_s") || vm.count("sweep_tx") ||
+                       vm.count("sweep_cq_mod") || vm.count("sweep_i") ||
+                       vm.count("sweep_qps"));
+    SweepConfig sweep_config;
+    if (sweep) {
+        LOG_ERR_EXIT(vm.count("mix") && vm.count("sweep_s"), EINVAL,
+                     std::system_category());
+        /* a coordinated run has a single window */
+        LOG_ERR_EXIT(vm.count("control"), EINVAL, std::system_category());
+        auto values = [&](const char* name, size_t value) {
+            return vm.count(name) ? vm[name].as<ValueList>()
+                                  : ValueList{{value}};
+        };
+        sweep_config.sizes = values("sweep_s", config.size.value);
+        sweep_config.tx_depths = values("sweep_tx", config.tx_depth);
+        sweep_config.cq_mods = values("sweep_cq_mod", config.cq_mod);
+        sweep_config.inline_data = values("sweep_i", config.inline_data);
+        sweep_config.qps = values("sweep_qps", config.qps);
+        sweep_config.warmup = vm["warmup"].as<size_t>();
+        sweep_config.window = vm["window"].as<size_t>();
+        LOG_ERR_EXIT(!sweep_config.window, EINVAL, std::system_category());
+        auto max = [](const ValueList& list) {
+            return *std::max_element(list.values.begin(), list.values.end());
+        };
+        if (!vm.count("mix")) {
+            config.size.value = max(sweep_config.sizes);
+            config.mix.types[0].size = config.size.value;
+            config.aligned_size =
+                align(config.size.value, config.alignment.value);
+        }
+        config.tx_depth = max(sweep_config.tx_depths);
+        config.inline_data = max(sweep_config.inline_data);
+        config.qps = max(sweep_config.qps);
+    }
 
-    LOG_ERR_EXIT(rdma_resolve_route(id, 1000), errno, std::system_category());
+    /* -tune: connect for the largest tx depth to try and the largest inline
+     * size the device takes */
+    const bool tune = !reg_bench && vm.count("tune");
+    TuneGoal tune_goal = {TuneGoal::Kind::RATE, 0.0};
+    if (tune) {
+        tune_goal = vm["tune"].as<TuneGoal>();
+        LOG_ERR_EXIT(sweep || vm.count("control") ||
+                         !vm["window"].as<size_t>() ||
+                         (tune_goal.kind == TuneGoal::Kind::P99 &&
+                          config.type != Type::LAT),
+                     EINVAL, std::system_category());
+        if (vm["tx"].defaulted()) {
+            config.tx_depth = default_tune_tx;
+        }
+        config.probe_inline = true;
+    }
 
-    ibv_wr_opcode opcode = vm["op"].as<ibv_wr_opcode>();
-    size_t tx_depth = vm["tx"].as<size_t>();
-    size_t ncqe = tx_depth;
-    if (opcode == IBV_WR_SEND) {
-        ncqe *= 2;
+    /* -replay: one mix entry per opcode of the trace at the largest size
+     * it has there, the buffers and QPs fit every record. Locations do not
+     * apply, the records carry the offsets. */
+    const bool replay = !reg_bench && vm.count("replay");
+    config.replay_pace = vm["replay_pace"].as<ReplayPace>();
+    if (replay) {
+        LOG_ERR_EXIT(sweep || tune || vm.count("mix") || app ||
+                         config.echo || vm.count("verify") ||
+                         vm.count("servers") || !vm["l"].defaulted() ||
+                         !vm["dist"].defaulted() ||
+                         !vm["trace_len"].defaulted() ||
+                         vm["rate"].as<double>() > 0.0,
+                     EINVAL, std::system_category());
+        const std::string path = vm["replay"].as<std::string>();
+        config.replay = std::make_shared<MappedTrace>(path);
+        const TraceHeader& header = config.replay->header();
+        LOG_ERR_EXIT(config.replay_pace.timestamps &&
+                         !config.replay->timestamps(),
+                     EINVAL, std::system_category());
+        config.mix.types.clear();
+        std::cout << "replay: " << path << ": " << header.records
+                  << " records (";
+        for (size_t i = 0; i < trace_ops; i++) {
+            if (header.ops & (1u << i)) {
+                const ibv_wr_opcode opcode = trace_opcode(TraceOp(i));
+                config.mix.types.push_back(
+                    {opcode, header.op_max_size[i], 1});
+                std::cout << (config.mix.types.size() > 1 ? " " : "")
+                          << op_name(config.mix.types.back());
+            }
+        }
+        std::cout << ") of up to " << header.max_size << " bytes in "
+                  << header.max_end << " bytes of server memory";
+        if (config.replay->timestamps()) {
+            std::cout << ", " << (header.last_ns - header.first_ns) / 1e9
+                      << "s recorded";
+        }
+        std::cout << ", " << config.replay_pace << '\n';
+        config.opcode = config.mix.types[0].opcode;
+        config.size.value = header.max_size;
+        config.aligned_size = align(config.size.value, config.alignment.value);
+        config.locations = 1;
     }
-    ibv_cq* cq;
-    LOG_ERR_EXIT(!(cq = ibv_create_cq(id->verbs, ncqe, NULL, NULL, 0)), errno,
-                 std::system_category());
 
-    Bytes size = vm["s"].as<Bytes>();
-    size_t inline_data = vm["i"].as<size_t>();
-    LOG_ERR_EXIT(inline_data && inline_data < size.value, EINVAL,
+    const ssize_t locations = config.locations;
+    const size_t max_location =
+        locations <= 0 ? (-locations + 1) : locations;
+    const size_t nlocal_locations = locations <= 0 ? 1 : locations;
+    config.nlocal_locations = nlocal_locations;
+    LOG_ERR_EXIT(max_location > std::numeric_limits<uint32_t>::max(), EINVAL,
                  std::system_category());
-    LOG_ERR_EXIT(inline_data && (opcode == IBV_WR_ATOMIC_CMP_AND_SWP ||
-                                 opcode == IBV_WR_ATOMIC_FETCH_AND_ADD ||
-                                 opcode == IBV_WR_RDMA_READ),
+
+    /* a mix only inlines the entries that can be inlined, a sweep or the
+     * tuner skips the points that cannot */
+    const bool mixed = vm.count("mix") || replay;
+    LOG_ERR_EXIT(!mixed && !sweep && !tune && config.inline_data &&
+                     config.inline_data < config.size.value,
                  EINVAL, std::system_category());
-    ibv_qp_init_attr qp_init_attr = {};
-    qp_init_attr.qp_type = IBV_QPT_RC;
-    qp_init_attr.sq_sig_all = 0;
-    qp_init_attr.send_cq = cq;
-    qp_init_attr.recv_cq = cq;
-    qp_init_attr.cap.max_inline_data = inline_data;
-    qp_init_attr.cap.max_recv_wr = opcode == IBV_WR_SEND ? tx_depth : 1;
-    qp_init_attr.cap.max_send_wr = tx_depth;
-    qp_init_attr.cap.max_recv_sge = 1;
-    qp_init_attr.cap.max_send_sge = 1;
-    LOG_ERR_EXIT(rdma_create_qp(id, id->pd, &qp_init_attr), errno,
+    LOG_ERR_EXIT(!mixed && !sweep && !tune && config.inline_data &&
+                     (config.opcode == IBV_WR_ATOMIC_CMP_AND_SWP ||
+                      config.opcode == IBV_WR_ATOMIC_FETCH_AND_ADD ||
+                      config.opcode == IBV_WR_RDMA_READ),
+                 EINVAL, std::system_category());
+    LOG_ERR_EXIT((config.opcode == IBV_WR_ATOMIC_CMP_AND_SWP ||
+                  config.opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) &&
+                     !lock && config.size.value != 8,
+                 EINVAL, std::system_category());
+
+    LOG_ERR_EXIT(!config.batch || config.batch > config.tx_depth, EINVAL,
+                 std::system_category());
+    LOG_ERR_EXIT(config.echo && config.opcode != IBV_WR_SEND, EINVAL,
                  std::system_category());
 
-    ibv_device_attr dev_attr;
-    LOG_ERR_EXIT(ibv_query_device(id->verbs, &dev_attr), errno,
+    const size_t nthreads = vm["threads"].as<size_t>();
+    LOG_ERR_EXIT(!nthreads, EINVAL, std::system_category());
+    LOG_ERR_EXIT(vm["rate"].as<double>() < 0.0, EINVAL,
                  std::system_category());
+    config.rate = vm["rate"].as<double>() / nthreads;
+    config.arrival = vm["arrival"].as<Arrival>();
+    config.xverbs = vm.count("xverbs");
+    config.completion = vm["completion"].as<CompletionMode>();
+    config.spin_ns = vm["spin_us"].as<size_t>() * 1000;
+    if (vm.count("cpus")) {
+        config.cpus = vm["cpus"].as<CpuList>().cpus;
+    }
+    config.transport = vm["transport"].as<TransportKind>();
+    /* shm only needs the port, it names the server's region */
+    LOG_ERR_EXIT(config.transport == TransportKind::RDMA && !vm.count("ip") &&
+                     !vm.count("servers"),
+                 EINVAL, std::system_category());
+
+    psl::net::in_port_t port = vm["p"].as<psl::net::in_port_t>();
+    if (vm.count("servers")) {
+        config.servers = vm["servers"].as<EndpointList>().endpoints;
+        for (auto& server : config.servers) {
+            if (!server.port) {
+                server.port = port;
+            }
+        }
+    } else {
+        Endpoint server = {};
+        if (vm.count("ip")) {
+            server.ip = vm["ip"].as<psl::net::in_addr>();
+        }
+        server.port = port;
+        config.servers.push_back(server);
+    }
+    const size_t ntargets = config.servers.size();
+    const ShardPolicy shard = vm["shard"].as<ShardPolicy>();
+    config.shared_cq = vm.count("shared_cq");
 
-    ClientConnectionData conn_data;
-    conn_data.send = (opcode == IBV_WR_SEND);
-    conn_data.locations = locations;
-    rdma_conn_param conn_param = {};
-    conn_param.private_data = reinterpret_cast<void*>(&conn_data);
-    conn_param.private_data_len = sizeof(conn_data);
-    conn_param.responder_resources = dev_attr.max_qp_rd_atom;
-    conn_param.initiator_depth = dev_attr.max_qp_rd_atom;
-    LOG_ERR_EXIT(rdma_connect(id, &conn_param), errno, std::system_category());
-
-    LOG_ERR_EXIT(id->event->param.conn.private_data_len <
-                     sizeof(ServerConnectionData),
+    /* every opcode has to exist on the QP type, UD signals every send so
+     * the drain can do without a flush write */
+    config.qp_type = vm["qp"].as<QpType>();
+    LOG_ERR_EXIT(config.transport != TransportKind::RDMA &&
+                     config.qp_type != QpType::RC,
+                 EINVAL, std::system_category());
+    for (auto& op_type : config.mix.types) {
+        LOG_ERR_EXIT(!qp_type_supports(config.qp_type, op_type.opcode),
+                     EOPNOTSUPP, std::system_category());
+    }
+    LOG_ERR_EXIT(config.qp_type == QpType::UD && !sweep && !tune &&
+                     config.cq_mod != 1,
                  EINVAL, std::system_category());
-    ServerConnectionData server_conn_data =
-        *reinterpret_cast<const ServerConnectionData*>(
-            id->event->param.conn.private_data);
+    config.recv_stride =
+        config.aligned_size +
+        (config.qp_type == QpType::UD ? ud_grh_size : 0);
 
-    Bytes alignment = vm["a"].as<Bytes>();
-    size_t aligned_size = align(size.value, alignment.value);
-    LOG_ERR_EXIT(aligned_size * max_location > server_conn_data.size, EINVAL,
-                 std::system_category());
+    /* -scenario: connect and register for the largest size and tx depth
+     * of all phases and every opcode in them, like a sweep. A phase that
+     * does not fit fails the run before it starts. */
+    std::vector<Phase> phases;
+    ClientConfig command_line = config;
+    if (vm.count("scenario")) {
+        LOG_ERR_EXIT(sweep || tune || reg_bench || app || replay ||
+                         vm.count("verify") || vm.count("control") ||
+                         vm.count("report"),
+                     EINVAL, std::system_category());
+        std::ifstream file(vm["scenario"].as<std::string>());
+        LOG_ERR_EXIT(!file, errno, std::system_category());
+        size_t line = 0;
+        bool parsed = parse_scenario(file, phases, line);
+        if (!parsed) {
+            std::cerr << "scenario: line " << line << ": syntax error\n";
+        }
+        LOG_ERR_EXIT(!parsed, EINVAL, std::system_category());
+        for (auto& phase : phases) {
+            ClientConfig point = config;
+            point.aligned_size = std::numeric_limits<size_t>::max();
+            size_t duration = vm["d"].as<size_t>();
+            parsed = phase_config(phase, command_line, nthreads, point,
+                                  duration);
+            if (!parsed) {
+                std::cerr << "scenario: line " << phase.line
+                          << ": bad or unsupported setting\n";
+            }
+            LOG_ERR_EXIT(!parsed, EINVAL, std::system_category());
+            config.size.value = std::max(config.size.value, point.size.value);
+            config.tx_depth = std::max(config.tx_depth, point.tx_depth);
+            for (auto& op_type : point.mix.types) {
+                config.phase_opcodes.push_back(op_type.opcode);
+            }
+        }
+        config.aligned_size = align(config.size.value, config.alignment.value);
+        config.recv_stride =
+            config.aligned_size +
+            (config.qp_type == QpType::UD ? ud_grh_size : 0);
+    }
+
+    /* an op never crosses a chunk, and pins it while it is in flight */
+    config.reg_cache = vm["reg_cache"].as<size_t>();
+    config.reg_chunk =
+        align(std::max(vm["reg_chunk"].as<Bytes>().value, config.aligned_size),
+              config.aligned_size);
+
+    /* -verify: a location holds either stamps (read/write, large enough
+     * for one) or a counter (fadd/cas), never both */
+    config.verify = vm.count("verify");
+    bool verify_data = false, verify_fadd = false, verify_cas = false;
+    for (auto& op_type : config.mix.types) {
+        const bool data = op_type.opcode == IBV_WR_RDMA_READ ||
+                          op_type.opcode == IBV_WR_RDMA_WRITE;
+        LOG_ERR_EXIT(config.verify &&
+                         (op_type.opcode == IBV_WR_SEND ||
+                          (data && op_type.size < verify_stamp_size)),
+                     EINVAL, std::system_category());
+        verify_data |= data;
+        verify_fadd |= op_type.opcode == IBV_WR_ATOMIC_FETCH_AND_ADD;
+        verify_cas |= op_type.opcode == IBV_WR_ATOMIC_CMP_AND_SWP;
+    }
+    LOG_ERR_EXIT(config.verify && verify_data && (verify_fadd || verify_cas),
+                 EINVAL, std::system_category());
+
+    /* -app: every verb is signaled, the next one is built from its
+     * result. Reads cover at least the lock word or the next pointer. */
+    LOG_ERR_EXIT(app && (config.verify ||
+                         (!sweep && !tune && config.cq_mod != 1) ||
+                         config.size.value < 8),
+                 EINVAL, std::system_category());
 
+    /* -report: opened up front, a file that cannot be written fails the
+     * run before anything is set up */
+    std::unique_ptr<ReportWriter> report;
+    if (vm.count("report")) {
+        LOG_ERR_EXIT(sweep || tune || reg_bench, EINVAL,
+                     std::system_category());
+        report.reset(new ReportWriter(vm["report"].as<std::string>(),
+                                      vm["report_format"].as<ReportFormat>()));
+    }
+
+    /* one allocation, sliced per worker */
     void* data;
-    size_t max_local_size = aligned_size * location_indices.size();
-    LOG_ERR_EXIT(posix_memalign(&data, alloc_alignment, max_local_size), errno,
-                 std::system_category());
-    std::memset(data, 0, max_local_size);
+    const size_t recv_size =
+        config.echo
+            ? config.recv_stride * config.tx_depth * ntargets * config.qps
+            : 0;
+    const size_t results_size =
+        config.verify || app
+            ? config.aligned_size * config.tx_depth * ntargets * config.qps
+            : 0;
+    size_t max_local_size =
+        config.aligned_size * nlocal_locations + recv_size + results_size;
+    size_t total_local_size = max_local_size * nthreads;
+    LOG_ERR_EXIT(posix_memalign(&data, alloc_alignment, total_local_size),
+                 errno, std::system_category());
+    std::memset(data, 0, total_local_size);
 
     if (vm.count("h")) {
-        LOG_ERR_EXIT(madvise(data, max_local_size, MADV_HUGEPAGE), errno,
+        LOG_ERR_EXIT(madvise(data, total_local_size, MADV_HUGEPAGE), errno,
                 std::system_category());
     }
 
-    ibv_mr* mr;
-    LOG_ERR_EXIT(!(mr = ibv_reg_mr(
-                       id->pd, data, max_local_size,
-                       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
-                           IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_ATOMIC)),
-                 errno, std::system_category());
+    /* every server holds its shard at the stride of the largest size */
+    const size_t server_locations = shard_size(shard, max_location, ntargets);
+    if (ntargets > 1) {
+        std::cout << "fan-out: " << ntargets << " servers, " << shard
+                  << " sharding, " << server_locations
+                  << " locations per server"
+                  << (config.shared_cq ? ", shared cq" : "") << '\n';
+    }
 
-    Type type = vm["t"].as<Type>();
-    std::atomic<std::vector<uint64_t>*> times{new std::vector<uint64_t>()};
-    if (type == Type::LAT) {
-        times.load()->reserve(sample_size);
+    /* calibrates the clock before the workers load the cpus */
+    const TscClock& clock = tsc_clock();
+    std::cout << "clock = ";
+    if (clock.tsc) {
+        std::cout << "tsc (" << clock.cycles_per_ns << " GHz, invariant)";
+    } else {
+        std::cout << "clock_gettime (no invariant tsc)";
+    }
+    /* to 0.1ns */
+    std::cout << ", read = " << std::round(clock_overhead_ns(now_ns) * 10) / 10
+              << "ns, clock_gettime = "
+              << std::round(clock_overhead_ns(monotonic_ns) * 10) / 10
+              << "ns\n";
+
+    std::random_device rd;
+    const uint32_t client_id = rd();
+    std::vector<Worker> workers(nthreads);
+    Histogram setup_latency;
+    for (size_t t = 0; t < nthreads; t++) {
+        Worker& worker = workers[t];
+        connect_worker(worker, config, setup_latency);
+        if ((config.xverbs || config.transport != TransportKind::RDMA ||
+             config.qp_type != QpType::RC) &&
+            t == 0) {
+            std::cout << "data path: "
+                      << worker.transports.back()->data_path() << '\n';
+        }
+
+        /* once per protection domain, not per connection. -reg_cache
+         * registers the op buffers on demand, up front only the echo
+         * receive buffers behind them. */
+        char* slice = static_cast<char*>(data) + t * max_local_size;
+        worker.slice = slice;
+        worker.client_id = (client_id << 8) | (t & 0xff);
+        worker.results = reinterpret_cast<uint64_t>(slice) +
+                         max_local_size - results_size;
+        const size_t on_demand =
+            config.reg_cache ? nlocal_locations * config.aligned_size : 0;
+        std::map<const void*, ibv_mr*> domain_mrs;
+        worker.mrs.clear();
+        for (auto& transport : worker.transports) {
+            /* -app chase: the locations are the server's nodes */
+            const size_t stride =
+                config.app.kind == AppPattern::Kind::CHASE
+                    ? transport->server_conn_data.chase_stride
+                    : config.aligned_size;
+            LOG_ERR_EXIT(!stride || config.size.value > stride ||
+                             stride * server_locations >
+                                 transport->server_conn_data.size,
+                         EINVAL, std::system_category());
+            LOG_ERR_EXIT(config.opcode == IBV_WR_SEND &&
+                             config.size.value >
+                                 transport->server_conn_data.recv_size,
+                         EMSGSIZE, std::system_category());
+            LOG_ERR_EXIT(config.size.value > transport->max_message, EMSGSIZE,
+                         std::system_category());
+            const bool fits = !replay || config.replay->header().max_end <=
+                                             transport->server_conn_data.size;
+            if (!fits) {
+                std::cerr << "replay: the trace needs "
+                          << config.replay->header().max_end
+                          << " bytes of server memory, the server has "
+                          << transport->server_conn_data.size << '\n';
+            }
+            LOG_ERR_EXIT(!fits, ERANGE, std::system_category());
+            const void* domain = transport->mr_domain();
+            ibv_mr*& mr = domain_mrs[domain];
+            if ((!domain || !mr) && max_local_size > on_demand) {
+                LOG_ERR_EXIT(
+                    !(mr = transport->reg_mr(slice + on_demand,
+                                             max_local_size - on_demand,
+                                             default_mr_access)),
+                    errno, std::system_category());
+            }
+            worker.mrs.push_back(mr);
+        }
+        LOG_ERR_EXIT(config.reg_cache && (domain_mrs.size() > 1 ||
+                                          !domain_mrs.begin()->first),
+                     EINVAL, std::system_category());
+
+        if (replay) {
+            worker.replay_first = t;
+            worker.replay_step = nthreads;
+        } else {
+            worker.trace = make_trace(config, shard, rd());
+        }
+    }
+    /* connections are set up one at a time, the rate is 1 / mean */
+    if (nthreads * ntargets * config.qps > 1) {
+        HistogramSnapshot setup;
+        setup_latency.snapshot(setup);
+        std::cout << "connections = " << setup.count() << " ("
+                  << static_cast<uint64_t>(1e9 / std::max(setup.mean(), 1.0))
+                  << "/sec)\tsetup\t";
+        print_latency(std::cout, setup);
+    }
+
+    const Type type = config.type;
+    const size_t ntypes = config.mix.types.size();
+    bool nic_timestamps = false;
+    for (auto& worker : workers) {
+        nic_timestamps |= std::all_of(
+            worker.transports.begin(), worker.transports.end(),
+            [](const std::unique_ptr<Transport>& transport) {
+                return transport->nic_timestamps;
+            });
+    }
+    if (reg_bench) {
+        RegBenchConfig bench;
+        bench.sizes = vm.count("sweep_s") ? vm["sweep_s"].as<ValueList>()
+                                          : ValueList{{config.size.value}};
+        bench.pages = vm["reg_pages"].as<OptionList<PageSize>>().values;
+        bench.accesses = vm["reg_access"].as<OptionList<MrAccess>>().values;
+        bench.iters = vm["reg_iters"].as<size_t>();
+        run_reg_bench(*workers[0].transports[0], bench);
+        return 0;
+    }
+    if (config.reg_cache) {
+        std::cout << "reg cache: " << config.reg_cache << " chunks of "
+                  << config.reg_chunk << " bytes per worker ("
+                  << (nlocal_locations * config.aligned_size +
+                      config.reg_chunk - 1) /
+                         config.reg_chunk
+                  << " chunks of local buffers)\n";
+    }
+    /* -verify: fadd counters before the run, nothing but fadds changes
+     * them unless cas shares their locations */
+    const bool reconcile =
+        config.verify && verify_fadd && !verify_cas && !sweep;
+    std::vector<std::vector<bool>> fadd_locations(ntargets);
+    std::vector<uint64_t> counters_before(ntargets, 0);
+    for (size_t s = 0; reconcile && s < ntargets; s++) {
+        fadd_locations[s].assign(server_locations, false);
+        for (auto& worker : workers) {
+            for (auto& op : worker.trace) {
+                if (op.target == s && config.mix.types[op.type].opcode ==
+                                          IBV_WR_ATOMIC_FETCH_AND_ADD) {
+                    fadd_locations[s][op.location] = true;
+                }
+            }
+        }
+        counters_before[s] = read_counters(workers[0], s, fadd_locations[s],
+                                           config.aligned_size);
+    }
+    if (sweep) {
+        run_sweep(workers, config, sweep_config);
+        return 0;
+    }
+    if (tune) {
+        run_tune(workers, config, tune_goal, vm["warmup"].as<size_t>(),
+                 vm["window"].as<size_t>());
+        return 0;
+    }
+    if (!phases.empty()) {
+        run_scenario(workers, config, command_line, phases,
+                     vm["d"].as<size_t>(), shard);
+        return 0;
     }
-    std::atomic<uint64_t> operations{0};
+
+    std::unique_ptr<WorkerStats[]> stats(new WorkerStats[nthreads]);
 
     size_t duration = vm["d"].as<size_t>();
-    bool done = false;
+    /* -control: everything is set up, wait for the rest of the group. The
+     * coordinator picks the window. */
+    int control = -1;
+    if (vm.count("control")) {
+        sockaddr_in control_addr = {};
+        control_addr.sin_addr = config.servers[0].ip;
+        control_addr.sin_family = AF_INET;
+        control_addr.sin_port = htons(vm["control"].as<psl::net::in_port_t>());
+        LOG_ERR_EXIT((control = control_connect(control_addr)) < 0, errno,
+                     std::system_category());
+        ControlHello hello = {static_cast<uint32_t>(nthreads),
+                              static_cast<uint32_t>(duration)};
+        ControlStart start;
+        LOG_ERR_EXIT(!send_control(control, ControlType::HELLO, &hello,
+                                   sizeof(hello)) ||
+                         !recv_control(control, ControlType::START, start),
+                     errno, std::system_category());
+        duration = start.duration;
+        std::cout << "coordinated: client " << start.client + 1 << "/"
+                  << start.clients << ", " << duration << "s" << std::endl;
+    }
+    if (report) {
+        report->metadata(
+            run_record(config, nthreads, duration, *workers[0].transports[0]));
+    }
+    /* -counters: every port the connections go through, once. The totals
+     * start here. */
+    std::vector<PortCounters> nic_counters;
+    if (vm.count("counters")) {
+        std::set<std::pair<std::string, unsigned>> ports;
+        for (auto& worker : workers) {
+            for (auto& transport : worker.transports) {
+                std::string device;
+                unsigned port;
+                if (transport->device_port(device, port)) {
+                    ports.insert({device, port});
+                }
+            }
+        }
+        LOG_ERR_EXIT(ports.empty(), EOPNOTSUPP, std::system_category());
+        for (auto& port : ports) {
+            nic_counters.emplace_back(port.first, port.second);
+            LOG_ERR_EXIT(nic_counters.back().empty(), ENOENT,
+                         std::system_category());
+        }
+    }
+    std::atomic<bool> done{false};
+    /* -report: sum of the in-flight samples of the ticks */
+    uint64_t in_flight_ticks = 0;
+    const uint64_t start_ns = now_ns();
+    const std::chrono::steady_clock::time_point run_start =
+        std::chrono::steady_clock::now();
+    std::vector<std::thread> worker_threads =
+        start_workers(workers, stats.get(), config, done);
     std::thread time_thread([&]() {
         using namespace std::chrono;
-        auto other_times = new std::vector<uint64_t>();
-        if (type == Type::LAT) {
-            other_times->reserve(sample_size);
-        }
+        HistogramSnapshot thread_latency, total_latency, latency,
+            nic_latency, last_nic_latency;
+        std::vector<HistogramSnapshot> type_latency(ntypes),
+            last_type_latency(ntypes);
+        std::vector<uint64_t> last_operations(nthreads, 0);
+        std::vector<uint64_t> thread_operations(nthreads, 0);
+        std::vector<uint64_t> last_type_operations(ntypes, 0);
+        std::vector<HistogramSnapshot> target_latency(ntargets),
+            last_target_latency(ntargets);
+        std::vector<uint64_t> last_target_operations(ntargets, 0);
+        uint64_t last_doorbells = 0;
+        uint64_t last_reg_hits = 0, last_reg_misses = 0;
+        uint64_t last_app_wrs = 0, last_lock_failures = 0;
+        HistogramSnapshot acquire_latency, last_acquire_latency;
+        std::vector<uint64_t> last_cpu_ns(nthreads, 0);
+        uint64_t last_tick_ns = start_ns;
+        uint64_t last_bytes = 0;
 
-        seconds sec{0};
-        while (duration-- > 0) {
-            system_clock::time_point now;
-            nanoseconds ns;
-            do {
-                now = system_clock::now();
-                ns = duration_cast<nanoseconds>(now.time_since_epoch()) -
-                     duration_cast<seconds>(now.time_since_epoch());
-            } while (ns > microseconds(100) ||
-                     sec == duration_cast<seconds>(now.time_since_epoch()));
-            sec = duration_cast<seconds>(now.time_since_epoch());
+        for (size_t tick = 1; tick <= duration; tick++) {
+            /* sleep to the next full second, the stamp shows how late the
+             * wakeup was. Coordinated clients count from the common start
+             * instead, their wall clocks need not agree. */
+            if (control >= 0) {
+                std::this_thread::sleep_until(run_start + seconds(tick));
+            } else {
+                std::this_thread::sleep_until(
+                    time_point_cast<seconds>(system_clock::now()) +
+                    seconds(1));
+            }
+            const system_clock::time_point now = system_clock::now();
+            const nanoseconds ns = duration_cast<nanoseconds>(
+                now - time_point_cast<seconds>(now));
 
             auto ttnow = system_clock::to_time_t(now);
             auto tmnow = std::localtime(&ttnow);
@@ -242,134 +3105,423 @@ int main(int argc, char* argv[]) {
             strftime(buf, sizeof(buf), "%d.%m.%y %X", tmnow);
             std::cout << buf << "." << std::setfill('0') << std::setw(9)
                       << ns.count() << "\t";
+            if (config.rate > 0.0 ||
+                (config.replay && config.replay_pace.timestamps)) {
+                uint64_t backlog = 0;
+                for (size_t t = 0; t < nthreads; t++) {
+                    backlog += stats[t].backlog.load(std::memory_order_relaxed);
+                }
+                std::cout << "backlog = " << backlog << " ops\t";
+            }
+            uint64_t total = 0;
+            uint64_t cpu_ns = 0;
+            for (size_t t = 0; t < nthreads; t++) {
+                uint64_t ops =
+                    stats[t].operations.load(std::memory_order_relaxed);
+                thread_operations[t] = ops - last_operations[t];
+                last_operations[t] = ops;
+                total += thread_operations[t];
+                uint64_t thread_cpu = thread_cpu_ns(worker_threads[t]);
+                cpu_ns += thread_cpu - last_cpu_ns[t];
+                last_cpu_ns[t] = thread_cpu;
+            }
+            const uint64_t tick_ns = now_ns();
+            const uint64_t wall_ns = tick_ns - last_tick_ns;
+            last_tick_ns = tick_ns;
+            uint64_t reg_hits = 0, reg_misses = 0;
+            for (size_t t = 0; config.reg_cache && t < nthreads; t++) {
+                reg_hits += stats[t].reg_hits.load(std::memory_order_relaxed);
+                reg_misses +=
+                    stats[t].reg_misses.load(std::memory_order_relaxed);
+            }
+            for (auto& counters : nic_counters) {
+                counters.sample();
+            }
+            uint64_t bytes = 0, in_flight = 0;
+            for (size_t t = 0; report && t < nthreads; t++) {
+                bytes += stats[t].replay_bytes.load(std::memory_order_relaxed);
+                for (size_t i = 0; !replay && i < ntypes; i++) {
+                    bytes += stats[t].type_operations[i].load(
+                                 std::memory_order_relaxed) *
+                             config.mix.types[i].size;
+                }
+                in_flight += stats[t].in_flight.load(std::memory_order_relaxed);
+            }
+            uint64_t app_wrs = 0, lock_failures = 0;
+            for (size_t t = 0; app && t < nthreads; t++) {
+                app_wrs += stats[t].app_wrs.load(std::memory_order_relaxed);
+                lock_failures +=
+                    stats[t].lock_failures.load(std::memory_order_relaxed);
+            }
             if (type == Type::BW) {
                 using namespace psl::terminal;
-                auto i = operations.exchange(0);
+                uint64_t doorbells = 0;
+                for (size_t t = 0; t < nthreads; t++) {
+                    doorbells +=
+                        stats[t].doorbells.load(std::memory_order_relaxed);
+                }
                 std::cout << graphic_format::GREEN << graphic_format::BOLD
-                          << "throughput = " << graphic_format::WHITE << i
-                          << " ops/sec\n" << graphic_format::RESET;
+                          << "throughput = " << graphic_format::WHITE << total
+                          << " ops/sec " << (doorbells - last_doorbells)
+                          << " doorbells/sec" << graphic_format::RESET;
+                last_doorbells = doorbells;
+                if (nthreads > 1) {
+                    std::cout << " (per thread =";
+                    for (auto ops : thread_operations) {
+                        std::cout << " " << ops;
+                    }
+                    std::cout << ")";
+                }
+                if (ntypes > 1) {
+                    std::cout << " (";
+                    for (size_t i = 0; i < ntypes; i++) {
+                        uint64_t ops = 0;
+                        for (size_t t = 0; t < nthreads; t++) {
+                            ops += stats[t].type_operations[i].load(
+                                std::memory_order_relaxed);
+                        }
+                        std::cout << (i ? " " : "")
+                                  << op_name(config.mix.types[i]) << " = "
+                                  << ops - last_type_operations[i];
+                        last_type_operations[i] = ops;
+                    }
+                    std::cout << ")";
+                }
+                if (ntargets > 1) {
+                    std::cout << " (";
+                    for (size_t i = 0; i < ntargets; i++) {
+                        uint64_t ops = 0;
+                        for (size_t t = 0; t < nthreads; t++) {
+                            ops += stats[t].target_operations[i].load(
+                                std::memory_order_relaxed);
+                        }
+                        std::cout << (i ? " " : "") << config.servers[i]
+                                  << " = " << ops - last_target_operations[i];
+                        last_target_operations[i] = ops;
+                    }
+                    std::cout << ")";
+                }
+                std::cout << " ";
+                print_cpu(std::cout, cpu_ns, total, wall_ns);
+                if (config.reg_cache) {
+                    std::cout << " ";
+                    print_reg_cache(std::cout, reg_hits - last_reg_hits,
+                                    reg_misses - last_reg_misses);
+                }
+                if (app) {
+                    std::cout << " ";
+                    print_app(std::cout, config.app, total,
+                              app_wrs - last_app_wrs,
+                              lock_failures - last_lock_failures);
+                }
+                std::cout << '\n';
             } else if (type == Type::LAT) {
-                using namespace psl::terminal;
-                other_times->clear();
-                other_times = times.exchange(other_times);
-                std::sort(other_times->begin(), other_times->end());
-                std::cout << graphic_format::GREEN << graphic_format::BOLD
-                          << "median = " << graphic_format::WHITE
-                          << psl::stats::median(other_times->begin(),
-                                                other_times->end()) << "ns"
-                          << graphic_format::GREEN
-                          << " average = " << graphic_format::WHITE
-                          << psl::stats::mean(other_times->begin(),
-                                              other_times->end()) << "ns"
-                          << graphic_format::RESET
-                          << " (sample size = " << other_times->size() << ")\n";
+                latency.clear();
+                for (size_t i = 0; i < ntypes; i++) {
+                    total_latency.clear();
+                    for (size_t t = 0; t < nthreads; t++) {
+                        stats[t].latency[i].snapshot(thread_latency);
+                        total_latency += thread_latency;
+                    }
+                    type_latency[i] = total_latency;
+                    type_latency[i].subtract(last_type_latency[i]);
+                    last_type_latency[i] = total_latency;
+                    latency += type_latency[i];
+                }
+                print_latency(std::cout, latency);
+                for (size_t i = 0; ntypes > 1 && i < ntypes; i++) {
+                    std::cout << "\t" << op_name(config.mix.types[i]) << "\t";
+                    print_latency(std::cout, type_latency[i]);
+                }
+                for (size_t i = 0; ntargets > 1 && i < ntargets; i++) {
+                    total_latency.clear();
+                    for (size_t t = 0; t < nthreads; t++) {
+                        stats[t].target_latency[i].snapshot(thread_latency);
+                        total_latency += thread_latency;
+                    }
+                    target_latency[i] = total_latency;
+                    target_latency[i].subtract(last_target_latency[i]);
+                    last_target_latency[i] = total_latency;
+                    std::cout << "\t" << config.servers[i] << "\t";
+                    print_latency(std::cout, target_latency[i]);
+                }
+                if (nic_timestamps) {
+                    total_latency.clear();
+                    for (size_t t = 0; t < nthreads; t++) {
+                        stats[t].nic_latency.snapshot(thread_latency);
+                        total_latency += thread_latency;
+                    }
+                    nic_latency = total_latency;
+                    nic_latency.subtract(last_nic_latency);
+                    last_nic_latency = total_latency;
+                    std::cout << "\tnic\t";
+                    print_latency(std::cout, nic_latency);
+                }
+                if (lock) {
+                    total_latency.clear();
+                    for (size_t t = 0; t < nthreads; t++) {
+                        stats[t].lock_acquire.snapshot(thread_latency);
+                        total_latency += thread_latency;
+                    }
+                    acquire_latency = total_latency;
+                    acquire_latency.subtract(last_acquire_latency);
+                    last_acquire_latency = total_latency;
+                    std::cout << "\tacquire\t";
+                    print_latency(std::cout, acquire_latency);
+                }
+                std::cout << "\t";
+                print_cpu(std::cout, cpu_ns, total, wall_ns);
+                std::cout << " (throughput = " << total << " ops/sec)";
+                if (config.reg_cache) {
+                    std::cout << " ";
+                    print_reg_cache(std::cout, reg_hits - last_reg_hits,
+                                    reg_misses - last_reg_misses);
+                }
+                if (app) {
+                    std::cout << " ";
+                    print_app(std::cout, config.app, total,
+                              app_wrs - last_app_wrs,
+                              lock_failures - last_lock_failures);
+                }
+                std::cout << '\n';
+            }
+            last_reg_hits = reg_hits;
+            last_reg_misses = reg_misses;
+            last_app_wrs = app_wrs;
+            last_lock_failures = lock_failures;
+            for (auto& counters : nic_counters) {
+                std::cout << "\t" << counters.name() << "\t";
+                counters.print(std::cout, total);
+                std::cout << '\n';
+            }
+            if (report) {
+                report->write(interval_record(
+                    "interval", tick, total, bytes - last_bytes, in_flight,
+                    cpu_ns, wall_ns, type == Type::LAT ? &latency : nullptr));
+                last_bytes = bytes;
+                in_flight_ticks += in_flight;
+            }
+            /* the interval histogram is only filled with -t lat */
+            if (control >= 0) {
+                LOG_ERR_EXIT(!send_stats(control, ControlType::INTERVAL,
+                                         {total, cpu_ns, wall_ns}, latency),
+                             errno, std::system_category());
             }
         }
         done = true;
     });
 
-    ibv_send_wr wr;
-    wr.wr_id = 0;
-    ibv_sge sge;
-    sge.lkey = mr->lkey;
-    if (opcode == IBV_WR_ATOMIC_CMP_AND_SWP ||
-        opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) {
-        LOG_ERR_EXIT(size.value != 8, EINVAL, std::system_category());
-        sge.length = 8;
-    } else {
-        sge.length = size.value;
-    }
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
-    wr.opcode = opcode;
-    wr.send_flags = inline_data ? IBV_SEND_INLINE : 0;
-    uint64_t* remote_addr = nullptr;
-    if (opcode == IBV_WR_ATOMIC_CMP_AND_SWP ||
-        opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) {
-        remote_addr = &wr.wr.atomic.remote_addr;
-        wr.wr.atomic.rkey = server_conn_data.rkey;
-        wr.wr.atomic.compare_add = 1;
-        wr.wr.atomic.swap = 1;
-    } else {
-        remote_addr = &wr.wr.rdma.remote_addr;
-        wr.wr.rdma.rkey = server_conn_data.rkey;
+    for (auto& worker_thread : worker_threads) {
+        worker_thread.join();
+    }
+    time_thread.join();
+    const uint64_t wall_ns = now_ns() - start_ns;
+
+    uint64_t total_operations = 0;
+    uint64_t total_cpu_ns = 0;
+    for (size_t t = 0; t < nthreads; t++) {
+        total_operations += stats[t].operations.load();
+        total_cpu_ns += stats[t].cpu_ns.load();
+    }
+    std::cout << "total\t";
+    print_cpu(std::cout, total_cpu_ns, total_operations, wall_ns);
+    std::cout << " (" << total_operations << " ops)\n";
+    for (auto& counters : nic_counters) {
+        counters.sample();
+        std::cout << "\t" << counters.name() << "\t";
+        counters.print(std::cout, total_operations, true);
+        std::cout << '\n';
+    }
+    if (report) {
+        HistogramSnapshot thread_latency, latency;
+        uint64_t bytes = 0;
+        for (size_t t = 0; t < nthreads; t++) {
+            bytes += stats[t].replay_bytes.load();
+            for (size_t i = 0; i < ntypes; i++) {
+                if (!replay) {
+                    bytes += stats[t].type_operations[i].load() *
+                             config.mix.types[i].size;
+                }
+                if (type == Type::LAT) {
+                    stats[t].latency[i].snapshot(thread_latency);
+                    latency += thread_latency;
+                }
+            }
+        }
+        report->write(interval_record(
+            "total", duration, total_operations, bytes,
+            duration ? in_flight_ticks / duration : 0, total_cpu_ns, wall_ns,
+            type == Type::LAT ? &latency : nullptr));
+        report->close();
+    }
+    if (control >= 0) {
+        HistogramSnapshot thread_latency, latency;
+        for (size_t t = 0; type == Type::LAT && t < nthreads; t++) {
+            for (size_t i = 0; i < ntypes; i++) {
+                stats[t].latency[i].snapshot(thread_latency);
+                latency += thread_latency;
+            }
+        }
+        LOG_ERR_EXIT(!send_stats(control, ControlType::FINAL,
+                                 {total_operations, total_cpu_ns, wall_ns},
+                                 latency),
+                     errno, std::system_category());
+        close(control);
+    }
+    if (config.reg_cache) {
+        uint64_t hits = 0, misses = 0, evictions = 0;
+        for (size_t t = 0; t < nthreads; t++) {
+            hits += stats[t].reg_hits.load();
+            misses += stats[t].reg_misses.load();
+            evictions += stats[t].reg_evictions.load();
+        }
+        std::cout << "\t";
+        print_reg_cache(std::cout, hits, misses);
+        std::cout << " (" << evictions << " evictions)\n";
+    }
+    for (size_t i = 0; ntargets > 1 && i < ntargets; i++) {
+        uint64_t ops = 0;
+        for (size_t t = 0; t < nthreads; t++) {
+            ops += stats[t].target_operations[i].load();
+        }
+        std::cout << "\t" << config.servers[i] << "\t" << ops << " ops ("
+                  << (total_operations ? 100 * ops / total_operations : 0)
+                  << "%)\n";
     }
 
-    size_t cq_mod = vm["cq_mod"].as<size_t>();
-    size_t in_flight = 0;
-    size_t posted = 1;
-    ibv_wc* wc = new ibv_wc[tx_depth];
-    std::vector<uint64_t> in_flight_times;
-    in_flight_times.resize(tx_depth);
-    auto times_iter = in_flight_times.begin();
-    while (true) {
+    if (config.rate > 0.0) {
+        uint64_t max_backlog = 0;
+        for (size_t t = 0; t < nthreads; t++) {
+            max_backlog = std::max(max_backlog, stats[t].max_backlog.load());
+        }
+        std::cout << "max backlog per thread = " << max_backlog << " ops\n";
+    }
 
-        /* 1. post */
-        while (in_flight < tx_depth) {
-            if (location_index == location_indices.cend()) {
-                location_index = location_indices.cbegin();
+    if (type == Type::LAT) {
+        HistogramSnapshot thread_latency, latency;
+        std::vector<HistogramSnapshot> type_latency(ntypes);
+        for (size_t i = 0; i < ntypes; i++) {
+            for (size_t t = 0; t < nthreads; t++) {
+                stats[t].latency[i].snapshot(thread_latency);
+                type_latency[i] += thread_latency;
             }
-            /* local location */
-            sge.addr = reinterpret_cast<uint64_t>(mr->addr);
-            if (location_indices.size() > 1) {
-                sge.addr += *location_index * aligned_size;
+            latency += type_latency[i];
+        }
+        std::cout << "total\t";
+        print_latency(std::cout, latency);
+        for (size_t i = 0; ntypes > 1 && i < ntypes; i++) {
+            std::cout << "\t" << op_name(config.mix.types[i]) << "\t";
+            print_latency(std::cout, type_latency[i]);
+        }
+        for (size_t i = 0; ntargets > 1 && i < ntargets; i++) {
+            HistogramSnapshot target_latency;
+            for (size_t t = 0; t < nthreads; t++) {
+                stats[t].target_latency[i].snapshot(thread_latency);
+                target_latency += thread_latency;
             }
-            /* remote location */
-            *remote_addr =
-                server_conn_data.address + aligned_size** location_index;
-            if (posted % cq_mod == 0) {
-                wr.send_flags |= IBV_SEND_SIGNALED;
-            } else {
-                wr.send_flags &= ~IBV_SEND_SIGNALED;
+            std::cout << "\t" << config.servers[i] << "\t";
+            print_latency(std::cout, target_latency);
+        }
+        if (nic_timestamps) {
+            HistogramSnapshot nic_latency;
+            for (size_t t = 0; t < nthreads; t++) {
+                stats[t].nic_latency.snapshot(thread_latency);
+                nic_latency += thread_latency;
             }
-            ibv_send_wr* bad_wr;
-            int ret;
-            if (type == Type::LAT) {
-                if (times_iter == in_flight_times.end()) {
-                    times_iter = in_flight_times.begin();
-                }
-                using namespace std::chrono;
-                auto now = high_resolution_clock::now();
-                *times_iter++ =
-                    duration_cast<nanoseconds>(now.time_since_epoch()).count();
+            std::cout << "\tnic\t";
+            print_latency(std::cout, nic_latency);
+        }
+        if (lock) {
+            HistogramSnapshot acquire_latency;
+            for (size_t t = 0; t < nthreads; t++) {
+                stats[t].lock_acquire.snapshot(thread_latency);
+                acquire_latency += thread_latency;
             }
-            wr.wr_id = std::distance(in_flight_times.begin(), times_iter) - 1;
-            LOG_ERR_EXIT((ret = ibv_post_send(id->qp, &wr, &bad_wr)), ret,
-                         std::system_category());
-            posted++;
-            location_index++;
-            in_flight++;
+            std::cout << "\tacquire\t";
+            print_latency(std::cout, acquire_latency);
+        }
+        if (vm.count("hist_file")) {
+            std::ofstream hist_file(vm["hist_file"].as<std::string>());
+            LOG_ERR_EXIT(!hist_file, errno, std::system_category());
+            latency.dump(hist_file);
         }
+    }
 
-        /* 2. poll */
-        int polled;
-        do {
-            LOG_ERR_EXIT(((polled = ibv_poll_cq(cq, tx_depth, wc)) < 0), errno,
-                         std::system_category());
-            if (done) {
-                goto end;
+    /* Fails the run on a bad stamp or on a counter that grew less than
+     * the fadds this client issued to it. Other clients at the same time
+     * can only add to a counter: the sum over all clients' issued fadds
+     * then has to match what the last one to finish reads. */
+    bool verified = true;
+    if (config.verify) {
+        uint64_t checked = 0, errors = 0, cas_success = 0, cas_failure = 0;
+        for (size_t t = 0; t < nthreads; t++) {
+            checked += stats[t].verify_checked.load();
+            errors += stats[t].verify_errors.load();
+            cas_success += stats[t].cas_success.load();
+            cas_failure += stats[t].cas_failure.load();
+        }
+        std::cout << "verify\t" << checked << " reads checked, " << errors
+                  << " bad";
+        if (verify_cas) {
+            const uint64_t cas = cas_success + cas_failure;
+            std::cout << ", cas " << cas_success << " succeeded, "
+                      << cas_failure << " failed ("
+                      << (cas ? 100 * cas_success / cas : 0) << "% success)";
+        }
+        std::cout << '\n';
+        verified = !errors;
+        for (size_t s = 0; reconcile && s < ntargets; s++) {
+            uint64_t issued = 0;
+            for (size_t t = 0; t < nthreads; t++) {
+                issued += stats[t].verify_fadds[s].load();
             }
-        } while (polled == 0);
-        for (int i = 0; i < polled; i++) {
-            LOG_ERR_EXIT(wc[i].status != IBV_WC_SUCCESS, wc[i].status,
-                         ibv_wc_error_category());
-            in_flight -= cq_mod;
-            if (type == Type::BW) {
-                operations += cq_mod;
-            } else if (type == Type::LAT) {
-                if (times.load()->size() < sample_size) {
-                    using namespace std::chrono;
-                    auto now = high_resolution_clock::now();
-                    times.load()->push_back(
-                        duration_cast<nanoseconds>(now.time_since_epoch())
-                            .count() -
-                        in_flight_times[wc[i].wr_id]);
-                }
+            const uint64_t grown =
+                read_counters(workers[0], s, fadd_locations[s],
+                              config.aligned_size) -
+                counters_before[s];
+            std::cout << "\tfadd " << config.servers[s] << "\t" << issued
+                      << " issued, counters +" << grown;
+            if (grown == issued) {
+                std::cout << " (ok)\n";
+            } else if (grown > issued) {
+                std::cout << " (+" << grown - issued
+                          << " from other clients)\n";
+            } else {
+                std::cout << " (" << issued - grown << " lost)\n";
+                verified = false;
             }
         }
     }
-end:
-    time_thread.join();
-    delete[] wc;
-    return 0;
+
+    /* -app lock: a release that finds another owner means the lock did not
+     * exclude, i.e. something else wrote the lock word */
+    if (app) {
+        uint64_t wrs = 0, failures = 0, max_attempts = 0, errors = 0;
+        for (size_t t = 0; t < nthreads; t++) {
+            wrs += stats[t].app_wrs.load();
+            failures += stats[t].lock_failures.load();
+            max_attempts =
+                std::max(max_attempts, stats[t].lock_max_attempts.load());
+            errors += stats[t].lock_errors.load();
+        }
+        std::cout << "app\t" << config.app << "\t";
+        print_app(std::cout, config.app, total_operations, wrs, failures);
+        if (lock) {
+            std::cout << " (" << total_operations
+                      << " acquired, max attempts = " << max_attempts << ", "
+                      << errors << " broken)";
+        } else if (type == Type::LAT) {
+            HistogramSnapshot thread_latency, latency;
+            for (size_t t = 0; t < nthreads; t++) {
+                stats[t].latency[0].snapshot(thread_latency);
+                latency += thread_latency;
+            }
+            std::cout << " (" << static_cast<uint64_t>(latency.mean() /
+                                                       config.app.n)
+                      << "ns per hop)";
+        }
+        std::cout << '\n';
+        verified = verified && !errors;
+    }
+    return verified ? 0 : EXIT_FAILURE;
 }
@@ -0,0 +1,77 @@
+#ifndef CM_QP_H
+#define CM_QP_H
+
+#include <cerrno>
+
+#include <rdma/rdma_cma.h>
+
+#include <infiniband/verbs.h>
+
+#include <common.h>
+
+/* UC and XRC QPs, and the server's shared UD QPs, are created outside of
+ * librdmacm, which only drives RC and per-id UD QPs itself. rdma_cm still
+ * does the handshake, the QP number travels in rdma_conn_param::qp_num,
+ * and the application moves the QP through its states with the attributes
+ * the CM computed. */
+
+inline ibv_qp_type verbs_qp_type(QpType t, bool initiator) {
+    switch (t) {
+    case QpType::UC:
+        return IBV_QPT_UC;
+    case QpType::UD:
+        return IBV_QPT_UD;
+    case QpType::XRC:
+        return initiator ? IBV_QPT_XRC_SEND : IBV_QPT_XRC_RECV;
+    default:
+        return IBV_QPT_RC;
+    }
+}
+
+/* rdma_init_qp_attr returns RC attributes, UC and XRC take a subset of
+ * them per state. A UD QP only gets its port, pkey and qkey from the CM
+ * for INIT, RTR and RTS take nothing but the send PSN, as librdmacm does
+ * for its own. 0 or an errno value. */
+inline int modify_qp_cm(rdma_cm_id* id, ibv_qp* qp, ibv_qp_type type,
+                        ibv_qp_state state) {
+    ibv_qp_attr attr = {};
+    int mask;
+    attr.qp_state = state;
+    if (type == IBV_QPT_UD && state != IBV_QPS_INIT) {
+        mask = IBV_QP_STATE;
+        if (state == IBV_QPS_RTS) {
+            attr.sq_psn = 0;
+            mask |= IBV_QP_SQ_PSN;
+        }
+        return ibv_modify_qp(qp, &attr, mask) ? errno : 0;
+    }
+    if (rdma_init_qp_attr(id, &attr, &mask)) {
+        return errno;
+    }
+    switch (state) {
+    case IBV_QPS_INIT:
+        if (type == IBV_QPT_UC) {
+            attr.qp_access_flags &= IBV_ACCESS_REMOTE_WRITE;
+        }
+        break;
+    case IBV_QPS_RTR:
+        if (type == IBV_QPT_UC || type == IBV_QPT_XRC_SEND) {
+            mask &= ~(IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+        }
+        break;
+    case IBV_QPS_RTS:
+        if (type == IBV_QPT_UC) {
+            mask &= ~(IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |
+                      IBV_QP_MAX_QP_RD_ATOMIC);
+        } else if (type == IBV_QPT_XRC_RECV) {
+            mask &= ~(IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |
+                      IBV_QP_MAX_QP_RD_ATOMIC);
+        }
+        break;
+    default:
+        break;
+    }
+    return ibv_modify_qp(qp, &attr, mask) ? errno : 0;
+}
+
+#endif /* CM_QP_H */
@@ -5,8 +5,11 @@
 #include <cstdint>
 #include <iostream>
 #include <sstream>
+#include <string>
 #include <system_error>
 
+#include <boost/algorithm/string.hpp>
+
 #include <psl/net.h>
 
 #include <infiniband/verbs.h>
@@ -14,6 +17,7 @@
 constexpr size_t max_send_wr = 128;
 constexpr size_t max_recv_wr = 512;
 constexpr size_t alloc_alignment = 4096;
+constexpr size_t cache_line_size = 64;
 
 constexpr psl::net::in_port_t default_port = {13345};
 
@@ -21,16 +25,71 @@ struct Bytes {
     size_t value;
 };
 
+/* QP type of a connection, RC unless the client asks for another one */
+enum class QpType : uint8_t { RC, UC, UD, XRC };
+
+/* UD receives are prefixed by the global routing header */
+constexpr size_t ud_grh_size = 40;
+
+inline std::ostream& operator<<(std::ostream& out, const QpType& t) {
+    const char* names[] = {"rc", "uc", "ud", "xrc"};
+    out << names[static_cast<uint8_t>(t)];
+    return out;
+}
+
+inline std::istream& operator>>(std::istream& in, QpType& t) {
+    std::string str;
+    in >> str;
+    if (boost::iequals("rc", str)) {
+        t = QpType::RC;
+    } else if (boost::iequals("uc", str)) {
+        t = QpType::UC;
+    } else if (boost::iequals("ud", str)) {
+        t = QpType::UD;
+    } else if (boost::iequals("xrc", str)) {
+        t = QpType::XRC;
+    } else {
+        in.setstate(std::ios_base::failbit);
+    }
+    return in;
+}
+
+/* UC has no reads and atomics, UD only sends. The server's XRC SRQ takes
+ * no receives, so no sends there. */
+inline bool qp_type_supports(QpType t, ibv_wr_opcode opcode) {
+    switch (t) {
+    case QpType::RC:
+        return true;
+    case QpType::UC:
+        return opcode == IBV_WR_RDMA_WRITE || opcode == IBV_WR_SEND;
+    case QpType::UD:
+        return opcode == IBV_WR_SEND;
+    case QpType::XRC:
+        return opcode != IBV_WR_SEND;
+    }
+    return false;
+}
+
 struct ServerConnectionData {
     bool inline_data;
     uint64_t address;
     uint64_t size;
     uint32_t rkey;
+    /* largest message a two-sided client may send */
+    uint32_t recv_size;
+    /* node stride of the pointer chain in the memory (-chase), 0 = none */
+    uint32_t chase_stride;
+    /* XRC: the SRQ every wr has to name */
+    uint32_t xrc_srqn;
 };
 
 struct ClientConnectionData {
     bool send;
     ssize_t locations;
+    /* two-sided only: server replies to every message with an echo */
+    bool echo;
+    uint32_t tx_depth;
+    QpType qp_type;
 };
 
 template <typename T> inline T align(T t, T a) {
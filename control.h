@@ -0,0 +1,190 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <histogram.h>
+
+/* Coordinated runs (-control): clients register with the coordinator of
+ * the server over TCP and block until the whole group is there. All of
+ * them then start at once, run for the same window and upload their stats
+ * every interval and at the end, which the server merges. A message is a
+ * ControlHeader and length bytes of payload, in host byte order like the
+ * connection private data. */
+enum class ControlType : uint32_t { HELLO, START, INTERVAL, FINAL };
+
+struct ControlHeader {
+    ControlType type;
+    uint32_t length;
+};
+
+/* client -> server, once connected */
+struct ControlHello {
+    uint32_t threads;
+    /* -d, the group runs for the longest one */
+    uint32_t duration;
+};
+
+/* server -> every client of the group, the start barrier */
+struct ControlStart {
+    uint32_t client;
+    uint32_t clients;
+    uint32_t duration;
+};
+
+/* client -> server, every interval and once more with the run's totals,
+ * followed by the HistogramSnapshot::encode() words of the latency */
+struct ControlStats {
+    uint64_t ops;
+    uint64_t cpu_ns;
+    uint64_t wall_ns;
+};
+
+/* a payload is never larger, a full latency histogram included */
+constexpr size_t max_control_message = 1 << 20;
+
+/* TCP socket on addr, listening or connected, -1 and errno on failure */
+inline int control_listen(const sockaddr_in& addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    if (fd < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+        bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) ||
+        listen(fd, SOMAXCONN)) {
+        int err = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+inline int control_connect(const sockaddr_in& addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    if (fd < 0 ||
+        connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) ||
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))) {
+        int err = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/* false and errno on failure, EPIPE when the peer went away */
+inline bool write_full(int fd, const void* buf, size_t n) {
+    const char* p = static_cast<const char*>(buf);
+    while (n) {
+        ssize_t ret = send(fd, p, n, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        p += ret;
+        n -= ret;
+    }
+    return true;
+}
+
+inline bool read_full(int fd, void* buf, size_t n) {
+    char* p = static_cast<char*>(buf);
+    while (n) {
+        ssize_t ret = recv(fd, p, n, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            if (!ret) {
+                errno = EPIPE;
+            }
+            return false;
+        }
+        p += ret;
+        n -= ret;
+    }
+    return true;
+}
+
+inline bool send_control(int fd, ControlType type, const void* payload,
+                         size_t length) {
+    ControlHeader header = {type, static_cast<uint32_t>(length)};
+    return write_full(fd, &header, sizeof(header)) &&
+           write_full(fd, payload, length);
+}
+
+/* false and errno on failure, EPROTO for anything but a message */
+inline bool recv_control(int fd, ControlType& type,
+                         std::vector<char>& payload) {
+    ControlHeader header;
+    if (!read_full(fd, &header, sizeof(header))) {
+        return false;
+    }
+    if (header.length > max_control_message) {
+        errno = EPROTO;
+        return false;
+    }
+    type = header.type;
+    payload.resize(header.length);
+    return read_full(fd, payload.data(), payload.size());
+}
+
+/* a message whose payload is exactly a T */
+template <typename T>
+inline bool recv_control(int fd, ControlType expected, T& message) {
+    ControlType type;
+    std::vector<char> payload;
+    if (!recv_control(fd, type, payload)) {
+        return false;
+    }
+    if (type != expected || payload.size() != sizeof(T)) {
+        errno = EPROTO;
+        return false;
+    }
+    std::memcpy(&message, payload.data(), sizeof(T));
+    return true;
+}
+
+inline bool send_stats(int fd, ControlType type, const ControlStats& stats,
+                       const HistogramSnapshot& latency) {
+    std::vector<uint64_t> words;
+    latency.encode(words);
+    std::vector<char> payload(sizeof(stats) + words.size() * sizeof(words[0]));
+    std::memcpy(payload.data(), &stats, sizeof(stats));
+    std::memcpy(payload.data() + sizeof(stats), words.data(),
+                words.size() * sizeof(words[0]));
+    return send_control(fd, type, payload.data(), payload.size());
+}
+
+/* false if the payload is not what send_stats() sent */
+inline bool parse_stats(const std::vector<char>& payload, ControlStats& stats,
+                        HistogramSnapshot& latency) {
+    if (payload.size() < sizeof(stats) ||
+        (payload.size() - sizeof(stats)) % sizeof(uint64_t)) {
+        return false;
+    }
+    std::memcpy(&stats, payload.data(), sizeof(stats));
+    std::vector<uint64_t> words((payload.size() - sizeof(stats)) /
+                                sizeof(uint64_t));
+    std::memcpy(words.data(), payload.data() + sizeof(stats),
+                words.size() * sizeof(uint64_t));
+    return latency.decode(words.data(), words.size());
+}
+
+#endif /* CONTROL_H */
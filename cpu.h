@@ -0,0 +1,181 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <boost/algorithm/string.hpp>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+/* cpu[,cpu...] with a-b ranges, e.g. 0-3,8 */
+struct CpuList {
+    std::vector<int> cpus;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const CpuList& list) {
+    for (size_t i = 0; i < list.cpus.size(); i++) {
+        out << (i ? "," : "") << list.cpus[i];
+    }
+    return out;
+}
+
+inline std::istream& operator>>(std::istream& in, CpuList& list) {
+    std::string str;
+    in >> str;
+    std::vector<std::string> entries;
+    boost::split(entries, str, boost::is_any_of(","));
+    list.cpus.clear();
+    for (auto& entry : entries) {
+        std::vector<std::string> fields;
+        boost::split(fields, entry, boost::is_any_of("-"));
+        std::stringstream lo_ss(fields[0]);
+        std::stringstream hi_ss(fields.size() > 1 ? fields[1] : fields[0]);
+        int lo, hi;
+        if (fields.size() > 2 || !(lo_ss >> lo) || !(hi_ss >> hi) || lo < 0 ||
+            lo > hi || hi >= CPU_SETSIZE) {
+            in.setstate(std::ios_base::failbit);
+            return in;
+        }
+        for (int cpu = lo; cpu <= hi; cpu++) {
+            list.cpus.push_back(cpu);
+        }
+    }
+    return in;
+}
+
+/* 0 or an errno value */
+inline int pin_thread(std::thread& thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+}
+
+/* CPU time (user + system) a running thread has consumed so far, can be
+ * read from any other thread, unlike getrusage(RUSAGE_THREAD). */
+inline uint64_t thread_cpu_ns(std::thread& thread) {
+    clockid_t clock;
+    timespec ts;
+    if (pthread_getcpuclockid(thread.native_handle(), &clock) ||
+        clock_gettime(clock, &ts)) {
+        return 0;
+    }
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+inline uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* rdtscp waits for earlier instructions, a completion time cannot be read
+ * before the poll that saw the completion */
+inline uint64_t read_tsc() {
+    unsigned aux;
+    return __rdtscp(&aux);
+}
+
+/* The TSC ticks at a constant rate through P- and C-state changes only if
+ * CPUID says it is invariant, otherwise it is no clock. */
+inline bool invariant_tsc() {
+    unsigned eax, ebx, ecx, edx;
+    return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) &&
+           (edx & (1u << 8));
+}
+
+/* TSC and CLOCK_MONOTONIC at the same instant: the clock read with the
+ * tightest TSC bracket out of a few */
+inline void tsc_sample(uint64_t& cycles, uint64_t& ns) {
+    uint64_t best = UINT64_MAX;
+    cycles = ns = 0;
+    for (int i = 0; i < 32; i++) {
+        const uint64_t before = read_tsc();
+        const uint64_t t = monotonic_ns();
+        const uint64_t after = read_tsc();
+        if (after - before < best) {
+            best = after - before;
+            cycles = before + best / 2;
+            ns = t;
+        }
+    }
+}
+#endif
+
+/* TSC rate and the CLOCK_MONOTONIC time of one TSC value, calibrated once
+ * over 50ms. tsc is only set for an invariant TSC. */
+struct TscClock {
+    bool tsc;
+    double cycles_per_ns;
+    double ns_per_cycle;
+    uint64_t base_cycles;
+    uint64_t base_ns;
+};
+
+inline const TscClock& tsc_clock() {
+    static const TscClock clock = [] {
+        TscClock c = {};
+#if defined(__x86_64__) || defined(__i386__)
+        uint64_t start_cycles, start_ns;
+        tsc_sample(start_cycles, start_ns);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        tsc_sample(c.base_cycles, c.base_ns);
+        c.cycles_per_ns = static_cast<double>(c.base_cycles - start_cycles) /
+                          (c.base_ns - start_ns);
+        c.ns_per_cycle = 1.0 / c.cycles_per_ns;
+        c.tsc = invariant_tsc();
+#endif
+        return c;
+    }();
+    return clock;
+}
+
+/* Reference cycles per ns (the TSC rate) to express CPU time as cycles.
+ * 0 where there is no TSC. */
+inline double cycles_per_ns() { return tsc_clock().cycles_per_ns; }
+
+/* Hot path timestamps in ns on the CLOCK_MONOTONIC time line: a TSC read
+ * and a multiply where the TSC is invariant, clock_gettime otherwise. The
+ * TSCs of all cores are synchronized then, a read on another core than
+ * the calibration may still be a few cycles behind it. */
+inline uint64_t now_ns() {
+#if defined(__x86_64__) || defined(__i386__)
+    const TscClock& clock = tsc_clock();
+    if (clock.tsc) {
+        const int64_t cycles = read_tsc() - clock.base_cycles;
+        return clock.base_ns +
+               static_cast<int64_t>(cycles * clock.ns_per_cycle);
+    }
+#endif
+    return monotonic_ns();
+}
+
+/* mean cost of one clock read in ns */
+template <typename Clock> inline double clock_overhead_ns(Clock clock) {
+    constexpr int reads = 1 << 20;
+    uint64_t sink = 0;
+    const uint64_t start = monotonic_ns();
+    for (int i = 0; i < reads; i++) {
+        sink += clock();
+    }
+    const uint64_t elapsed = monotonic_ns() - start;
+    /* keep the reads */
+    __asm__ __volatile__("" : : "r"(sink));
+    return static_cast<double>(elapsed) / reads;
+}
+
+#endif /* CPU_H */
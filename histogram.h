@@ -0,0 +1,232 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include <psl/terminal.h>
+
+/* Log-linear (HDR style) histogram layout: values below 2^sub_bucket_bits
+ * are counted exactly, above that every power of two is split into
+ * 2^(sub_bucket_bits - 1) linear buckets, i.e. the relative error is
+ * bounded by 2^-(sub_bucket_bits - 1) (< 1%). */
+namespace histogram {
+
+constexpr unsigned sub_bucket_bits = 8;
+constexpr size_t half_sub_bucket_count = size_t{1} << (sub_bucket_bits - 1);
+constexpr size_t bucket_count =
+    (64 - sub_bucket_bits + 2) * half_sub_bucket_count;
+
+inline size_t index(uint64_t value) {
+    if (value < (uint64_t{1} << sub_bucket_bits)) {
+        return value;
+    }
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned e = msb - sub_bucket_bits + 1;
+    return (static_cast<size_t>(e) << (sub_bucket_bits - 1)) + (value >> e);
+}
+
+/* smallest value that maps to bucket i */
+inline uint64_t lowest_value(size_t i) {
+    if (i < (size_t{1} << sub_bucket_bits)) {
+        return i;
+    }
+    unsigned e = (i >> (sub_bucket_bits - 1)) - 1;
+    uint64_t m = i - (static_cast<size_t>(e) << (sub_bucket_bits - 1));
+    return m << e;
+}
+
+/* largest value that maps to bucket i */
+inline uint64_t highest_value(size_t i) {
+    if (i < (size_t{1} << sub_bucket_bits)) {
+        return i;
+    }
+    unsigned e = (i >> (sub_bucket_bits - 1)) - 1;
+    return lowest_value(i) + (uint64_t{1} << e) - 1;
+}
+
+} // namespace histogram
+
+/* Plain (non-concurrent) copy of histogram counts the reporter works on. */
+class HistogramSnapshot {
+  public:
+    HistogramSnapshot() : counts_(histogram::bucket_count, 0) {}
+
+    uint64_t count() const { return count_; }
+    uint64_t max() const { return max_; }
+
+    double mean() const {
+        return count_ ? static_cast<double>(sum_) / count_ : 0.0;
+    }
+
+    /* highest equivalent value below which p percent of samples fall */
+    uint64_t percentile(double p) const {
+        if (!count_) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(p / 100.0 * count_ + 0.5);
+        rank = std::max<uint64_t>(1, std::min(rank, count_));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); i++) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                return std::min(histogram::highest_value(i), max_);
+            }
+        }
+        return max_;
+    }
+
+    HistogramSnapshot& operator+=(const HistogramSnapshot& other) {
+        for (size_t i = 0; i < counts_.size(); i++) {
+            counts_[i] += other.counts_[i];
+        }
+        count_ += other.count_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+        return *this;
+    }
+
+    /* Turn a cumulative snapshot into the interval since previous. The
+     * interval max is the highest populated bucket (bucket precision). */
+    void subtract(const HistogramSnapshot& previous) {
+        max_ = 0;
+        for (size_t i = 0; i < counts_.size(); i++) {
+            counts_[i] -= previous.counts_[i];
+            if (counts_[i]) {
+                max_ = histogram::highest_value(i);
+            }
+        }
+        count_ -= previous.count_;
+        sum_ -= previous.sum_;
+    }
+
+    void clear() {
+        std::fill(counts_.begin(), counts_.end(), 0);
+        count_ = sum_ = max_ = 0;
+    }
+
+    /* count, sum, max and index/count pairs of the populated buckets, to
+     * ship a snapshot to another process */
+    void encode(std::vector<uint64_t>& words) const {
+        words = {count_, sum_, max_};
+        for (size_t i = 0; i < counts_.size(); i++) {
+            if (counts_[i]) {
+                words.push_back(i);
+                words.push_back(counts_[i]);
+            }
+        }
+    }
+
+    /* false if the n words are not something encode() produced */
+    bool decode(const uint64_t* words, size_t n) {
+        clear();
+        if (n < 3 || (n - 3) % 2) {
+            return false;
+        }
+        count_ = words[0];
+        sum_ = words[1];
+        max_ = words[2];
+        for (size_t i = 3; i < n; i += 2) {
+            if (words[i] >= counts_.size()) {
+                return false;
+            }
+            counts_[words[i]] += words[i + 1];
+        }
+        return true;
+    }
+
+    /* value_lo value_hi count cumulative_fraction, one populated bucket
+     * per line */
+    void dump(std::ostream& out) const {
+        uint64_t seen = 0;
+        out << "# value_lo(ns)\tvalue_hi(ns)\tcount\tcumulative\n";
+        for (size_t i = 0; i < counts_.size(); i++) {
+            if (!counts_[i]) {
+                continue;
+            }
+            seen += counts_[i];
+            out << histogram::lowest_value(i) << '\t'
+                << histogram::highest_value(i) << '\t' << counts_[i] << '\t'
+                << static_cast<double>(seen) / count_ << '\n';
+        }
+        out << "# count = " << count_ << " mean = " << mean()
+            << " max = " << max_ << '\n';
+    }
+
+  private:
+    friend class Histogram;
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+};
+
+/* Cumulative histogram with a single writer (the poller thread) and any
+ * number of readers. Recording is wait-free: relaxed load/store pairs, no
+ * read-modify-write. Readers take snapshots and diff them against the
+ * previous one to obtain interval histograms, so the writer never has to
+ * be paused or swapped out. */
+class Histogram {
+  public:
+    Histogram() {
+        for (auto& c : counts_) {
+            c.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void record(uint64_t value) {
+        auto& c = counts_[histogram::index(value)];
+        c.store(c.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+        sum_.store(sum_.load(std::memory_order_relaxed) + value,
+                   std::memory_order_relaxed);
+        if (value > max_.load(std::memory_order_relaxed)) {
+            max_.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    void snapshot(HistogramSnapshot& s) const {
+        s.sum_ = sum_.load(std::memory_order_relaxed);
+        s.max_ = max_.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < counts_.size(); i++) {
+            s.counts_[i] = counts_[i].load(std::memory_order_relaxed);
+        }
+        /* the count is derived from the buckets so it always matches them */
+        uint64_t n = 0;
+        for (auto c : s.counts_) {
+            n += c;
+        }
+        s.count_ = n;
+    }
+
+  private:
+    std::array<std::atomic<uint64_t>, histogram::bucket_count> counts_;
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+};
+
+/* the percentiles every latency line shows */
+constexpr std::pair<const char*, double> latency_percentiles[] = {
+    {"p50", 50.0}, {"p90", 90.0}, {"p99", 99.0}, {"p99.9", 99.9},
+    {"p99.99", 99.99}};
+
+inline void print_latency(std::ostream& out, const HistogramSnapshot& h) {
+    using namespace psl::terminal;
+    for (auto& p : latency_percentiles) {
+        out << graphic_format::GREEN << graphic_format::BOLD << p.first
+            << " = " << graphic_format::WHITE << h.percentile(p.second)
+            << "ns ";
+    }
+    out << graphic_format::GREEN << "max = " << graphic_format::WHITE
+        << h.max() << "ns" << graphic_format::GREEN
+        << " average = " << graphic_format::WHITE << h.mean() << "ns"
+        << graphic_format::RESET << " (sample size = " << h.count() << ")\n";
+}
+
+#endif /* HISTOGRAM_H */
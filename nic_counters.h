@@ -0,0 +1,207 @@
+#ifndef NIC_COUNTERS_H
+#define NIC_COUNTERS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+
+#include <psl/terminal.h>
+
+/* -counters: the port counters (counters/, IB PMA) and the driver's
+ * hardware counters (hw_counters/) of an RDMA port in sysfs, sampled once
+ * per interval next to the benchmark's own numbers. They tell why a run
+ * got slower: retransmits, congestion notifications, pause or wait time,
+ * discards. */
+constexpr const char* sysfs_infiniband = "/sys/class/infiniband";
+
+/* port_xmit_data and port_rcv_data count 4 byte words */
+constexpr uint64_t port_data_word = 4;
+
+/* The port_* counters of counters/ come from the PMA. Without extended
+ * counters the data and packet ones are 32 bits wide and wrap; a counter
+ * read below 2^32 is taken to be one of those. */
+constexpr const char* pma_prefix = "port_";
+constexpr uint64_t pma_counter_range = uint64_t{1} << 32;
+
+/* Counters of a lost or repeated packet: the requester timed out or got a
+ * sequence NAK, the responder saw a packet out of sequence or twice. Each
+ * one means a retransmit on one end or the other. */
+constexpr const char* retransmit_counters[] = {
+    "local_ack_timeout_err", "packet_seq_err", "implied_nak_seq_err",
+    "out_of_sequence", "duplicate_request"};
+
+/* traffic itself, shown as wire bytes instead of one by one */
+constexpr const char* traffic_counters[] = {
+    "port_xmit_data",         "port_rcv_data",
+    "port_xmit_packets",      "port_rcv_packets",
+    "unicast_xmit_packets",   "unicast_rcv_packets",
+    "multicast_xmit_packets", "multicast_rcv_packets"};
+
+/* names of the entries of a directory, empty if there is none */
+inline std::vector<std::string> list_dir(const std::string& path) {
+    std::vector<std::string> names;
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        return names;
+    }
+    while (dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+/* every port of every RDMA device of the host */
+inline std::vector<std::pair<std::string, unsigned>> all_ports() {
+    std::vector<std::pair<std::string, unsigned>> ports;
+    for (auto& device : list_dir(sysfs_infiniband)) {
+        const std::string dir =
+            std::string(sysfs_infiniband) + "/" + device + "/ports";
+        for (auto& port : list_dir(dir)) {
+            ports.push_back({device, static_cast<unsigned>(std::stoul(port))});
+        }
+    }
+    return ports;
+}
+
+/* The counters of one port. Construction reads them all once, that is
+ * where the totals start; counters that cannot be read are left out. Only
+ * one thread may sample. */
+class PortCounters {
+  public:
+    PortCounters(const std::string& device, unsigned port)
+        : name_(device + ":" + std::to_string(port)) {
+        const std::string dir = std::string(sysfs_infiniband) + "/" + device +
+                                "/ports/" + std::to_string(port) + "/";
+        for (const char* group : {"counters", "hw_counters"}) {
+            for (auto& name : list_dir(dir + group)) {
+                Counter counter = {name, dir + group + "/" + name,
+                                   std::string(group) == "counters" &&
+                                       name.compare(0, std::strlen(pma_prefix),
+                                                    pma_prefix) == 0,
+                                   0, 0, 0, false, 0};
+                if (read(counter.path, counter.last)) {
+                    counters_.push_back(counter);
+                }
+            }
+        }
+    }
+
+    const std::string& name() const { return name_; }
+    /* false if the port has no counters at all, e.g. no such port */
+    bool empty() const { return counters_.empty(); }
+
+    /* Deltas since the last sample. A 32 bit PMA counter that went back
+     * wrapped, any other counter was reset (e.g. perfquery -R): its
+     * interval is unknown, it is skipped and flagged by print(). */
+    void sample() {
+        for (auto& counter : counters_) {
+            uint64_t value;
+            if (!read(counter.path, value)) {
+                continue;
+            }
+            counter.reset = false;
+            if (value >= counter.last) {
+                counter.delta = value - counter.last;
+            } else if (counter.pma && counter.last < pma_counter_range) {
+                counter.delta = pma_counter_range - counter.last + value;
+            } else {
+                counter.delta = 0;
+                counter.reset = true;
+                counter.resets++;
+            }
+            counter.total += counter.delta;
+            counter.last = value;
+        }
+    }
+
+    /* The last sample's deltas, or with total the sum of all samples:
+     * bytes on the wire (both directions), retransmit events and every
+     * other counter that moved. With ops, per op and per million ops. */
+    void print(std::ostream& out, uint64_t ops, bool total = false) const {
+        using namespace psl::terminal;
+        auto value = [total](const Counter& c) {
+            return total ? c.total : c.delta;
+        };
+        uint64_t bytes = 0, retransmits = 0;
+        std::vector<const Counter*> others;
+        for (auto& counter : counters_) {
+            const std::string& name = counter.name;
+            if (name == "port_xmit_data" || name == "port_rcv_data") {
+                bytes += value(counter) * port_data_word;
+            } else if (std::find(std::begin(retransmit_counters),
+                                 std::end(retransmit_counters),
+                                 name) != std::end(retransmit_counters)) {
+                retransmits += value(counter);
+            } else if (value(counter) &&
+                       std::find(std::begin(traffic_counters),
+                                 std::end(traffic_counters),
+                                 name) == std::end(traffic_counters)) {
+                others.push_back(&counter);
+            }
+        }
+        out << graphic_format::GREEN << graphic_format::BOLD << "wire = "
+            << graphic_format::WHITE << bytes << " bytes";
+        if (ops) {
+            out << " (" << bytes / ops << "/op)";
+        }
+        out << graphic_format::GREEN << graphic_format::BOLD
+            << " retransmits = " << graphic_format::WHITE << retransmits;
+        if (ops) {
+            out << " (" << retransmits * 1000000 / ops << "/Mops)";
+        }
+        out << graphic_format::RESET;
+        for (auto counter : others) {
+            out << " " << counter->name << " = " << value(*counter);
+        }
+        /* counters missing from the numbers above */
+        const char* separator = " reset: ";
+        for (auto& counter : counters_) {
+            if (total ? !counter.resets : !counter.reset) {
+                continue;
+            }
+            out << graphic_format::YELLOW << separator << counter.name;
+            if (total) {
+                out << " x" << counter.resets;
+            }
+            separator = ",";
+        }
+        out << graphic_format::RESET;
+    }
+
+  private:
+    struct Counter {
+        std::string name;
+        std::string path;
+        /* may be a 32 bit PMA counter */
+        bool pma;
+        uint64_t last;
+        uint64_t delta;
+        /* sum of the deltas, over wraps, without the reset intervals */
+        uint64_t total;
+        /* the last sample saw a reset, resets over all samples */
+        bool reset;
+        uint64_t resets;
+    };
+
+    /* sysfs attributes have to be read from the start every time */
+    static bool read(const std::string& path, uint64_t& value) {
+        std::ifstream in(path);
+        return static_cast<bool>(in >> value);
+    }
+
+    std::string name_;
+    std::vector<Counter> counters_;
+};
+
+#endif /* NIC_COUNTERS_H */
@@ -0,0 +1,426 @@
+#ifndef RDMA_TRANSPORT_H
+#define RDMA_TRANSPORT_H
+
+#include <cerrno>
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+#include <fcntl.h>
+#include <poll.h>
+
+#include <rdma/rdma_cma.h>
+
+#include <psl/log.h>
+
+#include <cm_qp.h>
+#include <common.h>
+#include <transport.h>
+#include <xverbs.h>
+
+/* Connection through librdmacm: one QP and one CQ for sends and receives.
+ * RC (default) and UD QPs are driven by librdmacm, UD in the UDP port
+ * space with an address handle to the server's QP. UC and XRC initiator
+ * QPs are created here and moved to RTS with the CM's attributes. With
+ * xverbs the extended CQ is tried first, and for RC the extended QP, each
+ * falling back to the classic verbs on its own. In a fan-out, later
+ * connections of a worker on the same device as its first one share that
+ * one's completion channel, so a single wait covers all of them, and with
+ * cq_qps > 1 its CQ. */
+class RdmaTransport : public Transport {
+  public:
+    RdmaTransport(const TransportParams& params, const sockaddr_in& addr,
+                  const RdmaTransport* first = nullptr) {
+        const QpType qp_type = params.qp_type;
+        LOG_ERR_EXIT(
+            rdma_create_id(nullptr, &id_, nullptr,
+                           qp_type == QpType::UD ? RDMA_PS_UDP : RDMA_PS_TCP),
+            errno, std::system_category());
+
+        LOG_ERR_EXIT(rdma_resolve_addr(id_, NULL,
+                                       reinterpret_cast<sockaddr*>(
+                                           const_cast<sockaddr_in*>(&addr)),
+                                       1000),
+                     errno, std::system_category());
+
+        LOG_ERR_EXIT(rdma_resolve_route(id_, 1000), errno,
+                     std::system_category());
+
+        /* echo: sends may complete after their reply, so give the send
+         * queue twice the depth; replies add another tx depth of receives */
+        const size_t sq_depth =
+            params.echo ? 2 * params.tx_depth : params.tx_depth;
+        size_t ncqe = sq_depth;
+        if (params.send) {
+            ncqe += params.tx_depth;
+        }
+        const bool same_device = first && first->id_->verbs == id_->verbs;
+        if (same_device && params.cq_qps > 1) {
+            channel_ = first->channel_;
+            cq_ = first->cq_;
+            cq_ex_ = first->cq_ex_;
+            nic_timestamps = first->nic_timestamps;
+            timestamp_mask = first->timestamp_mask;
+            ns_per_cycle = first->ns_per_cycle;
+            shares_cq = true;
+        } else {
+            ncqe *= params.cq_qps;
+        }
+        if (params.events && !channel_) {
+            if (same_device) {
+                channel_ = first->channel_;
+            } else {
+                /* non-blocking so waits can time out */
+                LOG_ERR_EXIT(
+                    !(channel_ = ibv_create_comp_channel(id_->verbs)), errno,
+                    std::system_category());
+                int flags = fcntl(channel_->fd, F_GETFL);
+                LOG_ERR_EXIT(
+                    fcntl(channel_->fd, F_SETFL, flags | O_NONBLOCK) < 0,
+                    errno, std::system_category());
+            }
+        }
+        if (params.xverbs && !cq_) {
+            create_cq_ex(ncqe);
+        }
+        if (!cq_) {
+            LOG_ERR_EXIT(
+                !(cq_ = ibv_create_cq(id_->verbs, ncqe, this, channel_, 0)),
+                errno, std::system_category());
+        }
+
+        ibv_qp_init_attr qp_init_attr = {};
+        qp_init_attr.qp_type = verbs_qp_type(qp_type, true);
+        qp_init_attr.sq_sig_all = 0;
+        qp_init_attr.send_cq = cq_;
+        qp_init_attr.recv_cq = cq_;
+        qp_init_attr.cap.max_inline_data = params.inline_data;
+        qp_init_attr.cap.max_recv_wr = params.send ? params.tx_depth : 1;
+        qp_init_attr.cap.max_send_wr = sq_depth;
+        qp_init_attr.cap.max_recv_sge = 1;
+        qp_init_attr.cap.max_send_sge = 1;
+        if (params.probe_inline) {
+            qp_init_attr.cap.max_inline_data = probe_inline(qp_init_attr);
+        }
+        ibv_device_attr dev_attr;
+        LOG_ERR_EXIT(ibv_query_device(id_->verbs, &dev_attr), errno,
+                     std::system_category());
+        /* QPs outside librdmacm are connected by hand */
+        const bool cm_qp = qp_type == QpType::RC || qp_type == QpType::UD;
+        if (cm_qp) {
+            if (params.xverbs && qp_type == QpType::RC) {
+                create_qp_ex(qp_init_attr, params);
+            }
+            if (!qpx_) {
+                LOG_ERR_EXIT(rdma_create_qp(id_, id_->pd, &qp_init_attr),
+                             errno, std::system_category());
+            }
+            qp_ = id_->qp;
+        } else {
+            create_qp(qp_init_attr, dev_attr);
+        }
+
+        ClientConnectionData conn_data = {};
+        conn_data.send = params.send;
+        conn_data.locations = params.locations;
+        conn_data.echo = params.echo;
+        conn_data.tx_depth = params.tx_depth;
+        conn_data.qp_type = qp_type;
+        rdma_conn_param conn_param = {};
+        conn_param.private_data = reinterpret_cast<void*>(&conn_data);
+        conn_param.private_data_len = sizeof(conn_data);
+        if (qp_type != QpType::UC) {
+            conn_param.responder_resources = dev_attr.max_qp_rd_atom;
+            conn_param.initiator_depth = dev_attr.max_qp_rd_atom;
+        }
+        if (!cm_qp) {
+            conn_param.qp_num = qp_->qp_num;
+        }
+        LOG_ERR_EXIT(rdma_connect(id_, &conn_param), errno,
+                     std::system_category());
+
+        /* RC/UC/XRC reply with the connection's, UD with the SIDR private
+         * data */
+        rdma_cm_event& event = *id_->event;
+        const void* private_data = qp_type == QpType::UD
+                                       ? event.param.ud.private_data
+                                       : event.param.conn.private_data;
+        const uint8_t private_data_len =
+            qp_type == QpType::UD ? event.param.ud.private_data_len
+                                  : event.param.conn.private_data_len;
+        LOG_ERR_EXIT(private_data_len < sizeof(ServerConnectionData), EINVAL,
+                     std::system_category());
+        server_conn_data =
+            *reinterpret_cast<const ServerConnectionData*>(private_data);
+        if (qp_type == QpType::UD) {
+            LOG_ERR_EXIT(
+                !(ah_ = ibv_create_ah(id_->pd, &event.param.ud.ah_attr)),
+                errno, std::system_category());
+            remote_qpn_ = event.param.ud.qp_num;
+            remote_qkey_ = event.param.ud.qkey;
+            /* a datagram fits one MTU */
+            ibv_port_attr port_attr;
+            LOG_ERR_EXIT(ibv_query_port(id_->verbs, id_->port_num, &port_attr),
+                         errno, std::system_category());
+            max_message = size_t{128} << port_attr.active_mtu;
+            recv_header = ud_grh_size;
+        }
+        if (!cm_qp) {
+            /* the reply arrived as CONNECT_RESPONSE, we still owe RTU */
+            int ret;
+            LOG_ERR_EXIT(
+                (ret = modify_qp_cm(id_, qp_, qp_init_attr.qp_type,
+                                    IBV_QPS_RTR)),
+                ret, std::system_category());
+            LOG_ERR_EXIT(
+                (ret = modify_qp_cm(id_, qp_, qp_init_attr.qp_type,
+                                    IBV_QPS_RTS)),
+                ret, std::system_category());
+            LOG_ERR_EXIT(rdma_establish(id_), errno, std::system_category());
+        }
+        qp_type_ = qp_type;
+        /* the device may round the inline size up */
+        ibv_qp_attr qp_attr;
+        ibv_qp_init_attr init_attr;
+        max_inline = ibv_query_qp(qp_, &qp_attr, IBV_QP_CAP, &init_attr)
+                         ? params.inline_data
+                         : qp_attr.cap.max_inline_data;
+    }
+
+    ibv_mr* reg_mr(void* addr, size_t length, int access) override {
+        return ibv_reg_mr(id_->pd, addr, length, access);
+    }
+
+    int dereg_mr(ibv_mr* mr) override { return ibv_dereg_mr(mr); }
+
+    /* librdmacm hands out one PD per device */
+    const void* mr_domain() const override { return id_->pd; }
+
+    int post_send(ibv_send_wr* wr) override {
+        ibv_send_wr* bad_wr;
+        if (qpx_) {
+            return post_send_ex(qpx_, wr);
+        }
+        /* the chain is built for RC, address it for the QP type */
+        if (qp_type_ == QpType::UD) {
+            for (ibv_send_wr* w = wr; w; w = w->next) {
+                w->wr.ud.ah = ah_;
+                w->wr.ud.remote_qpn = remote_qpn_;
+                w->wr.ud.remote_qkey = remote_qkey_;
+            }
+        } else if (qp_type_ == QpType::XRC) {
+            for (ibv_send_wr* w = wr; w; w = w->next) {
+                w->qp_type.xrc.remote_srqn = server_conn_data.xrc_srqn;
+            }
+        }
+        return ibv_post_send(qp_, wr, &bad_wr);
+    }
+
+    ibv_qp_ex* qp_ex() const override { return qpx_; }
+
+    int post_recv(ibv_recv_wr* wr) override {
+        ibv_recv_wr* bad_wr;
+        return ibv_post_recv(qp_, wr, &bad_wr);
+    }
+
+    int poll_cq(int n, ibv_wc* wc, uint64_t* ts) override {
+        return cq_ex_ ? poll_cq_ex(cq_ex_, n, wc, ts)
+                      : ibv_poll_cq(cq_, n, wc);
+    }
+
+    int req_notify_cq() override { return ibv_req_notify_cq(cq_, 0); }
+
+    int wait_cq_event(const timespec* timeout) override {
+        pollfd fd = {channel_->fd, POLLIN, 0};
+        int ret = ppoll(&fd, 1, timeout, nullptr);
+        if (ret <= 0) {
+            return ret;
+        }
+        ibv_cq* cq;
+        void* context;
+        if (ibv_get_cq_event(channel_, &cq, &context)) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        /* the channel may be shared, the event is the CQ owner's */
+        static_cast<RdmaTransport*>(context)->ack_cq_event();
+        return 0;
+    }
+
+    int read_clock(uint64_t& cycles) override {
+        return read_nic_clock(id_->verbs, cycles);
+    }
+
+    std::string data_path() const override {
+        std::ostringstream qp;
+        qp << qp_type_;
+        return "qp = " + qp.str() + " post = " +
+               (qpx_ ? "ibv_qp_ex" : "ibv_post_send") + " poll = " +
+               (cq_ex_ ? "ibv_cq_ex" : "ibv_poll_cq") +
+               (shares_cq ? " (shared)" : "") + " nic timestamps = " +
+               (nic_timestamps ? "yes" : "no");
+    }
+
+    bool query_device(std::string& name,
+                      ibv_device_attr& dev_attr) const override {
+        name = ibv_get_device_name(id_->verbs->device);
+        return !ibv_query_device(id_->verbs, &dev_attr);
+    }
+
+    bool device_port(std::string& name, unsigned& port) const override {
+        name = ibv_get_device_name(id_->verbs->device);
+        port = id_->port_num;
+        return true;
+    }
+
+  private:
+    /* inline sizes probe_inline() starts from */
+    static constexpr size_t probe_inline_max = 4096;
+
+    /* The largest inline size a QP like qp_init_attr can be created with:
+     * throwaway QPs from probe_inline_max down by halves, at least the
+     * requested size. XRC initiators are probed as RC. */
+    size_t probe_inline(ibv_qp_init_attr qp_init_attr) {
+        if (qp_init_attr.qp_type == IBV_QPT_XRC_SEND) {
+            qp_init_attr.qp_type = IBV_QPT_RC;
+        }
+        const size_t requested = qp_init_attr.cap.max_inline_data;
+        for (size_t size = probe_inline_max; size > requested; size /= 2) {
+            ibv_qp_init_attr attr = qp_init_attr;
+            attr.cap.max_inline_data = size;
+            if (ibv_qp* qp = ibv_create_qp(id_->pd, &attr)) {
+                ibv_destroy_qp(qp);
+                /* the device may round it up */
+                return attr.cap.max_inline_data;
+            }
+        }
+        return requested;
+    }
+
+    /* UC and XRC initiator QPs, left in INIT */
+    void create_qp(const ibv_qp_init_attr& qp_init_attr,
+                   const ibv_device_attr& dev_attr) {
+        if (qp_init_attr.qp_type == IBV_QPT_XRC_SEND) {
+            LOG_ERR_EXIT(!(dev_attr.device_cap_flags & IBV_DEVICE_XRC),
+                         EOPNOTSUPP, std::system_category());
+            ibv_qp_init_attr_ex qp_init_attr_ex = {};
+            qp_init_attr_ex.qp_type = IBV_QPT_XRC_SEND;
+            qp_init_attr_ex.send_cq = qp_init_attr.send_cq;
+            qp_init_attr_ex.cap = qp_init_attr.cap;
+            qp_init_attr_ex.cap.max_recv_wr = 0;
+            qp_init_attr_ex.cap.max_recv_sge = 0;
+            qp_init_attr_ex.comp_mask = IBV_QP_INIT_ATTR_PD;
+            qp_init_attr_ex.pd = id_->pd;
+            LOG_ERR_EXIT(
+                !(qp_ = ibv_create_qp_ex(id_->verbs, &qp_init_attr_ex)),
+                errno, std::system_category());
+        } else {
+            LOG_ERR_EXIT(!(qp_ = ibv_create_qp(
+                               id_->pd,
+                               const_cast<ibv_qp_init_attr*>(&qp_init_attr))),
+                         errno, std::system_category());
+        }
+        int ret;
+        LOG_ERR_EXIT(
+            (ret = modify_qp_cm(id_, qp_, qp_init_attr.qp_type, IBV_QPS_INIT)),
+            ret, std::system_category());
+    }
+
+    void ack_cq_event() {
+        /* acking takes a lock, do it for a batch of events at once */
+        if (++unacked_events_ == event_ack_batch) {
+            ibv_ack_cq_events(cq_, unacked_events_);
+            unacked_events_ = 0;
+        }
+    }
+
+    void create_cq_ex(size_t ncqe) {
+        /* timestamps need a free running NIC clock we can also read at
+         * post time, else fall back to a plain extended CQ */
+        ibv_device_attr_ex dev_attr_ex = {};
+        uint64_t cycles;
+        bool timestamps =
+            !ibv_query_device_ex(id_->verbs, nullptr, &dev_attr_ex) &&
+            dev_attr_ex.completion_timestamp_mask &&
+            dev_attr_ex.hca_core_clock && !read_nic_clock(id_->verbs, cycles);
+        ibv_cq_init_attr_ex cq_attr = {};
+        cq_attr.cqe = ncqe;
+        cq_attr.channel = channel_;
+        cq_attr.cq_context = this;
+        if (timestamps) {
+            cq_attr.wc_flags =
+                IBV_WC_STANDARD_FLAGS | IBV_WC_EX_WITH_COMPLETION_TIMESTAMP;
+            cq_ex_ = ibv_create_cq_ex(id_->verbs, &cq_attr);
+        }
+        if (!cq_ex_) {
+            timestamps = false;
+            cq_attr.wc_flags = IBV_WC_STANDARD_FLAGS;
+            cq_ex_ = ibv_create_cq_ex(id_->verbs, &cq_attr);
+        }
+        if (cq_ex_) {
+            cq_ = ibv_cq_ex_to_cq(cq_ex_);
+            nic_timestamps = timestamps;
+            timestamp_mask = dev_attr_ex.completion_timestamp_mask;
+            /* hca_core_clock is in kHz */
+            ns_per_cycle = 1e6 / dev_attr_ex.hca_core_clock;
+        }
+    }
+
+    void create_qp_ex(const ibv_qp_init_attr& qp_init_attr,
+                      const TransportParams& params) {
+        ibv_qp_init_attr_ex qp_init_attr_ex = {};
+        qp_init_attr_ex.qp_type = qp_init_attr.qp_type;
+        qp_init_attr_ex.sq_sig_all = qp_init_attr.sq_sig_all;
+        qp_init_attr_ex.send_cq = qp_init_attr.send_cq;
+        qp_init_attr_ex.recv_cq = qp_init_attr.recv_cq;
+        qp_init_attr_ex.cap = qp_init_attr.cap;
+        qp_init_attr_ex.comp_mask =
+            IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+        qp_init_attr_ex.pd = id_->pd;
+        /* the drain at the end of a run is an empty write */
+        qp_init_attr_ex.send_ops_flags = IBV_QP_EX_WITH_RDMA_WRITE;
+        for (auto opcode : params.opcodes) {
+            switch (opcode) {
+            case IBV_WR_RDMA_READ:
+                qp_init_attr_ex.send_ops_flags |= IBV_QP_EX_WITH_RDMA_READ;
+                break;
+            case IBV_WR_RDMA_WRITE:
+                qp_init_attr_ex.send_ops_flags |= IBV_QP_EX_WITH_RDMA_WRITE;
+                break;
+            case IBV_WR_ATOMIC_FETCH_AND_ADD:
+                qp_init_attr_ex.send_ops_flags |=
+                    IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD;
+                break;
+            case IBV_WR_ATOMIC_CMP_AND_SWP:
+                qp_init_attr_ex.send_ops_flags |=
+                    IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP;
+                break;
+            case IBV_WR_SEND:
+                qp_init_attr_ex.send_ops_flags |= IBV_QP_EX_WITH_SEND;
+                break;
+            default:
+                break;
+            }
+        }
+        if (!rdma_create_qp_ex(id_, &qp_init_attr_ex)) {
+            qpx_ = ibv_qp_to_qp_ex(id_->qp);
+        }
+    }
+
+    static constexpr unsigned event_ack_batch = 64;
+
+    rdma_cm_id* id_ = nullptr;
+    QpType qp_type_ = QpType::RC;
+    ibv_qp* qp_ = nullptr;
+    /* UD: where datagrams go */
+    ibv_ah* ah_ = nullptr;
+    uint32_t remote_qpn_ = 0;
+    uint32_t remote_qkey_ = 0;
+    ibv_comp_channel* channel_ = nullptr;
+    unsigned unacked_events_ = 0;
+    ibv_cq* cq_ = nullptr;
+    /* extended verbs, nullptr where the classic path is used */
+    ibv_cq_ex* cq_ex_ = nullptr;
+    ibv_qp_ex* qpx_ = nullptr;
+};
+
+#endif /* RDMA_TRANSPORT_H */
@@ -0,0 +1,214 @@
+#ifndef REGISTRATION_H
+#define REGISTRATION_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+
+#include <infiniband/verbs.h>
+
+#include <psl/log.h>
+
+#include <transport.h>
+
+/* Access flags a memory region is registered with, by name: local (local
+ * write only), remote (+ remote read/write), atomic (+ remote atomic, what
+ * the benchmark itself uses) and odp (atomic on demand, no pinning). */
+struct MrAccess {
+    const char* name;
+    int flags;
+};
+
+constexpr MrAccess mr_accesses[] = {
+    {"local", IBV_ACCESS_LOCAL_WRITE},
+    {"remote", IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                   IBV_ACCESS_REMOTE_READ},
+    {"atomic", default_mr_access},
+    {"odp", default_mr_access | IBV_ACCESS_ON_DEMAND},
+};
+
+inline std::ostream& operator<<(std::ostream& out, const MrAccess& access) {
+    out << access.name;
+    return out;
+}
+
+inline std::istream& operator>>(std::istream& in, MrAccess& access) {
+    std::string str;
+    in >> str;
+    for (auto& a : mr_accesses) {
+        if (boost::iequals(a.name, str)) {
+            access = a;
+            return in;
+        }
+    }
+    in.setstate(std::ios_base::failbit);
+    return in;
+}
+
+/* value[,value...] of any type with stream operators, e.g. 4K,2M pages */
+template <typename T> struct OptionList {
+    std::vector<T> values;
+};
+
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, const OptionList<T>& list) {
+    for (size_t i = 0; i < list.values.size(); i++) {
+        out << (i ? "," : "") << list.values[i];
+    }
+    return out;
+}
+
+template <typename T>
+inline std::istream& operator>>(std::istream& in, OptionList<T>& list) {
+    std::string str;
+    in >> str;
+    std::vector<std::string> entries;
+    boost::split(entries, str, boost::is_any_of(","));
+    list.values.clear();
+    for (auto& entry : entries) {
+        std::stringstream ss(entry);
+        T value;
+        if (!(ss >> value)) {
+            in.setstate(std::ios_base::failbit);
+            return in;
+        }
+        list.values.push_back(value);
+    }
+    return in;
+}
+
+/* LRU cache of registrations over fixed size chunks of a buffer, the way a
+ * storage stack registers I/O buffers on first use instead of pinning all
+ * of them up front. A miss registers the chunk of the address and, when
+ * full, deregisters the least recently used one first. A chunk is pinned
+ * from pin() until the matching unpin(), i.e. while a wr using it is
+ * outstanding, and is never evicted then: pinned chunks leave the LRU
+ * list, and with every registered chunk pinned a miss goes over capacity
+ * until enough of them are unpinned again. The list is intrusive in the
+ * per-chunk entries, nothing is allocated after construction. */
+class RegistrationCache {
+  public:
+    static constexpr size_t none = SIZE_MAX;
+
+    RegistrationCache(Transport& transport, uint64_t base, size_t length,
+                      size_t chunk, size_t capacity, int access)
+        : transport_(transport), base_(base), length_(length), chunk_(chunk),
+          capacity_(capacity), access_(access),
+          entries_((length + chunk - 1) / chunk) {}
+
+    ~RegistrationCache() {
+        for (Entry& entry : entries_) {
+            if (entry.mr) {
+                transport_.dereg_mr(entry.mr);
+            }
+        }
+    }
+
+    /* chunk that holds addr, an op must not cross chunks */
+    size_t chunk(uint64_t addr) const { return (addr - base_) / chunk_; }
+
+    /* lkey of chunk, registered on a miss, pinned until unpin(chunk) */
+    uint32_t pin(size_t index) {
+        Entry& entry = entries_[index];
+        if (entry.mr) {
+            hits_++;
+            if (entry.pins++ == 0) {
+                unlink(index);
+            }
+        } else {
+            misses_++;
+            while (registered_ >= capacity_ && tail_ != none) {
+                evict(tail_);
+            }
+            const uint64_t offset = index * chunk_;
+            LOG_ERR_EXIT(
+                !(entry.mr = transport_.reg_mr(
+                      reinterpret_cast<void*>(base_ + offset),
+                      std::min(chunk_, length_ - offset), access_)),
+                errno, std::system_category());
+            registered_++;
+            entry.pins = 1;
+        }
+        return entry.mr->lkey;
+    }
+
+    /* the chunk becomes the most recently used once nothing pins it, a
+     * cache over capacity shrinks back right away */
+    void unpin(size_t index) {
+        if (--entries_[index].pins == 0) {
+            link(index);
+            while (registered_ > capacity_ && tail_ != none) {
+                evict(tail_);
+            }
+        }
+    }
+
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+    uint64_t evictions() const { return evictions_; }
+
+  private:
+    struct Entry {
+        ibv_mr* mr = nullptr;
+        size_t pins = 0;
+        /* neighbours on the LRU list, towards head_ and tail_ */
+        size_t prev = none;
+        size_t next = none;
+    };
+
+    /* to the head of the LRU list */
+    void link(size_t index) {
+        Entry& entry = entries_[index];
+        entry.prev = none;
+        entry.next = head_;
+        if (head_ != none) {
+            entries_[head_].prev = index;
+        } else {
+            tail_ = index;
+        }
+        head_ = index;
+    }
+
+    void unlink(size_t index) {
+        Entry& entry = entries_[index];
+        (entry.prev != none ? entries_[entry.prev].next : head_) = entry.next;
+        (entry.next != none ? entries_[entry.next].prev : tail_) = entry.prev;
+        entry.prev = entry.next = none;
+    }
+
+    void evict(size_t index) {
+        Entry& entry = entries_[index];
+        unlink(index);
+        int ret;
+        LOG_ERR_EXIT((ret = transport_.dereg_mr(entry.mr)), ret,
+                     std::system_category());
+        entry.mr = nullptr;
+        registered_--;
+        evictions_++;
+    }
+
+    Transport& transport_;
+    const uint64_t base_;
+    const size_t length_;
+    const size_t chunk_;
+    const size_t capacity_;
+    const int access_;
+    /* one per chunk, registered unpinned ones are on the LRU list, most
+     * recent at head_ */
+    std::vector<Entry> entries_;
+    size_t head_ = none;
+    size_t tail_ = none;
+    size_t registered_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t evictions_ = 0;
+};
+
+#endif /* REGISTRATION_H */
@@ -0,0 +1,274 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+
+#include <psl/log.h>
+
+/* -report: the run as machine readable records next to the terminal
+ * output, a run record with the configuration and the device first, then
+ * one record per interval and a total. JSON Lines writes every record as
+ * an object. CSV writes the run record as "# name=value" comment lines and
+ * the others as one table, they all have the same columns. */
+enum class ReportFormat { JSONL, CSV };
+
+inline std::ostream& operator<<(std::ostream& out, const ReportFormat& f) {
+    out << (f == ReportFormat::JSONL ? "jsonl" : "csv");
+    return out;
+}
+
+inline std::istream& operator>>(std::istream& in, ReportFormat& f) {
+    std::string str;
+    in >> str;
+    if (boost::iequals("jsonl", str)) {
+        f = ReportFormat::JSONL;
+    } else if (boost::iequals("csv", str)) {
+        f = ReportFormat::CSV;
+    } else {
+        in.setstate(std::ios_base::failbit);
+    }
+    return in;
+}
+
+/* wall clock time of a record, ns since the epoch */
+inline uint64_t report_time_ns() {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(system_clock::now().time_since_epoch())
+        .count();
+}
+
+/* Named fields in order, numbers, booleans or strings. Values are turned
+ * into text when added, quoting and escaping is up to the writer. */
+class ReportRecord {
+  public:
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value, ReportRecord&>::type
+    add(const char* name, T value) {
+        if (std::is_same<T, bool>::value) {
+            fields_.push_back({name, value ? "true" : "false", false});
+        } else {
+            fields_.push_back({name, std::to_string(value), false});
+        }
+        return *this;
+    }
+
+    /* not a number in JSON, null instead */
+    ReportRecord& add(const char* name, double value) {
+        std::ostringstream ss;
+        if (std::isfinite(value)) {
+            ss.precision(15);
+            ss << value;
+        } else {
+            ss << "null";
+        }
+        fields_.push_back({name, ss.str(), false});
+        return *this;
+    }
+
+    ReportRecord& add(const char* name, const std::string& value) {
+        fields_.push_back({name, value, true});
+        return *this;
+    }
+
+    ReportRecord& add(const char* name, const char* value) {
+        return add(name, std::string(value));
+    }
+
+    /* anything else with a stream operator, as a string */
+    template <typename T>
+    typename std::enable_if<!std::is_arithmetic<T>::value, ReportRecord&>::type
+    add(const char* name, const T& value) {
+        std::ostringstream ss;
+        ss << value;
+        return add(name, ss.str());
+    }
+
+    struct Field {
+        std::string name;
+        std::string value;
+        bool string;
+    };
+
+    const std::vector<Field>& fields() const { return fields_; }
+
+  private:
+    std::vector<Field> fields_;
+};
+
+inline void append_json_string(std::string& out, const std::string& str) {
+    out += '"';
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+/* quoted only when it has to be, RFC 4180 */
+inline void append_csv_value(std::string& out, const std::string& str) {
+    if (str.find_first_of(",\"\r\n") == std::string::npos) {
+        out += str;
+        return;
+    }
+    out += '"';
+    for (char c : str) {
+        if (c == '"') {
+            out += '"';
+        }
+        out += c;
+    }
+    out += '"';
+}
+
+/* Records are formatted and written by a thread of their own: the time
+ * thread only queues them, so a slow disk or a short interval never
+ * delays the next tick. Every batch is flushed, a dashboard tailing the
+ * file sees an interval as soon as it is written. Exits on failure like
+ * the rest of the tool. */
+class ReportWriter {
+  public:
+    ReportWriter(const std::string& path, ReportFormat format)
+        : out_(path), format_(format) {
+        LOG_ERR_EXIT(!out_, errno, std::system_category());
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    ~ReportWriter() { close(); }
+
+    ReportWriter(const ReportWriter&) = delete;
+    ReportWriter& operator=(const ReportWriter&) = delete;
+
+    /* the run record */
+    void metadata(ReportRecord record) { push(std::move(record), true); }
+
+    void write(ReportRecord record) { push(std::move(record), false); }
+
+    /* writes what is queued and stops the thread */
+    void close() {
+        if (!thread_.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_one();
+        thread_.join();
+        out_.close();
+        LOG_ERR_EXIT(out_.fail(), EIO, std::system_category());
+    }
+
+  private:
+    struct Entry {
+        ReportRecord record;
+        bool metadata;
+    };
+
+    void push(ReportRecord record, bool metadata) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back({std::move(record), metadata});
+        }
+        cv_.notify_one();
+    }
+
+    void run() {
+        std::vector<Entry> entries;
+        std::string buf;
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            entries.swap(queue_);
+            lock.unlock();
+            buf.clear();
+            for (auto& entry : entries) {
+                format(entry, buf);
+            }
+            entries.clear();
+            out_.write(buf.data(), buf.size());
+            out_.flush();
+            LOG_ERR_EXIT(!out_, EIO, std::system_category());
+            lock.lock();
+        }
+    }
+
+    void format(const Entry& entry, std::string& buf) {
+        const auto& fields = entry.record.fields();
+        if (format_ == ReportFormat::JSONL) {
+            buf += '{';
+            for (size_t i = 0; i < fields.size(); i++) {
+                buf += i ? "," : "";
+                append_json_string(buf, fields[i].name);
+                buf += ':';
+                if (fields[i].string) {
+                    append_json_string(buf, fields[i].value);
+                } else {
+                    buf += fields[i].value;
+                }
+            }
+            buf += "}\n";
+        } else if (entry.metadata) {
+            /* comment lines, newlines in a value would end them */
+            for (auto& field : fields) {
+                std::string value = field.value;
+                std::replace(value.begin(), value.end(), '\n', ' ');
+                buf += "# " + field.name + "=" + value + "\n";
+            }
+        } else {
+            /* the first record names the columns */
+            if (!columns_) {
+                for (size_t i = 0; i < fields.size(); i++) {
+                    buf += i ? "," : "";
+                    append_csv_value(buf, fields[i].name);
+                }
+                buf += '\n';
+                columns_ = true;
+            }
+            for (size_t i = 0; i < fields.size(); i++) {
+                buf += i ? "," : "";
+                append_csv_value(buf, fields[i].value);
+            }
+            buf += '\n';
+        }
+    }
+
+    std::ofstream out_;
+    const ReportFormat format_;
+    /* writer thread only */
+    bool columns_ = false;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<Entry> queue_;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+#endif /* REPORT_H */
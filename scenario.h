@@ -0,0 +1,75 @@
+#ifndef SCENARIO_H
+#define SCENARIO_H
+
+#include <cstddef>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+
+/* -scenario: a run as ordered phases over the same connections and
+ * memory. A line of the file is a phase: warmup or measure, then key=value
+ * settings that override the command line options of the same name for
+ * that phase only (d, op, mix, s, tx, batch, rate, arrival, dist), and an
+ * optional name=. # starts a comment. E.g.
+ *
+ *   warmup  name=fault-in d=5 op=write s=4K
+ *   measure name=ramp d=10 rate=100000
+ *   measure name=steady d=30 rate=1000000 dist=zipf:0.99
+ */
+struct Phase {
+    std::string name;
+    /* warmup phases run like the others but stay out of the totals */
+    bool measured;
+    /* of the scenario file, for errors */
+    size_t line;
+    std::vector<std::pair<std::string, std::string>> settings;
+};
+
+/* false and the line on a syntax error, the keys are up to the caller */
+inline bool parse_scenario(std::istream& in, std::vector<Phase>& phases,
+                           size_t& error_line) {
+    std::string text;
+    for (size_t line = 1; std::getline(in, text); line++) {
+        text = text.substr(0, text.find('#'));
+        std::istringstream ss(text);
+        std::string kind;
+        if (!(ss >> kind)) {
+            continue;
+        }
+        Phase phase = {"phase" + std::to_string(phases.size() + 1), true,
+                       line, {}};
+        if (boost::iequals("warmup", kind)) {
+            phase.measured = false;
+        } else if (!boost::iequals("measure", kind)) {
+            error_line = line;
+            return false;
+        }
+        std::string setting;
+        while (ss >> setting) {
+            const size_t eq = setting.find('=');
+            if (eq == std::string::npos || !eq || eq + 1 == setting.size()) {
+                error_line = line;
+                return false;
+            }
+            std::string key = setting.substr(0, eq);
+            std::string value = setting.substr(eq + 1);
+            if (key == "name") {
+                phase.name = value;
+            } else {
+                phase.settings.push_back({key, value});
+            }
+        }
+        phases.push_back(phase);
+    }
+    if (phases.empty()) {
+        error_line = 0;
+        return false;
+    }
+    return true;
+}
+
+#endif /* SCENARIO_H */
@@ -1,23 +1,1073 @@
 #include <iostream>
 #include <sstream>
 #include <cstdlib>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <unordered_map>
+#include <map>
+#include <tuple>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <numeric>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
 
 #include <boost/program_options.hpp>
 
+#include <fcntl.h>
 #include <sys/mman.h>
 
 #include <rdma/rdma_cma.h>
 
 #include <psl/log.h>
 #include <psl/net.h>
+#include <psl/terminal.h>
 
+#include <cm_qp.h>
 #include <common.h>
+#include <control.h>
+#include <histogram.h>
+#include <nic_counters.h>
+#include <server_memory.h>
+#include <shm_transport.h>
 
-constexpr int connection_backlog = 128;
+/* wr_id tag of echo sends, the rest of the wr_id is the buffer index */
+constexpr uint64_t echo_wr_flag = uint64_t{1} << 63;
+
+struct TwoSidedConfig {
+    size_t pollers;
+    size_t srq_size;
+    size_t srq_batch;
+    size_t recv_size;
+};
+
+/* Per QP state the pollers need to answer a message: a client's own QP,
+ * or a UD QP shared by all UD clients of a port. */
+struct Connection {
+    ibv_qp* qp;
+    bool echo;
+    /* UD: replies need an address handle per source */
+    bool ud;
+    uint8_t port_num;
+};
+
+/* UD: where a message came from, the GID only with a GRH */
+struct UdSource {
+    uint32_t qp_num;
+    uint16_t lid;
+    ibv_gid gid;
+
+    bool operator<(const UdSource& other) const {
+        return std::tie(qp_num, lid) < std::tie(other.qp_num, other.lid) ||
+               (std::tie(qp_num, lid) == std::tie(other.qp_num, other.lid) &&
+                std::memcmp(gid.raw, other.gid.raw, sizeof(gid.raw)) < 0);
+    }
+};
+
+/* address handles a poller keeps for UD replies; every run of a UD client
+ * is a new source, the cache starts over when it is full */
+constexpr size_t max_ud_sources = 1024;
+
+/* Last registry generation a poller has seen, i.e. it holds no cached
+ * Connection older than that. */
+struct alignas(cache_line_size) PollerSlot {
+    std::atomic<uint64_t> generation{0};
+};
+
+/* qp_num -> Connection for the pollers. Pollers cache lookups locally and
+ * drop their cache whenever the generation changes; remove() waits until
+ * every poller has moved past the removal, after which the QP may be
+ * destroyed safely. */
+class ConnectionRegistry {
+  public:
+    void add(const Connection& connection) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        connections_[connection.qp->qp_num] = connection;
+    }
+
+    void remove(uint32_t qp_num) {
+        uint64_t generation;
+        std::vector<PollerSlot*> pollers;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            connections_.erase(qp_num);
+            generation = generation_.fetch_add(1) + 1;
+            for (auto& poller : pollers_) {
+                pollers.push_back(poller.get());
+            }
+        }
+        /* pollers busy poll, this is a few loop iterations at most */
+        for (auto poller : pollers) {
+            while (poller->generation.load(std::memory_order_acquire) <
+                   generation) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    PollerSlot& add_poller() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pollers_.emplace_back(new PollerSlot());
+        pollers_.back()->generation = generation_.load();
+        return *pollers_.back();
+    }
+
+    uint64_t generation() const {
+        return generation_.load(std::memory_order_acquire);
+    }
+
+    bool find(uint32_t qp_num, Connection& connection) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = connections_.find(qp_num);
+        if (it == connections_.end()) {
+            return false;
+        }
+        connection = it->second;
+        return true;
+    }
+
+  private:
+    std::mutex mutex_;
+    std::unordered_map<uint32_t, Connection> connections_;
+    std::vector<std::unique_ptr<PollerSlot>> pollers_;
+    std::atomic<uint64_t> generation_{0};
+};
+
+/* Receive side of a device shared by all two-sided clients: one SRQ over a
+ * registered buffer pool, drained by one CQ per poller thread. */
+struct SharedReceiveQueue {
+    ibv_srq* srq;
+    ibv_mr* mr;
+    size_t buffer_size;
+    std::vector<ibv_cq*> cqs;
+    size_t next_cq;
+};
 
 struct DeviceContext {
-    ibv_mr& mr;
+    /* one per region of the server memory */
+    std::vector<ibv_mr*> mrs;
     ibv_device_attr dev_attr;
+    SharedReceiveQueue* rq;
+    /* CQs of disconnected one-sided clients, reused for new ones */
+    std::vector<ibv_cq*> free_cqs;
+    /* UD is connectionless: all UD clients of a port share a QP on the
+     * SRQ, one that echoes and one that does not. Created on the first
+     * such client, they live as long as the device. */
+    std::map<std::pair<uint8_t, bool>, ibv_qp*> ud_qps;
+    /* XRC target QPs, opened on the first XRC client. Every XRC wr
+     * names an SRQ of the target's domain, and RDMA into the server
+     * memory is checked against that SRQ's PD, so there is one in the
+     * PD of the mrs. Nothing is ever posted to it. */
+    ibv_xrcd* xrcd;
+    ibv_srq* xrc_srq;
+    uint32_t xrc_srqn;
+};
+
+void post_srq_recvs(SharedReceiveQueue& rq, const std::vector<uint64_t>& bufs,
+                    std::vector<ibv_recv_wr>& wrs,
+                    std::vector<ibv_sge>& sges) {
+    if (bufs.empty()) {
+        return;
+    }
+    wrs.resize(bufs.size());
+    sges.resize(bufs.size());
+    for (size_t i = 0; i < bufs.size(); i++) {
+        sges[i].addr = reinterpret_cast<uint64_t>(rq.mr->addr) +
+                       bufs[i] * rq.buffer_size;
+        sges[i].length = rq.buffer_size;
+        sges[i].lkey = rq.mr->lkey;
+        wrs[i].wr_id = bufs[i];
+        wrs[i].sg_list = &sges[i];
+        wrs[i].num_sge = 1;
+        wrs[i].next = i + 1 < bufs.size() ? &wrs[i + 1] : nullptr;
+    }
+    ibv_recv_wr* bad_wr;
+    int ret;
+    LOG_ERR_EXIT((ret = ibv_post_srq_recv(rq.srq, wrs.data(), &bad_wr)), ret,
+                 std::system_category());
+}
+
+/* An echo whose QP had a full send queue, posted again once completions
+ * made room. It holds its buffer until then. */
+struct DeferredEcho {
+    uint32_t qp_num;
+    ibv_qp* qp;
+    ibv_send_wr wr;
+    ibv_sge sge;
+};
+
+void poll_two_sided(SharedReceiveQueue& rq, ibv_cq* cq,
+                    ConnectionRegistry& registry, PollerSlot& slot,
+                    const TwoSidedConfig& config) {
+    std::vector<ibv_wc> wc(config.srq_batch);
+    std::vector<uint64_t> free_bufs;
+    free_bufs.reserve(config.srq_size);
+    std::vector<ibv_recv_wr> recv_wrs;
+    std::vector<ibv_sge> recv_sges;
+    /* poller local copy, the registry is only locked on a miss */
+    std::unordered_map<uint32_t, Connection> connections;
+    uint64_t generation = slot.generation;
+    /* in arrival order, replies of one QP must not overtake each other */
+    std::vector<DeferredEcho> deferred;
+    deferred.reserve(config.srq_size);
+    /* QPs whose deferred echoes did not fit yet */
+    std::vector<uint32_t> full;
+    std::map<UdSource, ibv_ah*> ahs;
+    /* the reply address of a UD message, nullptr if none can be built */
+    auto ud_ah = [&](const Connection& c, const ibv_wc& wc,
+                     const ibv_grh* grh) -> ibv_ah* {
+        UdSource source = {};
+        source.qp_num = wc.src_qp;
+        source.lid = wc.slid;
+        if (wc.wc_flags & IBV_WC_GRH) {
+            source.gid = grh->sgid;
+        }
+        auto it = ahs.find(source);
+        if (it != ahs.end()) {
+            return it->second;
+        }
+        if (ahs.size() >= max_ud_sources) {
+            /* deferred echoes still need theirs */
+            for (auto a = ahs.begin(); a != ahs.end();) {
+                if (std::any_of(deferred.begin(), deferred.end(),
+                                [&a](const DeferredEcho& echo) {
+                                    return echo.wr.wr.ud.ah == a->second;
+                                })) {
+                    ++a;
+                    continue;
+                }
+                ibv_destroy_ah(a->second);
+                a = ahs.erase(a);
+            }
+        }
+        ibv_ah* ah = ibv_create_ah_from_wc(
+            c.qp->pd, const_cast<ibv_wc*>(&wc), const_cast<ibv_grh*>(grh),
+            c.port_num);
+        if (ah) {
+            ahs.insert({source, ah});
+        }
+        return ah;
+    };
+    auto is_deferred = [&](uint32_t qp_num) {
+        return std::any_of(deferred.begin(), deferred.end(),
+                           [qp_num](const DeferredEcho& echo) {
+                               return echo.qp_num == qp_num;
+                           });
+    };
+    /* false if the send queue is full, any other failure is reported and
+     * the reply dropped, the client is going away */
+    auto post_echo = [&](ibv_qp* qp, ibv_send_wr& wr, uint64_t buf) {
+        ibv_send_wr* bad_wr;
+        int ret = ibv_post_send(qp, &wr, &bad_wr);
+        if (ret == ENOMEM) {
+            return false;
+        }
+        if (ret) {
+            std::cerr << "qp " << qp->qp_num << ": echo: "
+                      << std::system_category().message(ret) << '\n';
+            free_bufs.push_back(buf);
+        }
+        return true;
+    };
+
+    while (true) {
+        uint64_t current = registry.generation();
+        if (current != generation) {
+            /* drop what was removed, the rest keeps its deferred echoes */
+            for (auto it = connections.begin(); it != connections.end();) {
+                Connection c;
+                if (registry.find(it->first, c) && c.qp == it->second.qp) {
+                    ++it;
+                    continue;
+                }
+                it = connections.erase(it);
+            }
+            for (auto it = deferred.begin(); it != deferred.end();) {
+                if (connections.count(it->qp_num)) {
+                    ++it;
+                    continue;
+                }
+                free_bufs.push_back(it->wr.wr_id & ~echo_wr_flag);
+                it = deferred.erase(it);
+            }
+            generation = current;
+            slot.generation.store(generation, std::memory_order_release);
+        }
+
+        /* send completions of the last poll made room, a QP that is still
+         * full holds back its later echoes */
+        full.clear();
+        for (auto it = deferred.begin(); it != deferred.end();) {
+            bool posted = false;
+            if (std::find(full.begin(), full.end(), it->qp_num) ==
+                full.end()) {
+                it->wr.sg_list = &it->sge;
+                posted = post_echo(it->qp, it->wr,
+                                   it->wr.wr_id & ~echo_wr_flag);
+            }
+            if (posted) {
+                it = deferred.erase(it);
+                continue;
+            }
+            full.push_back(it->qp_num);
+            ++it;
+        }
+
+        int polled;
+        LOG_ERR_EXIT(((polled = ibv_poll_cq(cq, wc.size(), wc.data())) < 0),
+                     errno, std::system_category());
+        for (int i = 0; i < polled; i++) {
+            uint64_t buf = wc[i].wr_id & ~echo_wr_flag;
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                /* flushes are expected when a client goes away */
+                if (wc[i].status != IBV_WC_WR_FLUSH_ERR) {
+                    std::cerr << "qp " << wc[i].qp_num << ": "
+                              << ibv_wc_error_category().message(
+                                     wc[i].status)
+                              << '\n';
+                }
+                free_bufs.push_back(buf);
+                continue;
+            }
+            if (wc[i].wr_id & echo_wr_flag) {
+                free_bufs.push_back(buf);
+                continue;
+            }
+            auto connection = connections.find(wc[i].qp_num);
+            if (connection == connections.end()) {
+                Connection c;
+                if (!registry.find(wc[i].qp_num, c)) {
+                    free_bufs.push_back(buf);
+                    continue;
+                }
+                connection = connections.insert({wc[i].qp_num, c}).first;
+            }
+            Connection& c = connection->second;
+            if (!c.echo) {
+                free_bufs.push_back(buf);
+                continue;
+            }
+            ibv_sge sge;
+            sge.addr = reinterpret_cast<uint64_t>(rq.mr->addr) +
+                       buf * rq.buffer_size;
+            sge.length = wc[i].byte_len;
+            sge.lkey = rq.mr->lkey;
+            ibv_send_wr wr = {};
+            if (c.ud) {
+                /* the message follows the GRH, the reply goes back to
+                 * the sending QP */
+                ibv_ah* ah =
+                    ud_ah(c, wc[i], reinterpret_cast<ibv_grh*>(sge.addr));
+                if (!ah) {
+                    free_bufs.push_back(buf);
+                    continue;
+                }
+                sge.addr += ud_grh_size;
+                sge.length -= ud_grh_size;
+                wr.wr.ud.ah = ah;
+                wr.wr.ud.remote_qpn = wc[i].src_qp;
+                wr.wr.ud.remote_qkey = RDMA_UDP_QKEY;
+            }
+            wr.wr_id = buf | echo_wr_flag;
+            wr.sg_list = &sge;
+            wr.num_sge = 1;
+            wr.opcode = IBV_WR_SEND;
+            wr.send_flags = IBV_SEND_SIGNALED;
+            if ((!deferred.empty() && is_deferred(wc[i].qp_num)) ||
+                !post_echo(c.qp, wr, buf)) {
+                deferred.push_back({wc[i].qp_num, c.qp, wr, sge});
+            }
+        }
+        /* refill in batches to amortize the doorbell */
+        if (free_bufs.size() >= config.srq_batch) {
+            post_srq_recvs(rq, free_bufs, recv_wrs, recv_sges);
+            free_bufs.clear();
+        }
+    }
+}
+
+SharedReceiveQueue* create_srq(rdma_cm_id* id, const ibv_device_attr& dev_attr,
+                               ConnectionRegistry& registry,
+                               const TwoSidedConfig& config) {
+    auto rq = new SharedReceiveQueue();
+    /* room for the GRH in front of UD messages */
+    rq->buffer_size = config.recv_size + ud_grh_size;
+    rq->next_cq = 0;
+
+    size_t pool_size = config.srq_size * rq->buffer_size;
+    void* pool;
+    LOG_ERR_EXIT(posix_memalign(&pool, alloc_alignment, pool_size), errno,
+                 std::system_category());
+    LOG_ERR_EXIT(!(rq->mr = ibv_reg_mr(id->pd, pool, pool_size,
+                                       IBV_ACCESS_LOCAL_WRITE)),
+                 errno, std::system_category());
+
+    ibv_srq_init_attr srq_init_attr = {};
+    srq_init_attr.attr.max_wr = config.srq_size;
+    srq_init_attr.attr.max_sge = 1;
+    LOG_ERR_EXIT(!(rq->srq = ibv_create_srq(id->pd, &srq_init_attr)), errno,
+                 std::system_category());
+
+    std::vector<uint64_t> bufs(config.srq_size);
+    std::iota(bufs.begin(), bufs.end(), 0);
+    std::vector<ibv_recv_wr> wrs;
+    std::vector<ibv_sge> sges;
+    post_srq_recvs(*rq, bufs, wrs, sges);
+
+    /* every buffer is either posted or has one echo in flight, so twice the
+     * pool bounds the completions a CQ can see */
+    int ncqe = std::min<int>(2 * config.srq_size, dev_attr.max_cqe);
+    for (size_t i = 0; i < config.pollers; i++) {
+        ibv_cq* cq;
+        LOG_ERR_EXIT(
+            !(cq = ibv_create_cq(id->verbs, ncqe, nullptr, nullptr, 0)),
+            errno, std::system_category());
+        rq->cqs.push_back(cq);
+        std::thread(poll_two_sided, std::ref(*rq), cq, std::ref(registry),
+                    std::ref(registry.add_poller()), std::cref(config))
+            .detach();
+    }
+    return rq;
+}
+
+/* Per client resources, hung off rdma_cm_id::context. */
+struct ClientContext {
+    size_t number;
+    DeviceContext* device;
+    /* own CQ of one-sided clients, nullptr for two-sided ones */
+    ibv_cq* cq;
+    /* UC/XRC: the QP is not the id's, nullptr for RC/UD */
+    ibv_qp* qp;
+    bool two_sided;
+    bool established;
+    std::chrono::steady_clock::time_point requested;
+};
+
+/* Drives all connection events of the listening id on its own thread,
+ * sets up and tears down per client resources. */
+class ConnectionManager {
+  public:
+    ConnectionManager(rdma_event_channel* channel, const ServerMemory& memory,
+                      const MemoryConfig& memory_config,
+                      const TwoSidedConfig& two_sided)
+        : channel_(channel), memory_(memory), memory_config_(memory_config),
+          two_sided_(two_sided) {}
+
+    /* registers the memory with the device of id now instead of on the
+     * first connection, so the cost does not end up in accept latency */
+    void register_memory(rdma_cm_id* id) { device(id); }
+
+    void run() {
+        while (true) {
+            rdma_cm_event* event;
+            LOG_ERR_EXIT(rdma_get_cm_event(channel_, &event), errno,
+                         std::system_category());
+            rdma_cm_id* id = event->id;
+            bool release = false;
+            switch (event->event) {
+            case RDMA_CM_EVENT_CONNECT_REQUEST:
+                release = !accept(*event);
+                break;
+            case RDMA_CM_EVENT_ESTABLISHED:
+                established(id);
+                break;
+            case RDMA_CM_EVENT_DISCONNECTED:
+                disconnected_++;
+                release = true;
+                break;
+            case RDMA_CM_EVENT_REJECTED:
+            case RDMA_CM_EVENT_CONNECT_ERROR:
+            case RDMA_CM_EVENT_UNREACHABLE:
+                std::cerr << "#" << client(id).number << " "
+                          << rdma_event_str(event->event) << " ("
+                          << event->status << ")\n";
+                failed_++;
+                release = true;
+                break;
+            case RDMA_CM_EVENT_DEVICE_REMOVAL:
+                LOG_ERR_EXIT(true, ENODEV, std::system_category());
+                break;
+            default:
+                break;
+            }
+            /* ids can only be destroyed once their events are acked */
+            rdma_ack_cm_event(event);
+            if (release) {
+                this->release(id);
+            }
+        }
+    }
+
+    /* one line whenever connections changed since the last call */
+    void report(std::ostream& out) {
+        uint64_t requested = requested_.load();
+        uint64_t established = established_.load();
+        uint64_t disconnected = disconnected_.load();
+        uint64_t failed = failed_.load();
+        uint64_t rejected = rejected_.load();
+        uint64_t events =
+            requested + established + disconnected + failed + rejected;
+        if (events == last_events_) {
+            return;
+        }
+        last_events_ = events;
+        /* establishment rate since the last line */
+        auto now = std::chrono::steady_clock::now();
+        double elapsed =
+            std::chrono::duration<double>(now - last_report_).count();
+        uint64_t rate =
+            (established - last_established_) / std::max(elapsed, 1e-9);
+        last_report_ = now;
+        last_established_ = established;
+
+        using namespace psl::terminal;
+        HistogramSnapshot latency;
+        accept_latency_.snapshot(latency);
+        out << graphic_format::GREEN << graphic_format::BOLD
+            << "connections = " << graphic_format::WHITE << active_.load()
+            << graphic_format::RESET << " (requested = " << requested
+            << " established = " << established
+            << " disconnected = " << disconnected << " failed = " << failed
+            << " rejected = " << rejected
+            << " released = " << released_.load() << ") "
+            << graphic_format::GREEN << graphic_format::BOLD << "rate = "
+            << graphic_format::WHITE << rate << "/sec "
+            << graphic_format::GREEN << graphic_format::BOLD
+            << "accept latency p50 = "
+            << graphic_format::WHITE << latency.percentile(50.0) << "ns"
+            << graphic_format::GREEN << " p99 = " << graphic_format::WHITE
+            << latency.percentile(99.0) << "ns" << graphic_format::GREEN
+            << " max = " << graphic_format::WHITE << latency.max() << "ns"
+            << graphic_format::RESET << '\n';
+    }
+
+  private:
+    ClientContext& client(rdma_cm_id* id) {
+        return *static_cast<ClientContext*>(id->context);
+    }
+
+    DeviceContext& device(rdma_cm_id* id) {
+        auto context = contexts_.find(id->verbs);
+        if (context == contexts_.end()) {
+            using namespace std::chrono;
+            int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                         IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_ATOMIC;
+            const bool odp = memory_config_.odp && odp_supported(id->verbs);
+            if (odp) {
+                access |= IBV_ACCESS_ON_DEMAND;
+            }
+            /* pinning faults in every page, this is the page-in cost */
+            auto start = steady_clock::now();
+            std::vector<ibv_mr*> mrs;
+            for (auto& region : memory_.regions) {
+                ibv_mr* mr;
+                LOG_ERR_EXIT(!(mr = ibv_reg_mr(id->pd, region.addr,
+                                               region.size, access)),
+                             errno, std::system_category());
+                mrs.push_back(mr);
+            }
+            auto latency = steady_clock::now() - start;
+            std::cout << ibv_get_device_name(id->verbs->device)
+                      << ": registered " << mrs.size() << " region(s) in "
+                      << duration_cast<microseconds>(latency).count() << "us"
+                      << (odp ? " (odp)" : "");
+            if (memory_config_.odp && !odp) {
+                std::cout << " (odp unsupported, pinned)";
+            }
+            std::cout << '\n';
+            context =
+                contexts_.insert(
+                    {id->verbs,
+                     {mrs, {}, nullptr, {}, {}, nullptr, nullptr, 0}})
+                    .first;
+
+            ibv_device_attr& dev_attr = context->second.dev_attr;
+            LOG_ERR_EXIT(ibv_query_device(id->verbs, &dev_attr), errno,
+                         std::system_category());
+        }
+        return context->second;
+    }
+
+    /* false if the id has to be released: the request was rejected, or
+     * it is UD and done with the reply */
+    bool accept(const rdma_cm_event& event) {
+        rdma_cm_id* child_id = event.id;
+        auto ctx = new ClientContext();
+        ctx->number = requested_++;
+        ctx->requested = std::chrono::steady_clock::now();
+        child_id->context = ctx;
+
+        /* UD clients come in on the UDP listener with SIDR private data */
+        const bool ud = child_id->ps == RDMA_PS_UDP;
+        const void* private_data = ud ? event.param.ud.private_data
+                                      : event.param.conn.private_data;
+        const uint8_t private_data_len = ud ? event.param.ud.private_data_len
+                                            : event.param.conn.private_data_len;
+        ClientConnectionData client_conn_data = {};
+        if (private_data_len >= sizeof(ClientConnectionData)) {
+            client_conn_data =
+                *reinterpret_cast<const ClientConnectionData*>(private_data);
+        }
+
+        sockaddr_in* child_addr =
+            reinterpret_cast<sockaddr_in*>(rdma_get_peer_addr(child_id));
+        sockaddr_in* listen_addr =
+            reinterpret_cast<sockaddr_in*>(rdma_get_local_addr(child_id));
+        std::cout << "#" << ctx->number << " " << listen_addr->sin_addr << ":"
+                  << ntohs(listen_addr->sin_port) << " <- "
+                  << psl::terminal::graphic_format::BOLD << child_addr->sin_addr
+                  << ":" << ntohs(child_addr->sin_port)
+                  << psl::terminal::graphic_format::RESET << '\n';
+
+        DeviceContext& context = device(child_id);
+        ctx->device = &context;
+        ctx->two_sided = client_conn_data.send;
+        const QpType qp_type = client_conn_data.qp_type;
+        /* UD has to be two-sided, the XRC SRQ takes no receives */
+        if ((qp_type == QpType::UD) != ud ||
+            (ud && !ctx->two_sided) ||
+            (qp_type == QpType::XRC && ctx->two_sided)) {
+            return reject(child_id, EOPNOTSUPP);
+        }
+
+        if (ctx->two_sided && !context.rq) {
+            context.rq =
+                create_srq(child_id, context.dev_attr, registry_, two_sided_);
+        }
+        ibv_qp* qp;
+        if (ud) {
+            int ret;
+            if ((ret = ud_qp(child_id, context, client_conn_data.echo, qp))) {
+                return reject(child_id, ret);
+            }
+        } else {
+            ibv_qp_init_attr qp_init_attr = {};
+            qp_init_attr.qp_type = verbs_qp_type(qp_type, false);
+            qp_init_attr.sq_sig_all = 0;
+            qp_init_attr.cap.max_inline_data = 0;
+            qp_init_attr.cap.max_recv_sge = 1;
+            qp_init_attr.cap.max_send_sge = 1;
+            if (ctx->two_sided) {
+                SharedReceiveQueue* rq = context.rq;
+                ibv_cq* cq = rq->cqs[rq->next_cq++ % rq->cqs.size()];
+                qp_init_attr.send_cq = cq;
+                qp_init_attr.recv_cq = cq;
+                qp_init_attr.srq = rq->srq;
+                qp_init_attr.cap.max_recv_wr = 0;
+                /* like the client's send queue: a request can arrive before
+                 * the completion of the echo before it was polled */
+                qp_init_attr.cap.max_send_wr =
+                    client_conn_data.echo
+                        ? 2 * std::max<uint32_t>(client_conn_data.tx_depth, 1)
+                        : 1;
+            } else if (qp_type != QpType::XRC) {
+                if (context.free_cqs.empty()) {
+                    ibv_cq* cq;
+                    if (!(cq = ibv_create_cq(child_id->verbs,
+                                             max_send_wr + max_recv_wr, nullptr,
+                                             nullptr, 0))) {
+                        return reject(child_id, errno);
+                    }
+                    context.free_cqs.push_back(cq);
+                }
+                ctx->cq = context.free_cqs.back();
+                context.free_cqs.pop_back();
+                qp_init_attr.send_cq = ctx->cq;
+                qp_init_attr.recv_cq = ctx->cq;
+                qp_init_attr.cap.max_recv_wr = 1;
+                qp_init_attr.cap.max_send_wr = 1;
+            }
+            if (qp_type == QpType::RC || qp_type == QpType::UD) {
+                if (rdma_create_qp(child_id, child_id->pd, &qp_init_attr)) {
+                    return reject(child_id, errno);
+                }
+                qp = child_id->qp;
+            } else {
+                int ret;
+                if ((ret = create_qp(child_id, context, qp_init_attr))) {
+                    return reject(child_id, ret);
+                }
+                qp = ctx->qp;
+            }
+            if (ctx->two_sided) {
+                registry_.add(
+                    {qp, client_conn_data.echo, false, child_id->port_num});
+            }
+        }
+
+        /* regions are handed out round robin */
+        const size_t region = ctx->number % memory_.regions.size();
+        ServerConnectionData conn_data;
+        conn_data.address =
+            reinterpret_cast<uint64_t>(memory_.regions[region].addr);
+        conn_data.size = memory_.regions[region].size;
+        conn_data.rkey = context.mrs[region]->rkey;
+        conn_data.recv_size = two_sided_.recv_size;
+        conn_data.chase_stride = memory_config_.chase;
+        conn_data.xrc_srqn = qp_type == QpType::XRC ? context.xrc_srqn : 0;
+        rdma_conn_param conn_param = {};
+        conn_param.private_data = reinterpret_cast<void*>(&conn_data);
+        conn_param.private_data_len = sizeof(conn_data);
+        if (qp_type != QpType::UC) {
+            conn_param.responder_resources = context.dev_attr.max_qp_rd_atom;
+            conn_param.initiator_depth = context.dev_attr.max_qp_rd_atom;
+        }
+        if (!child_id->qp) {
+            conn_param.qp_num = qp->qp_num;
+        }
+        if (rdma_accept(child_id, &conn_param)) {
+            return reject(child_id, errno);
+        }
+        /* SIDR is done with the reply, no ESTABLISHED or DISCONNECTED
+         * follows and the shared QP holds nothing of the client's */
+        if (ud) {
+            established(child_id);
+            return false;
+        }
+        return true;
+    }
+
+    /* The shared UD QP of the port of id, created and brought to RTS on
+     * first use. Receives come from the SRQ. An echo holds its receive
+     * buffer until its send completes, so a send queue as deep as the SRQ
+     * never fills. 0 or an errno value. */
+    int ud_qp(rdma_cm_id* id, DeviceContext& context, bool echo,
+              ibv_qp*& qp) {
+        ibv_qp*& shared = context.ud_qps[{id->port_num, echo}];
+        if (shared) {
+            qp = shared;
+            return 0;
+        }
+        SharedReceiveQueue& rq = *context.rq;
+        ibv_cq* cq = rq.cqs[rq.next_cq++ % rq.cqs.size()];
+        ibv_qp_init_attr qp_init_attr = {};
+        qp_init_attr.qp_type = IBV_QPT_UD;
+        qp_init_attr.send_cq = cq;
+        qp_init_attr.recv_cq = cq;
+        qp_init_attr.srq = rq.srq;
+        qp_init_attr.cap.max_send_wr =
+            echo ? std::min<size_t>(two_sided_.srq_size,
+                                    context.dev_attr.max_qp_wr)
+                 : 1;
+        qp_init_attr.cap.max_send_sge = 1;
+        qp_init_attr.cap.max_recv_sge = 1;
+        if (!(qp = ibv_create_qp(id->pd, &qp_init_attr))) {
+            return errno;
+        }
+        int ret = 0;
+        for (ibv_qp_state state : {IBV_QPS_INIT, IBV_QPS_RTR, IBV_QPS_RTS}) {
+            if ((ret = modify_qp_cm(id, qp, IBV_QPT_UD, state))) {
+                ibv_destroy_qp(qp);
+                return ret;
+            }
+        }
+        registry_.add({qp, echo, true, id->port_num});
+        shared = qp;
+        return 0;
+    }
+
+    /* UC and XRC target QPs, brought to RTS before the accept like
+     * librdmacm does with its own. 0 or an errno value. */
+    int create_qp(rdma_cm_id* id, DeviceContext& context,
+                  const ibv_qp_init_attr& qp_init_attr) {
+        ClientContext& ctx = client(id);
+        if (qp_init_attr.qp_type == IBV_QPT_XRC_RECV) {
+            if (!(context.dev_attr.device_cap_flags & IBV_DEVICE_XRC)) {
+                return EOPNOTSUPP;
+            }
+            if (!context.xrcd) {
+                ibv_xrcd_init_attr xrcd_attr = {};
+                xrcd_attr.comp_mask =
+                    IBV_XRCD_INIT_ATTR_FD | IBV_XRCD_INIT_ATTR_OFLAGS;
+                xrcd_attr.fd = -1;
+                xrcd_attr.oflags = O_CREAT;
+                if (!(context.xrcd = ibv_open_xrcd(id->verbs, &xrcd_attr))) {
+                    return errno;
+                }
+            }
+            if (!context.xrc_srq) {
+                int ret;
+                if ((ret = create_xrc_srq(id, context))) {
+                    return ret;
+                }
+            }
+            ibv_qp_init_attr_ex qp_init_attr_ex = {};
+            qp_init_attr_ex.qp_type = IBV_QPT_XRC_RECV;
+            qp_init_attr_ex.comp_mask = IBV_QP_INIT_ATTR_XRCD;
+            qp_init_attr_ex.xrcd = context.xrcd;
+            ctx.qp = ibv_create_qp_ex(id->verbs, &qp_init_attr_ex);
+        } else {
+            ctx.qp = ibv_create_qp(
+                id->pd, const_cast<ibv_qp_init_attr*>(&qp_init_attr));
+        }
+        if (!ctx.qp) {
+            return errno;
+        }
+        int ret = 0;
+        for (ibv_qp_state state : {IBV_QPS_INIT, IBV_QPS_RTR, IBV_QPS_RTS}) {
+            if ((ret = modify_qp_cm(id, ctx.qp, qp_init_attr.qp_type,
+                                    state))) {
+                break;
+            }
+        }
+        return ret;
+    }
+
+    /* 0 or an errno value */
+    int create_xrc_srq(rdma_cm_id* id, DeviceContext& context) {
+        /* an XRC SRQ needs a CQ, nothing completes on it */
+        ibv_cq* cq;
+        if (!(cq = ibv_create_cq(id->verbs, 1, nullptr, nullptr, 0))) {
+            return errno;
+        }
+        ibv_srq_init_attr_ex srq_init_attr = {};
+        srq_init_attr.attr.max_wr = 1;
+        srq_init_attr.attr.max_sge = 1;
+        srq_init_attr.comp_mask = IBV_SRQ_INIT_ATTR_TYPE |
+                                  IBV_SRQ_INIT_ATTR_XRCD |
+                                  IBV_SRQ_INIT_ATTR_CQ | IBV_SRQ_INIT_ATTR_PD;
+        srq_init_attr.srq_type = IBV_SRQT_XRC;
+        srq_init_attr.xrcd = context.xrcd;
+        srq_init_attr.cq = cq;
+        srq_init_attr.pd = id->pd;
+        ibv_srq* srq;
+        int ret = 0;
+        if (!(srq = ibv_create_srq_ex(id->verbs, &srq_init_attr))) {
+            ret = errno;
+        } else if ((ret = ibv_get_srq_num(srq, &context.xrc_srqn))) {
+            ibv_destroy_srq(srq);
+        }
+        if (ret) {
+            ibv_destroy_cq(cq);
+            return ret;
+        }
+        context.xrc_srq = srq;
+        return 0;
+    }
+
+    bool reject(rdma_cm_id* id, int err) {
+        std::cerr << "#" << client(id).number << " rejected: "
+                  << std::system_category().message(err) << '\n';
+        rdma_reject(id, nullptr, 0);
+        rejected_++;
+        return false;
+    }
+
+    void established(rdma_cm_id* id) {
+        using namespace std::chrono;
+        auto latency = steady_clock::now() - client(id).requested;
+        accept_latency_.record(duration_cast<nanoseconds>(latency).count());
+        client(id).established = true;
+        established_++;
+        active_++;
+    }
+
+    void release(rdma_cm_id* id) {
+        ClientContext* ctx = &client(id);
+        released_++;
+        ibv_qp* qp = ctx->qp ? ctx->qp : id->qp;
+        if (qp && ctx->two_sided) {
+            registry_.remove(qp->qp_num);
+        }
+        if (ctx->qp) {
+            ibv_destroy_qp(ctx->qp);
+        } else if (id->qp) {
+            rdma_destroy_qp(id);
+        }
+        if (ctx->cq) {
+            ctx->device->free_cqs.push_back(ctx->cq);
+        }
+        if (ctx->established) {
+            active_--;
+        }
+        delete ctx;
+        rdma_destroy_id(id);
+    }
+
+    rdma_event_channel* channel_;
+    const ServerMemory& memory_;
+    const MemoryConfig& memory_config_;
+    const TwoSidedConfig& two_sided_;
+    ConnectionRegistry registry_;
+    std::map<ibv_context*, DeviceContext> contexts_;
+
+    /* written by the manager thread, read by the reporter */
+    std::atomic<uint64_t> requested_{0};
+    std::atomic<uint64_t> established_{0};
+    std::atomic<uint64_t> disconnected_{0};
+    std::atomic<uint64_t> failed_{0};
+    std::atomic<uint64_t> rejected_{0};
+    std::atomic<uint64_t> released_{0};
+    std::atomic<int64_t> active_{0};
+    Histogram accept_latency_;
+    uint64_t last_events_ = 0;
+    uint64_t last_established_ = 0;
+    std::chrono::steady_clock::time_point last_report_ =
+        std::chrono::steady_clock::now();
+};
+
+/* -control: runs one group of clients after the other. A group starts
+ * once -clients clients registered, clients that come in while it runs
+ * wait in the listen backlog for the next one. See control.h. */
+class Coordinator {
+  public:
+    Coordinator(int fd, size_t clients) : fd_(fd), clients_(clients) {}
+
+    void run() {
+        for (uint64_t run = 1;; run++) {
+            std::vector<Member> members;
+            uint32_t duration = 0;
+            while (members.size() < clients_) {
+                sockaddr_in addr;
+                socklen_t addr_len = sizeof(addr);
+                int fd;
+                LOG_ERR_EXIT(
+                    (fd = accept(fd_, reinterpret_cast<sockaddr*>(&addr),
+                                 &addr_len)) < 0,
+                    errno, std::system_category());
+                ControlHello hello;
+                if (!recv_control(fd, ControlType::HELLO, hello)) {
+                    lost(addr, errno);
+                    close(fd);
+                    continue;
+                }
+                members.push_back({fd, addr, false});
+                duration = std::max(duration, hello.duration);
+                std::cout << "coordinator: run " << run << ", client "
+                          << members.size() << "/" << clients_ << " "
+                          << addr.sin_addr << " (" << hello.threads
+                          << " threads)" << std::endl;
+            }
+            /* the barrier, everybody is connected and set up by now */
+            for (size_t i = 0; i < members.size(); i++) {
+                ControlStart start = {static_cast<uint32_t>(i),
+                                      static_cast<uint32_t>(clients_),
+                                      duration};
+                if (!send_control(members[i].fd, ControlType::START, &start,
+                                  sizeof(start))) {
+                    lost(members[i].addr, errno);
+                    members[i].done = true;
+                }
+            }
+            std::cout << "coordinator: run " << run << " started, "
+                      << clients_ << " clients, " << duration << "s"
+                      << std::endl;
+            merge(run, members);
+            for (auto& member : members) {
+                close(member.fd);
+            }
+        }
+    }
+
+  private:
+    struct Member {
+        int fd;
+        sockaddr_in addr;
+        /* sent its totals or went away */
+        bool done;
+    };
+
+    /* Merged stats over the clients that reported: throughput is the sum
+     * of the clients' own rates, latency the merged histograms. */
+    struct Merged {
+        std::vector<uint64_t> rates;
+        uint64_t ops = 0;
+        uint64_t cpu_ns = 0;
+        HistogramSnapshot latency;
+
+        void add(const ControlStats& stats, const HistogramSnapshot& h) {
+            rates.push_back(stats.wall_ns ? stats.ops * 1000000000 /
+                                                stats.wall_ns
+                                          : 0);
+            ops += stats.ops;
+            cpu_ns += stats.cpu_ns;
+            latency += h;
+        }
+
+        void print(std::ostream& out) const {
+            using namespace psl::terminal;
+            out << graphic_format::GREEN << graphic_format::BOLD
+                << "throughput = " << graphic_format::WHITE
+                << std::accumulate(rates.begin(), rates.end(), uint64_t{0})
+                << " ops/sec" << graphic_format::RESET << " (per client =";
+            for (auto rate : rates) {
+                out << " " << rate;
+            }
+            out << ") " << graphic_format::GREEN << graphic_format::BOLD
+                << "cpu = " << graphic_format::WHITE
+                << (ops ? cpu_ns / ops : 0) << "ns/op"
+                << graphic_format::RESET << " (" << ops << " ops)\n";
+            if (latency.count()) {
+                out << "\t";
+                print_latency(out, latency);
+            }
+        }
+    };
+
+    /* Every client sends one message per interval and then its totals,
+     * taking one message of every client per round keeps the intervals
+     * lined up. */
+    void merge(uint64_t run, std::vector<Member>& members) {
+        Merged total;
+        HistogramSnapshot latency;
+        for (uint64_t interval = 1;; interval++) {
+            Merged merged;
+            bool active = false;
+            for (auto& member : members) {
+                if (member.done) {
+                    continue;
+                }
+                active = true;
+                ControlType type;
+                std::vector<char> payload;
+                ControlStats stats;
+                if (!recv_control(member.fd, type, payload)) {
+                    lost(member.addr, errno);
+                    member.done = true;
+                    continue;
+                }
+                if ((type != ControlType::INTERVAL &&
+                     type != ControlType::FINAL) ||
+                    !parse_stats(payload, stats, latency)) {
+                    lost(member.addr, EPROTO);
+                    member.done = true;
+                    continue;
+                }
+                if (type == ControlType::FINAL) {
+                    total.add(stats, latency);
+                    member.done = true;
+                } else {
+                    merged.add(stats, latency);
+                }
+            }
+            if (!active) {
+                break;
+            }
+            if (!merged.rates.empty()) {
+                std::ostringstream out;
+                out << "coordinator: run " << run << ", " << interval
+                    << "s\t";
+                merged.print(out);
+                std::cout << out.str() << std::flush;
+            }
+        }
+        std::ostringstream out;
+        out << "coordinator: run " << run << ", total\t";
+        total.print(out);
+        std::cout << out.str() << std::flush;
+    }
+
+    void lost(const sockaddr_in& addr, int err) {
+        std::cerr << "coordinator: " << addr.sin_addr << " lost: "
+                  << std::system_category().message(err) << '\n';
+    }
+
+    const int fd_;
+    const size_t clients_;
 };
 
 int main(int argc, char* argv[]) {
@@ -32,6 +1082,38 @@ int main(int argc, char* argv[]) {
         "listen only from this ip")
         ("p", bop::value<psl::net::in_port_t>()->default_value(default_port),
         "listen on port")
+        ("pollers", bop::value<size_t>()->default_value(1),
+         "two-sided: CQ poller threads")
+        ("srq", bop::value<size_t>()->default_value(max_recv_wr),
+         "two-sided: shared receive queue size")
+        ("srq_batch", bop::value<size_t>()->default_value(16),
+         "two-sided: receives reposted per batch")
+        ("recv_size", bop::value<Bytes>()->default_value({4096}),
+         "two-sided: receive buffer size")
+        ("transport",
+         bop::value<TransportKind>()->default_value(TransportKind::RDMA),
+         "rdma or shm (region for local clients, one-sided only)")
+        ("numa", bop::value<NumaNode>()->default_value(
+            {NumaNode::Kind::AUTO, -1}),
+         "bind memory to node: auto (the NIC's, needs -ip), none or a node")
+        ("pages", bop::value<PageSize>()->default_value(PageSize::BASE),
+         "page size: 4K or hugetlbfs 2M/1G")
+        ("odp", "register on demand (no pinning) where supported")
+        ("regions", bop::value<size_t>()->default_value(1),
+         "split memory into this many MRs, handed out round robin")
+        ("chase", bop::value<Bytes>()->default_value({0}),
+         "lay out a random pointer chain over nodes of this many bytes in "
+         "every region (client -app chase)")
+        ("backlog", bop::value<int>()->default_value(128),
+         "pending connection requests (rdma_listen)")
+        ("control", bop::value<psl::net::in_port_t>()->default_value(0),
+         "coordinate runs of -clients clients on this TCP port (client "
+         "-control), 0 = off")
+        ("clients", bop::value<size_t>()->default_value(2),
+         "control: clients of a run, it starts once all of them are "
+         "registered")
+        ("counters", "print the sysfs port and hardware counters of the "
+         "listening port (every port without -ip) every second (rdma)")
         ("h", "enbale hugepages (madvise)");
     // clang-format on
 
@@ -53,8 +1135,64 @@ int main(int argc, char* argv[]) {
     auto size = vm["s"].as<Bytes>();
     LOG_ERR_EXIT(!size.value, EINVAL, std::system_category());
 
+    TwoSidedConfig two_sided;
+    two_sided.pollers = vm["pollers"].as<size_t>();
+    two_sided.srq_size = vm["srq"].as<size_t>();
+    two_sided.srq_batch = vm["srq_batch"].as<size_t>();
+    two_sided.recv_size = vm["recv_size"].as<Bytes>().value;
+    LOG_ERR_EXIT(!two_sided.pollers || !two_sided.srq_batch ||
+                     two_sided.srq_batch > two_sided.srq_size ||
+                     !two_sided.recv_size,
+                 EINVAL, std::system_category());
+
+    /* a node has to hold the pointer to the next one */
+    const size_t chase = vm["chase"].as<Bytes>().value;
+    LOG_ERR_EXIT(chase && (chase < 8 || chase % 8 || chase > size.value),
+                 EINVAL, std::system_category());
+
+    /* next to the data path of either transport, it only sees TCP */
+    std::unique_ptr<Coordinator> coordinator;
+    const psl::net::in_port_t control_port =
+        vm["control"].as<psl::net::in_port_t>();
+    if (control_port) {
+        const size_t clients = vm["clients"].as<size_t>();
+        LOG_ERR_EXIT(!clients, EINVAL, std::system_category());
+        sockaddr_in control_addr = {};
+        control_addr.sin_addr = vm["ip"].as<psl::net::in_addr>();
+        control_addr.sin_family = AF_INET;
+        control_addr.sin_port = htons(control_port);
+        int fd;
+        LOG_ERR_EXIT((fd = control_listen(control_addr)) < 0, errno,
+                     std::system_category());
+        coordinator.reset(new Coordinator(fd, clients));
+        std::thread(&Coordinator::run, coordinator.get()).detach();
+        std::cout << "coordinator on port " << control_port << ", "
+                  << clients << " clients per run\n";
+    }
+
+    if (vm["transport"].as<TransportKind>() == TransportKind::SHM) {
+        LOG_ERR_EXIT(vm.count("counters"), EINVAL, std::system_category());
+        /* clients access the region directly, there is nothing to serve */
+        psl::net::in_port_t port = vm["p"].as<psl::net::in_port_t>();
+        create_shm_region(port, size.value, chase);
+        std::cout << "Server sharing " << size.value << " bytes as "
+                  << shm_name(port);
+        if (chase) {
+            std::cout << ", chase: " << size.value / chase << " nodes of "
+                      << chase << " bytes";
+        }
+        std::cout << '\n';
+        while (true) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+    }
+
+    rdma_event_channel* channel;
+    LOG_ERR_EXIT(!(channel = rdma_create_event_channel()), errno,
+                 std::system_category());
+
     rdma_cm_id* id;
-    LOG_ERR_EXIT(rdma_create_id(nullptr, &id, nullptr, RDMA_PS_TCP), errno,
+    LOG_ERR_EXIT(rdma_create_id(channel, &id, nullptr, RDMA_PS_TCP), errno,
                  std::system_category());
 
     psl::net::in_addr ip = vm["ip"].as<psl::net::in_addr>();
@@ -67,14 +1205,38 @@ int main(int argc, char* argv[]) {
     LOG_ERR_EXIT(rdma_bind_addr(id, reinterpret_cast<sockaddr*>(&addr)), errno,
                  std::system_category());
 
-    void* data;
-    LOG_ERR_EXIT(posix_memalign(&data, alloc_alignment, size.value), errno,
-                 std::system_category());
-    std::memset(data, 0, size.value);
-
-    if (vm.count("h")) {
-        LOG_ERR_EXIT(madvise(data, size.value, MADV_HUGEPAGE), errno,
-                std::system_category());
+    MemoryConfig memory_config;
+    memory_config.numa = vm["numa"].as<NumaNode>();
+    memory_config.pages = vm["pages"].as<PageSize>();
+    memory_config.thp = vm.count("h");
+    memory_config.odp = vm.count("odp");
+    memory_config.regions = vm["regions"].as<size_t>();
+    memory_config.chase = chase;
+    ServerMemory memory = allocate_memory(memory_config, size.value, id->verbs);
+    std::cout << "memory: " << size.value << " bytes, "
+              << memory_config.pages << " pages, "
+              << memory.regions.size() << " region(s), node ";
+    if (memory.node >= 0) {
+        std::cout << memory.node;
+    } else {
+        std::cout << "unbound";
+    }
+    std::cout << ", mapped in " << memory.allocate_ns / 1000 << "us\n";
+    /* before the memory is registered, this faults in every page */
+    if (chase) {
+        using namespace std::chrono;
+        auto start = steady_clock::now();
+        std::random_device rd;
+        size_t nodes = 0;
+        for (auto& region : memory.regions) {
+            LOG_ERR_EXIT(region.size < chase, EINVAL, std::system_category());
+            nodes = layout_chase(region.addr, region.size, chase, rd());
+        }
+        std::cout << "chase: " << nodes << " nodes of " << chase
+                  << " bytes per region, laid out in "
+                  << duration_cast<microseconds>(steady_clock::now() - start)
+                         .count()
+                  << "us\n";
     }
 
     std::cout << "Server listening on " << ip << ":" << port;
@@ -83,75 +1245,54 @@ int main(int argc, char* argv[]) {
     }
     std::cout << '\n';
 
-    LOG_ERR_EXIT(rdma_listen(id, connection_backlog), errno,
+    LOG_ERR_EXIT(rdma_listen(id, vm["backlog"].as<int>()), errno,
+                 std::system_category());
+    /* UD clients resolve the same port in the UDP port space */
+    rdma_cm_id* ud_id;
+    LOG_ERR_EXIT(rdma_create_id(channel, &ud_id, nullptr, RDMA_PS_UDP), errno,
+                 std::system_category());
+    LOG_ERR_EXIT(rdma_bind_addr(ud_id, reinterpret_cast<sockaddr*>(&addr)),
+                 errno, std::system_category());
+    LOG_ERR_EXIT(rdma_listen(ud_id, vm["backlog"].as<int>()), errno,
                  std::system_category());
 
-    size_t nclients = 0;
-    std::map<ibv_context*, DeviceContext> contexts;
-    while (true) {
-        rdma_cm_id* child_id;
-        LOG_ERR_EXIT(rdma_get_request(id, &child_id), errno,
-                     std::system_category());
-
-        sockaddr_in* child_addr =
-            reinterpret_cast<sockaddr_in*>(rdma_get_peer_addr(child_id));
-        sockaddr_in* listen_addr =
-            reinterpret_cast<sockaddr_in*>(rdma_get_local_addr(child_id));
-        std::cout << "#" << nclients << " " << listen_addr->sin_addr << ":"
-                  << ntohs(listen_addr->sin_port) << " <- "
-                  << psl::terminal::graphic_format::BOLD << child_addr->sin_addr
-                  << ":" << ntohs(child_addr->sin_port)
-                  << psl::terminal::graphic_format::RESET << '\n';
-        nclients++;
-
-        auto context = contexts.find(child_id->verbs);
-        if (context == contexts.end()) {
-            ibv_mr* mr;
-            LOG_ERR_EXIT(!(mr = ibv_reg_mr(child_id->pd, data, size.value,
-                                           IBV_ACCESS_LOCAL_WRITE |
-                                               IBV_ACCESS_REMOTE_WRITE |
-                                               IBV_ACCESS_REMOTE_READ |
-                                               IBV_ACCESS_REMOTE_ATOMIC)),
-                         errno, std::system_category());
-            context = contexts.insert({child_id->verbs, {*mr, {}}}).first;
+    ConnectionManager manager(channel, memory, memory_config, two_sided);
+    if (id->verbs) {
+        manager.register_memory(id);
+    }
+    std::thread manager_thread(&ConnectionManager::run, &manager);
 
-            ibv_device_attr& dev_attr = context->second.dev_attr;
-            LOG_ERR_EXIT(ibv_query_device(child_id->verbs, &dev_attr), errno,
-                         std::system_category());
+    /* -counters: the server posts nothing, but its port sees the load of
+     * all clients. Bound to an address, that is the port of the address,
+     * else the clients could come in on any of them. */
+    std::vector<PortCounters> nic_counters;
+    if (vm.count("counters")) {
+        if (id->verbs) {
+            nic_counters.emplace_back(ibv_get_device_name(id->verbs->device),
+                                      id->port_num);
+        } else {
+            for (auto& port : all_ports()) {
+                nic_counters.emplace_back(port.first, port.second);
+            }
         }
+        nic_counters.erase(
+            std::remove_if(nic_counters.begin(), nic_counters.end(),
+                           [](const PortCounters& c) { return c.empty(); }),
+            nic_counters.end());
+        LOG_ERR_EXIT(nic_counters.empty(), ENOENT, std::system_category());
+    }
 
-        ibv_cq* cq;
-        LOG_ERR_EXIT(
-            !(cq = ibv_create_cq(child_id->verbs, max_send_wr + max_recv_wr,
-                                 nullptr, nullptr, 0)),
-            errno, std::system_category());
-
-        ibv_qp_init_attr qp_init_attr = {};
-        qp_init_attr.qp_type = IBV_QPT_RC;
-        qp_init_attr.sq_sig_all = 0;
-        qp_init_attr.send_cq = cq;
-        qp_init_attr.recv_cq = cq;
-        qp_init_attr.cap.max_inline_data = 0;
-        qp_init_attr.cap.max_recv_wr = 1;
-        qp_init_attr.cap.max_send_wr = 1;
-        qp_init_attr.cap.max_recv_sge = 1;
-        qp_init_attr.cap.max_send_sge = 1;
-        LOG_ERR_EXIT(rdma_create_qp(child_id, child_id->pd, &qp_init_attr),
-                     errno, std::system_category());
-
-        ServerConnectionData conn_data;
-        conn_data.address = reinterpret_cast<uint64_t>(data);
-        conn_data.size = size.value;
-        conn_data.rkey = context->second.mr.rkey;
-        rdma_conn_param conn_param = {};
-        conn_param.private_data = reinterpret_cast<void*>(&conn_data);
-        conn_param.private_data_len = sizeof(conn_data);
-        conn_param.responder_resources =
-            context->second.dev_attr.max_qp_rd_atom;
-        conn_param.initiator_depth = context->second.dev_attr.max_qp_rd_atom;
-        LOG_ERR_EXIT(rdma_accept(child_id, &conn_param), errno,
-                     std::system_category());
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        manager.report(std::cout);
+        for (auto& counters : nic_counters) {
+            counters.sample();
+            std::cout << "\t" << counters.name() << "\t";
+            counters.print(std::cout, 0);
+            std::cout << '\n';
+        }
     }
 
+    manager_thread.join();
     return 0;
 }
@@ -0,0 +1,251 @@
+#ifndef SERVER_MEMORY_H
+#define SERVER_MEMORY_H
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <boost/algorithm/string.hpp>
+
+#include <infiniband/verbs.h>
+
+#include <psl/log.h>
+
+#include <common.h>
+
+/* Page size of the server memory: base pages or explicit hugetlbfs pages
+ * (MAP_HUGETLB, taken from the preallocated pool, so no silent fallback
+ * like with transparent hugepages). */
+enum class PageSize { BASE, HUGE_2M, HUGE_1G };
+
+inline size_t page_bytes(PageSize pages) {
+    switch (pages) {
+    case PageSize::HUGE_2M:
+        return size_t{1} << 21;
+    case PageSize::HUGE_1G:
+        return size_t{1} << 30;
+    default:
+        return alloc_alignment;
+    }
+}
+
+inline std::ostream& operator<<(std::ostream& out, const PageSize& pages) {
+    switch (pages) {
+    case PageSize::HUGE_2M:
+        out << "2M";
+        break;
+    case PageSize::HUGE_1G:
+        out << "1G";
+        break;
+    default:
+        out << "4K";
+        break;
+    }
+    return out;
+}
+
+inline std::istream& operator>>(std::istream& in, PageSize& pages) {
+    std::string str;
+    in >> str;
+    if (boost::iequals("4K", str)) {
+        pages = PageSize::BASE;
+    } else if (boost::iequals("2M", str)) {
+        pages = PageSize::HUGE_2M;
+    } else if (boost::iequals("1G", str)) {
+        pages = PageSize::HUGE_1G;
+    } else {
+        in.setstate(std::ios_base::failbit);
+    }
+    return in;
+}
+
+/* Private anonymous mapping of size bytes (a multiple of the page size)
+ * in pages, MAP_FAILED and errno on failure */
+inline void* map_pages(size_t size, PageSize pages) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (pages == PageSize::HUGE_2M) {
+        flags |= MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+    } else if (pages == PageSize::HUGE_1G) {
+        flags |= MAP_HUGETLB | (30 << MAP_HUGE_SHIFT);
+    }
+    return mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+}
+
+/* auto: the NIC's node, none: no binding, else a node number */
+struct NumaNode {
+    enum class Kind { AUTO, NONE, NODE } kind;
+    int node;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const NumaNode& numa) {
+    switch (numa.kind) {
+    case NumaNode::Kind::AUTO:
+        out << "auto";
+        break;
+    case NumaNode::Kind::NONE:
+        out << "none";
+        break;
+    case NumaNode::Kind::NODE:
+        out << numa.node;
+        break;
+    }
+    return out;
+}
+
+inline std::istream& operator>>(std::istream& in, NumaNode& numa) {
+    std::string str;
+    in >> str;
+    numa = {NumaNode::Kind::NODE, -1};
+    if (boost::iequals("auto", str)) {
+        numa.kind = NumaNode::Kind::AUTO;
+    } else if (boost::iequals("none", str)) {
+        numa.kind = NumaNode::Kind::NONE;
+    } else {
+        std::stringstream ss(str);
+        if (!(ss >> numa.node) || numa.node < 0 || !ss.eof()) {
+            in.setstate(std::ios_base::failbit);
+        }
+    }
+    return in;
+}
+
+/* NUMA node the device is attached to, -1 if unknown */
+inline int device_numa_node(ibv_context* verbs) {
+    std::ifstream file(std::string("/sys/class/infiniband/") +
+                       ibv_get_device_name(verbs->device) +
+                       "/device/numa_node");
+    int node = -1;
+    if (!(file >> node)) {
+        return -1;
+    }
+    return node;
+}
+
+struct MemoryConfig {
+    NumaNode numa;
+    PageSize pages;
+    /* madvise(MADV_HUGEPAGE), base pages only */
+    bool thp;
+    /* register with IBV_ACCESS_ON_DEMAND where the device supports it */
+    bool odp;
+    /* MRs the memory is split into, handed out round robin to clients */
+    size_t regions;
+    /* node stride of the pointer chain laid out in every region, 0 = the
+     * memory stays zeroed */
+    size_t chase;
+};
+
+struct MemoryRegion {
+    void* addr;
+    size_t size;
+};
+
+/* Remote memory of the server: one zeroed mapping split into regions */
+struct ServerMemory {
+    void* data;
+    size_t size;
+    /* bound to this node, -1 if not bound */
+    int node;
+    std::vector<MemoryRegion> regions;
+    /* mmap and binding, pages are only faulted in when registered */
+    uint64_t allocate_ns;
+};
+
+/* verbs is the device the server is bound to for -numa auto, or nullptr
+ * when listening on every device (no binding then). */
+inline ServerMemory allocate_memory(const MemoryConfig& config, size_t size,
+                                    ibv_context* verbs) {
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+    ServerMemory memory;
+    const size_t page = page_bytes(config.pages);
+    LOG_ERR_EXIT(!config.regions || size / config.regions < page, EINVAL,
+                 std::system_category());
+    memory.size = align(size, page);
+
+    LOG_ERR_EXIT((memory.data = map_pages(memory.size, config.pages)) ==
+                     MAP_FAILED,
+                 errno, std::system_category());
+    if (config.thp && config.pages == PageSize::BASE) {
+        LOG_ERR_EXIT(madvise(memory.data, memory.size, MADV_HUGEPAGE), errno,
+                     std::system_category());
+    }
+
+    /* the policy has to be in place before the first touch */
+    memory.node = -1;
+    if (config.numa.kind == NumaNode::Kind::NODE) {
+        memory.node = config.numa.node;
+    } else if (config.numa.kind == NumaNode::Kind::AUTO && verbs) {
+        memory.node = device_numa_node(verbs);
+    }
+    if (memory.node >= 0) {
+        const size_t bits = 8 * sizeof(unsigned long);
+        std::vector<unsigned long> nodemask(memory.node / bits + 1, 0);
+        nodemask[memory.node / bits] = 1ul << (memory.node % bits);
+        LOG_ERR_EXIT(syscall(SYS_mbind, memory.data, memory.size, MPOL_BIND,
+                             nodemask.data(), nodemask.size() * bits + 1, 0),
+                     errno, std::system_category());
+    }
+
+    /* equal page aligned slices, the last one takes the rest */
+    const size_t region_size = size / config.regions / page * page;
+    for (size_t i = 0; i < config.regions; i++) {
+        MemoryRegion region;
+        region.addr = static_cast<char*>(memory.data) + i * region_size;
+        region.size =
+            i + 1 < config.regions ? region_size : size - i * region_size;
+        memory.regions.push_back(region);
+    }
+    memory.allocate_ns =
+        duration_cast<nanoseconds>(steady_clock::now() - start).count();
+    return memory;
+}
+
+/* -chase: links the nodes of stride bytes in [addr, addr + size) into a
+ * single random cycle (Sattolo's algorithm). The first 8 bytes of a node
+ * are the offset of the next one from addr, so a client can start at any
+ * node and never runs into the end of the chain. Consecutive hops land on
+ * unrelated pages, neither prefetching nor the NIC's translation cache
+ * hide a hop. Returns the number of nodes. */
+inline size_t layout_chase(void* addr, size_t size, size_t stride,
+                           uint64_t seed) {
+    char* const base = static_cast<char*>(addr);
+    const size_t n = size / stride;
+    auto next = [&](size_t i) -> uint64_t& {
+        return *reinterpret_cast<uint64_t*>(base + i * stride);
+    };
+    for (size_t i = 0; i < n; i++) {
+        next(i) = i * stride;
+    }
+    std::mt19937_64 r(seed);
+    for (size_t i = n - 1; n && i > 0; i--) {
+        std::uniform_int_distribution<size_t> dist(0, i - 1);
+        std::swap(next(i), next(dist(r)));
+    }
+    return n;
+}
+
+/* ODP needs general support plus RC read/write/atomic on demand */
+inline bool odp_supported(ibv_context* verbs) {
+    ibv_device_attr_ex dev_attr_ex = {};
+    const uint32_t rc_caps = IBV_ODP_SUPPORT_READ | IBV_ODP_SUPPORT_WRITE |
+                             IBV_ODP_SUPPORT_ATOMIC;
+    return !ibv_query_device_ex(verbs, nullptr, &dev_attr_ex) &&
+           (dev_attr_ex.odp_caps.general_caps & IBV_ODP_SUPPORT) &&
+           (dev_attr_ex.odp_caps.per_transport_caps.rc_odp_caps & rc_caps) ==
+               rc_caps;
+}
+
+#endif /* SERVER_MEMORY_H */
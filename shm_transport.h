@@ -0,0 +1,230 @@
+#ifndef SHM_TRANSPORT_H
+#define SHM_TRANSPORT_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <psl/log.h>
+#include <psl/net.h>
+
+#include <common.h>
+#include <server_memory.h>
+#include <transport.h>
+
+/* A shm region starts with this header, the emulated remote memory follows
+ * at shm_header_size so it is page aligned. */
+struct ShmHeader {
+    uint64_t magic;
+    uint64_t size;
+    uint64_t chase_stride;
+};
+
+constexpr uint64_t shm_magic = 0x72646d6170657266; /* "rdmaperf" */
+constexpr size_t shm_header_size = alloc_alignment;
+constexpr uint32_t shm_rkey = 0x73686d;
+
+/* the port names the region, like it names the RDMA listener */
+inline std::string shm_name(psl::net::in_port_t port) {
+    std::ostringstream ss;
+    ss << "/rdmaperf-" << port;
+    return ss.str();
+}
+
+/* Server side: replaces the region of the port with a zeroed one, with
+ * chase_stride laid out as a pointer chain, and returns the start of its
+ * memory. The header is published last. */
+inline void* create_shm_region(psl::net::in_port_t port, size_t size,
+                               size_t chase_stride) {
+    const std::string name = shm_name(port);
+    const size_t map_size = shm_header_size + size;
+    shm_unlink(name.c_str());
+    int fd;
+    LOG_ERR_EXIT(
+        (fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600)) < 0,
+        errno, std::system_category());
+    LOG_ERR_EXIT(ftruncate(fd, map_size), errno, std::system_category());
+    void* base;
+    LOG_ERR_EXIT((base = mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, fd, 0)) == MAP_FAILED,
+                 errno, std::system_category());
+    close(fd);
+    ShmHeader* header = static_cast<ShmHeader*>(base);
+    header->size = size;
+    header->chase_stride = chase_stride;
+    if (chase_stride) {
+        layout_chase(static_cast<char*>(base) + shm_header_size, size,
+                     chase_stride, std::random_device{}());
+    }
+    __atomic_store_n(&header->magic, shm_magic, __ATOMIC_RELEASE);
+    return static_cast<char*>(base) + shm_header_size;
+}
+
+/* Emulates one-sided read/write/fadd/cas on the region of a local server:
+ * the posting thread performs the access itself with memcpy or a CPU
+ * atomic and signaled wrs complete right away. What is left is the tool's
+ * own per op cost, i.e. the ceiling of the rate it can drive. Accesses
+ * outside the region complete with a remote access error. There are no
+ * two-sided ops. */
+class ShmTransport : public Transport {
+  public:
+    ShmTransport(const TransportParams& params, psl::net::in_port_t port)
+        : name_(shm_name(port)) {
+        LOG_ERR_EXIT(params.send, EOPNOTSUPP, std::system_category());
+        /* the access is a copy either way, any size can be "inline" */
+        max_inline = params.probe_inline ? SIZE_MAX : params.inline_data;
+        int fd;
+        LOG_ERR_EXIT((fd = shm_open(name_.c_str(), O_RDWR, 0)) < 0, errno,
+                     std::system_category());
+        struct stat st;
+        LOG_ERR_EXIT(fstat(fd, &st), errno, std::system_category());
+        map_size_ = st.st_size;
+        LOG_ERR_EXIT(map_size_ < shm_header_size, EINVAL,
+                     std::system_category());
+        LOG_ERR_EXIT((base_ = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED, fd, 0)) == MAP_FAILED,
+                     errno, std::system_category());
+        close(fd);
+        const ShmHeader* header = static_cast<const ShmHeader*>(base_);
+        LOG_ERR_EXIT(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) !=
+                             shm_magic ||
+                         header->size > map_size_ - shm_header_size,
+                     EINVAL, std::system_category());
+        begin_ = reinterpret_cast<uint64_t>(base_) + shm_header_size;
+        end_ = begin_ + header->size;
+        server_conn_data.address = begin_;
+        server_conn_data.size = header->size;
+        server_conn_data.rkey = shm_rkey;
+        server_conn_data.chase_stride = header->chase_stride;
+        /* every outstanding wr plus the drain */
+        completions_.reserve(params.tx_depth + 1);
+    }
+
+    ~ShmTransport() override { munmap(base_, map_size_); }
+
+    ibv_mr* reg_mr(void* addr, size_t length, int) override {
+        mrs_.emplace_back(new ibv_mr{});
+        ibv_mr* mr = mrs_.back().get();
+        mr->addr = addr;
+        mr->length = length;
+        mr->lkey = mr->rkey = shm_rkey;
+        return mr;
+    }
+
+    int dereg_mr(ibv_mr* mr) override {
+        auto it = std::find_if(
+            mrs_.begin(), mrs_.end(),
+            [mr](const std::unique_ptr<ibv_mr>& m) { return m.get() == mr; });
+        if (it == mrs_.end()) {
+            return EINVAL;
+        }
+        mrs_.erase(it);
+        return 0;
+    }
+
+    /* keys are not checked */
+    const void* mr_domain() const override { return &shm_rkey; }
+
+    int post_send(ibv_send_wr* wr) override {
+        for (; wr; wr = wr->next) {
+            ibv_wc wc = {};
+            wc.wr_id = wr->wr_id;
+            wc.status = execute(*wr, wc.opcode);
+            if ((wr->send_flags & IBV_SEND_SIGNALED) ||
+                wc.status != IBV_WC_SUCCESS) {
+                completions_.push_back(wc);
+            }
+        }
+        return 0;
+    }
+
+    int post_recv(ibv_recv_wr*) override { return EOPNOTSUPP; }
+
+    int poll_cq(int n, ibv_wc* wc, uint64_t*) override {
+        size_t polled =
+            std::min<size_t>(n, completions_.size() - completions_head_);
+        std::copy_n(completions_.begin() + completions_head_, polled, wc);
+        completions_head_ += polled;
+        if (completions_head_ == completions_.size()) {
+            completions_.clear();
+            completions_head_ = 0;
+        }
+        return polled;
+    }
+
+    std::string data_path() const override {
+        return "shm loopback (" + name_ + ")";
+    }
+
+  private:
+    ibv_wc_status execute(const ibv_send_wr& wr, ibv_wc_opcode& opcode) {
+        const bool atomic = wr.opcode == IBV_WR_ATOMIC_FETCH_AND_ADD ||
+                            wr.opcode == IBV_WR_ATOMIC_CMP_AND_SWP;
+        const uint64_t remote =
+            atomic ? wr.wr.atomic.remote_addr : wr.wr.rdma.remote_addr;
+        const size_t length = wr.num_sge ? wr.sg_list->length : 0;
+        void* local = wr.num_sge ? reinterpret_cast<void*>(wr.sg_list->addr)
+                                 : nullptr;
+        if (remote < begin_ || remote > end_ || length > end_ - remote) {
+            return IBV_WC_REM_ACCESS_ERR;
+        }
+        if (atomic && (remote % 8 || length != 8)) {
+            return IBV_WC_REM_INV_REQ_ERR;
+        }
+        uint64_t* target = reinterpret_cast<uint64_t*>(remote);
+        uint64_t old;
+        switch (wr.opcode) {
+        case IBV_WR_RDMA_READ:
+            opcode = IBV_WC_RDMA_READ;
+            if (length) {
+                std::memcpy(local, target, length);
+            }
+            break;
+        case IBV_WR_RDMA_WRITE:
+            opcode = IBV_WC_RDMA_WRITE;
+            if (length) {
+                std::memcpy(target, local, length);
+            }
+            break;
+        case IBV_WR_ATOMIC_FETCH_AND_ADD:
+            opcode = IBV_WC_FETCH_ADD;
+            old = __atomic_fetch_add(target, wr.wr.atomic.compare_add,
+                                     __ATOMIC_SEQ_CST);
+            std::memcpy(local, &old, sizeof(old));
+            break;
+        case IBV_WR_ATOMIC_CMP_AND_SWP:
+            opcode = IBV_WC_COMP_SWAP;
+            old = wr.wr.atomic.compare_add;
+            __atomic_compare_exchange_n(target, &old, wr.wr.atomic.swap, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+            std::memcpy(local, &old, sizeof(old));
+            break;
+        default:
+            return IBV_WC_LOC_QP_OP_ERR;
+        }
+        return IBV_WC_SUCCESS;
+    }
+
+    std::string name_;
+    void* base_;
+    size_t map_size_;
+    uint64_t begin_;
+    uint64_t end_;
+    std::vector<std::unique_ptr<ibv_mr>> mrs_;
+    /* completion queue, drained from completions_head_ */
+    std::vector<ibv_wc> completions_;
+    size_t completions_head_ = 0;
+};
+
+#endif /* SHM_TRANSPORT_H */
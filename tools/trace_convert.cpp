@@ -0,0 +1,177 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <boost/program_options.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include <psl/log.h>
+
+#include <common.h>
+#include <workload.h>
+#include <trace.h>
+
+/* Writes the binary trace of rdmaperf_client -replay from CSV, one record
+ * per line: op,offset,size[,timestamp_ns]. op is read, write, fadd or cas,
+ * offset and size are bytes (K/M/G suffixes like -s), timestamps ns in any
+ * epoch and not decreasing. Either every record has a timestamp or none
+ * has. Empty lines and # comments are skipped, so is a first line that
+ * names the columns. */
+
+/* records written per write() */
+constexpr size_t convert_batch = 1 << 16;
+
+/* false if the line is not a record */
+bool parse_record(const std::string& line, TraceRecord& record,
+                  bool& timestamp) {
+    std::vector<std::string> fields;
+    boost::split(fields, line, boost::is_any_of(","));
+    if (fields.size() < 3 || fields.size() > 4) {
+        return false;
+    }
+    for (auto& field : fields) {
+        boost::trim(field);
+    }
+    ibv_wr_opcode opcode;
+    TraceOp op;
+    Bytes offset, size;
+    std::stringstream op_ss(fields[0]), offset_ss(fields[1]),
+        size_ss(fields[2]);
+    if (!(op_ss >> opcode) || !to_trace_op(opcode, op) ||
+        !(offset_ss >> offset) || !(size_ss >> size) ||
+        size.value > std::numeric_limits<uint32_t>::max()) {
+        return false;
+    }
+    record = {};
+    record.offset = offset.value;
+    record.size = size.value;
+    record.op = static_cast<uint8_t>(op);
+    timestamp = fields.size() == 4;
+    if (timestamp) {
+        std::stringstream ss(fields[3]);
+        if (!(ss >> record.timestamp_ns) || !ss.eof()) {
+            return false;
+        }
+    }
+    return valid_record(record, std::numeric_limits<uint64_t>::max());
+}
+
+int main(int argc, char* argv[]) {
+    namespace bop = boost::program_options;
+
+    bop::options_description desc("Options");
+    // clang-format off
+    desc.add_options()
+        ("help", "produce this message")
+        ("in", bop::value<std::string>()->default_value("-"),
+         "CSV input, - for stdin")
+        ("out", bop::value<std::string>(), "trace file to write");
+    // clang-format on
+
+    bop::positional_options_description p;
+    p.add("in", 1);
+    p.add("out", 1);
+
+    bop::variables_map vm;
+    bop::store(
+        bop::command_line_parser(argc, argv).options(desc).positional(p).run(),
+        vm);
+
+    if (vm.count("help") || !vm.count("out")) {
+        std::cout << "trace_convert <in.csv> <out.trace>\n" << desc << "\n";
+        return 1;
+    }
+    bop::notify(vm);
+
+    const std::string in_path = vm["in"].as<std::string>();
+    std::ifstream file;
+    if (in_path != "-") {
+        file.open(in_path);
+        LOG_ERR_EXIT(!file, errno, std::system_category());
+    }
+    std::istream& in = in_path == "-" ? std::cin : file;
+    std::ofstream out(vm["out"].as<std::string>(), std::ios::binary);
+    LOG_ERR_EXIT(!out, errno, std::system_category());
+
+    /* written again with the summary once all records are through */
+    TraceHeader header = {};
+    std::memcpy(header.magic, trace_magic, sizeof(trace_magic));
+    header.version = trace_version;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    std::vector<TraceRecord> batch;
+    batch.reserve(convert_batch);
+    auto flush = [&]() {
+        out.write(reinterpret_cast<const char*>(batch.data()),
+                  batch.size() * sizeof(TraceRecord));
+        LOG_ERR_EXIT(!out, EIO, std::system_category());
+        batch.clear();
+    };
+    std::string line;
+    bool first = true;
+    for (size_t n = 1; std::getline(in, line); n++) {
+        line = line.substr(0, line.find('#'));
+        if (boost::trim_copy(line).empty()) {
+            continue;
+        }
+        TraceRecord record;
+        bool timestamp;
+        const bool parsed = parse_record(line, record, timestamp);
+        /* the first line may name the columns */
+        const bool names = first && !parsed;
+        first = false;
+        if (names) {
+            continue;
+        }
+        if (!parsed) {
+            std::cerr << in_path << ":" << n << ": not a valid record\n";
+            return 1;
+        }
+        if (!header.records) {
+            header.flags = timestamp ? trace_timestamps : 0;
+            header.first_ns = record.timestamp_ns;
+        } else if (timestamp != (header.flags & trace_timestamps)) {
+            std::cerr << in_path << ":" << n
+                      << ": timestamps on some records only\n";
+            return 1;
+        } else if (record.timestamp_ns < header.last_ns) {
+            std::cerr << in_path << ":" << n << ": timestamp goes back\n";
+            return 1;
+        }
+        header.records++;
+        header.max_end = std::max(header.max_end, record.offset + record.size);
+        header.max_size = std::max(header.max_size, record.size);
+        header.ops |= 1u << record.op;
+        header.op_max_size[record.op] =
+            std::max(header.op_max_size[record.op], record.size);
+        header.last_ns = record.timestamp_ns;
+        batch.push_back(record);
+        if (batch.size() == convert_batch) {
+            flush();
+        }
+    }
+    LOG_ERR_EXIT(in.bad(), EIO, std::system_category());
+    if (!header.records) {
+        std::cerr << in_path << ": no records\n";
+        return 1;
+    }
+    flush();
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.close();
+    LOG_ERR_EXIT(out.fail(), EIO, std::system_category());
+
+    std::cout << header.records << " records, up to " << header.max_size
+              << " bytes, " << header.max_end << " bytes of server memory";
+    if (header.flags & trace_timestamps) {
+        std::cout << ", " << (header.last_ns - header.first_ns) / 1e9 << "s";
+    }
+    std::cout << '\n';
+    return 0;
+}
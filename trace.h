@@ -0,0 +1,226 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/algorithm/string.hpp>
+
+#include <infiniband/verbs.h>
+
+#include <psl/log.h>
+
+#include <workload.h>
+
+/* -replay: a recorded access trace, a TraceHeader followed by fixed size
+ * TraceRecords in host byte order like the connection private data.
+ * tools/trace_convert writes it from CSV. The client maps the file and
+ * walks the records in order, nothing is parsed or copied, so a trace
+ * does not have to fit in memory. */
+enum class TraceOp : uint8_t { READ, WRITE, FADD, CAS };
+constexpr size_t trace_ops = 4;
+
+constexpr char trace_magic[8] = {'R', 'D', 'M', 'A', 'T', 'R', 'C', '\0'};
+constexpr uint32_t trace_version = 2;
+/* TraceHeader::flags: the records carry timestamps */
+constexpr uint32_t trace_timestamps = 1;
+
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t records;
+    /* Summary of the records, so the client can size its buffers and
+     * check the server's memory before the run: the largest offset +
+     * size, the largest size, a bit per TraceOp that occurs and its
+     * largest size, and the first and last timestamp. */
+    uint64_t max_end;
+    uint32_t max_size;
+    uint32_t ops;
+    uint32_t op_max_size[trace_ops];
+    uint64_t first_ns;
+    uint64_t last_ns;
+};
+
+struct TraceRecord {
+    /* into the server's memory */
+    uint64_t offset;
+    /* ns, not decreasing, 0 without trace_timestamps */
+    uint64_t timestamp_ns;
+    uint32_t size;
+    /* TraceOp */
+    uint8_t op;
+    uint8_t pad[3];
+};
+
+static_assert(sizeof(TraceRecord) == 24, "TraceRecord is a file format");
+
+inline ibv_wr_opcode trace_opcode(TraceOp op) {
+    switch (op) {
+    case TraceOp::READ:
+        return IBV_WR_RDMA_READ;
+    case TraceOp::WRITE:
+        return IBV_WR_RDMA_WRITE;
+    case TraceOp::FADD:
+        return IBV_WR_ATOMIC_FETCH_AND_ADD;
+    default:
+        return IBV_WR_ATOMIC_CMP_AND_SWP;
+    }
+}
+
+/* false for an opcode a trace cannot hold (send) */
+inline bool to_trace_op(ibv_wr_opcode opcode, TraceOp& op) {
+    for (size_t i = 0; i < trace_ops; i++) {
+        if (trace_opcode(static_cast<TraceOp>(i)) == opcode) {
+            op = static_cast<TraceOp>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* A record fits into limit bytes of server memory: a known op, at least a
+ * byte, atomics on an aligned word */
+inline bool valid_record(const TraceRecord& record, uint64_t limit) {
+    if (record.op >= trace_ops || !record.size || record.size > limit ||
+        record.offset > limit - record.size) {
+        return false;
+    }
+    const ibv_wr_opcode opcode = trace_opcode(TraceOp(record.op));
+    return !is_atomic(opcode) || (record.size == 8 && record.offset % 8 == 0);
+}
+
+/* How records are posted: as fast as the QPs take them, or each at its
+ * timestamp (relative to the trace's first one) divided by speed */
+struct ReplayPace {
+    bool timestamps;
+    double speed;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const ReplayPace& pace) {
+    if (pace.timestamps) {
+        out << "ts:" << pace.speed;
+    } else {
+        out << "asap";
+    }
+    return out;
+}
+
+/* asap | ts[:speed] */
+inline std::istream& operator>>(std::istream& in, ReplayPace& pace) {
+    std::string str;
+    in >> str;
+    std::vector<std::string> fields;
+    boost::split(fields, str, boost::is_any_of(":"));
+    pace = {false, 1.0};
+    if (boost::iequals("asap", fields[0]) && fields.size() == 1) {
+        return in;
+    }
+    if (!boost::iequals("ts", fields[0]) || fields.size() > 2) {
+        in.setstate(std::ios_base::failbit);
+        return in;
+    }
+    pace.timestamps = true;
+    if (fields.size() == 2) {
+        std::stringstream ss(fields[1]);
+        if (!(ss >> pace.speed) || !ss.eof() || !(pace.speed > 0.0)) {
+            in.setstate(std::ios_base::failbit);
+        }
+    }
+    return in;
+}
+
+/* A trace file mapped read only. The kernel is told the access is
+ * sequential, so it reads ahead and drops pages behind; readers can ask
+ * for the window ahead of them with prefetch(). Exits on failure like the
+ * rest of the tool. */
+class MappedTrace {
+  public:
+    /* records a prefetch() covers, about 1.5 MiB */
+    static constexpr size_t prefetch_records = 1 << 16;
+
+    explicit MappedTrace(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        LOG_ERR_EXIT(fd < 0, errno, std::system_category());
+        struct stat st;
+        LOG_ERR_EXIT(fstat(fd, &st), errno, std::system_category());
+        length_ = st.st_size;
+        const bool sized = length_ >= sizeof(TraceHeader);
+        if (sized) {
+            map_ = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+            LOG_ERR_EXIT(map_ == MAP_FAILED, errno, std::system_category());
+        }
+        close(fd);
+        header_ = static_cast<const TraceHeader*>(map_);
+        bool valid =
+            sized &&
+            !std::memcmp(header_->magic, trace_magic, sizeof(trace_magic)) &&
+            header_->version == trace_version && header_->records &&
+            header_->max_size && header_->ops &&
+            header_->records ==
+                (length_ - sizeof(TraceHeader)) / sizeof(TraceRecord) &&
+            (length_ - sizeof(TraceHeader)) % sizeof(TraceRecord) == 0;
+        for (size_t i = 0; valid && i < trace_ops; i++) {
+            const uint32_t size = header_->op_max_size[i];
+            valid = (header_->ops & (1u << i))
+                        ? size && size <= header_->max_size
+                        : !size;
+        }
+        if (!valid) {
+            std::cerr << "replay: " << path << ": not a trace file\n";
+        }
+        LOG_ERR_EXIT(!valid, EINVAL, std::system_category());
+        records_ = reinterpret_cast<const TraceRecord*>(header_ + 1);
+        LOG_ERR_EXIT(madvise(map_, length_, MADV_SEQUENTIAL), errno,
+                     std::system_category());
+    }
+
+    ~MappedTrace() {
+        if (map_) {
+            munmap(map_, length_);
+        }
+    }
+
+    MappedTrace(const MappedTrace&) = delete;
+    MappedTrace& operator=(const MappedTrace&) = delete;
+
+    const TraceHeader& header() const { return *header_; }
+    const TraceRecord* records() const { return records_; }
+    size_t size() const { return header_->records; }
+    bool timestamps() const { return header_->flags & trace_timestamps; }
+
+    /* Starts reading the prefetch_records after record index in the
+     * background. A hint: it may be ignored and it never fails. */
+    void prefetch(size_t index) const {
+        static const uintptr_t page = sysconf(_SC_PAGESIZE);
+        const size_t end = std::min(index + prefetch_records, size());
+        if (index >= end) {
+            return;
+        }
+        const uintptr_t begin =
+            reinterpret_cast<uintptr_t>(records_ + index) & ~(page - 1);
+        madvise(reinterpret_cast<void*>(begin),
+                reinterpret_cast<uintptr_t>(records_ + end) - begin,
+                MADV_WILLNEED);
+    }
+
+  private:
+    void* map_ = nullptr;
+    size_t length_;
+    const TraceHeader* header_;
+    const TraceRecord* records_;
+};
+
+#endif /* TRACE_H */
@@ -0,0 +1,132 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+
+#include <infiniband/verbs.h>
+
+#include <common.h>
+
+enum class TransportKind { RDMA, SHM };
+
+inline std::ostream& operator<<(std::ostream& out, const TransportKind& k) {
+    out << (k == TransportKind::RDMA ? "rdma" : "shm");
+    return out;
+}
+
+inline std::istream& operator>>(std::istream& in, TransportKind& k) {
+    std::string str;
+    in >> str;
+    if (boost::iequals("rdma", str)) {
+        k = TransportKind::RDMA;
+    } else if (boost::iequals("shm", str)) {
+        k = TransportKind::SHM;
+    } else {
+        in.setstate(std::ios_base::failbit);
+    }
+    return in;
+}
+
+/* access of the client's local memory, enough for every opcode */
+constexpr int default_mr_access =
+    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ |
+    IBV_ACCESS_REMOTE_ATOMIC;
+
+/* What a client connection has to be set up for */
+struct TransportParams {
+    size_t tx_depth;
+    size_t inline_data;
+    /* rdma: QPs take the largest inline size the device allows, at least
+     * inline_data (-tune searches it) */
+    bool probe_inline;
+    /* two-sided, echo: replies to every message */
+    bool send;
+    bool echo;
+    ssize_t locations;
+    /* every opcode that will be posted */
+    std::vector<ibv_wr_opcode> opcodes;
+    /* rdma: post and poll through ibv_qp_ex/ibv_cq_ex where supported */
+    bool xverbs;
+    /* completion events can be waited for */
+    bool events;
+    /* fan-out: QPs of a worker that share the CQ of its first one, 1 = a
+     * CQ per QP */
+    size_t cq_qps;
+    /* rdma: QP type of the connection */
+    QpType qp_type;
+};
+
+/* The client data path. The benchmark loop keeps building ibv_send_wr
+ * chains and consuming ibv_wc arrays, a transport only has to register
+ * local memory, post a chain with one doorbell and report completions.
+ * Backends connect in their constructor and exit on failure like the
+ * rest of the tool. */
+class Transport {
+  public:
+    virtual ~Transport() {}
+
+    /* nullptr and errno on failure, like ibv_reg_mr */
+    virtual ibv_mr* reg_mr(void* addr, size_t length, int access) = 0;
+    /* 0 or an errno value, like ibv_dereg_mr */
+    virtual int dereg_mr(ibv_mr* mr) = 0;
+
+    /* transports with the same domain accept each other's MRs, nullptr =
+     * only its own */
+    virtual const void* mr_domain() const { return nullptr; }
+
+    /* 0 or an errno value, like ibv_post_send/ibv_post_recv */
+    virtual int post_send(ibv_send_wr* wr) = 0;
+    virtual int post_recv(ibv_recv_wr* wr) = 0;
+    /* With an extended QP the benchmark loop adds its wrs to it with
+     * ibv_wr_* itself, nullptr = post ibv_send_wr chains */
+    virtual ibv_qp_ex* qp_ex() const { return nullptr; }
+
+    /* Up to n completions like ibv_poll_cq, -1 and errno on failure. With
+     * nic_timestamps, ts[i] is the raw completion timestamp of wc[i]. */
+    virtual int poll_cq(int n, ibv_wc* wc, uint64_t* ts) = 0;
+
+    /* Completion events, only with TransportParams::events: arm with
+     * req_notify_cq, wait_cq_event then blocks until the next event or the
+     * timeout (nullptr = none). 0 or an errno value / -1 and errno. A
+     * transport whose completions never lag behind the post needs
+     * neither. */
+    virtual int req_notify_cq() { return 0; }
+    virtual int wait_cq_event(const timespec*) { return 0; }
+
+    /* raw clock in the units of the completion timestamps */
+    virtual int read_clock(uint64_t&) { return EOPNOTSUPP; }
+
+    /* for the startup line */
+    virtual std::string data_path() const = 0;
+
+    /* the device of the connection for -report, false without one */
+    virtual bool query_device(std::string&, ibv_device_attr&) const {
+        return false;
+    }
+    /* the device and port it goes through for -counters */
+    virtual bool device_port(std::string&, unsigned&) const { return false; }
+
+    ServerConnectionData server_conn_data = {};
+    /* completions show up on another transport's CQ, do not poll this one */
+    bool shares_cq = false;
+    /* largest message a send can carry, receive buffers need recv_header
+     * bytes in front of it */
+    size_t max_message = SIZE_MAX;
+    size_t recv_header = 0;
+    /* inline data a wr can carry, at least TransportParams::inline_data */
+    size_t max_inline = 0;
+    /* ns = (cycles & timestamp_mask) * ns_per_cycle */
+    bool nic_timestamps = false;
+    uint64_t timestamp_mask = 0;
+    double ns_per_cycle = 0.0;
+};
+
+#endif /* TRANSPORT_H */
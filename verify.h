@@ -0,0 +1,52 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <workload.h>
+
+/* -verify: every write stamps the start of its location with who wrote it
+ * and a checksum that binds the stamp to the location, every read checks
+ * that what it got is such a stamp (or zero, never written). A torn,
+ * misplaced or corrupted transfer fails the checksum. */
+struct VerifyStamp {
+    uint32_t client;
+    uint32_t checksum;
+    uint64_t seq;
+};
+
+constexpr size_t verify_stamp_size = sizeof(VerifyStamp);
+
+inline uint32_t stamp_checksum(uint32_t client, uint64_t seq,
+                               uint64_t location) {
+    return mix64(mix64(seq ^ (uint64_t{client} << 32)) ^ location);
+}
+
+inline void write_stamp(uint64_t addr, uint32_t client, uint64_t seq,
+                        uint64_t location) {
+    VerifyStamp stamp = {client, stamp_checksum(client, seq, location), seq};
+    std::memcpy(reinterpret_cast<void*>(addr), &stamp, sizeof(stamp));
+}
+
+/* false for anything but a stamp of location or zeroes */
+inline bool check_stamp(uint64_t addr, uint64_t location,
+                        VerifyStamp& stamp) {
+    std::memcpy(&stamp, reinterpret_cast<const void*>(addr), sizeof(stamp));
+    if (!stamp.client && !stamp.checksum && !stamp.seq) {
+        return true;
+    }
+    return stamp.checksum == stamp_checksum(stamp.client, stamp.seq, location);
+}
+
+/* What an op in flight needs to be checked once it completed: where its
+ * result landed and, for cas, the values it was posted with. */
+struct VerifyOp {
+    uint64_t result;
+    uint32_t location;
+    uint64_t compare;
+    uint64_t swap;
+};
+
+#endif /* VERIFY_H */
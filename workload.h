@@ -0,0 +1,364 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+
+#include <infiniband/verbs.h>
+
+#include <common.h>
+
+/* an op mix never has more entries than this */
+constexpr size_t max_op_types = 8;
+/* a fan-out never has more servers than this */
+constexpr size_t max_targets = 16;
+
+inline std::istream& operator>>(std::istream& in, ibv_wr_opcode& op) {
+    std::string str;
+    in >> str;
+    if (boost::iequals("read", str)) {
+        op = IBV_WR_RDMA_READ;
+    } else if (boost::iequals("write", str)) {
+        op = IBV_WR_RDMA_WRITE;
+    } else if (boost::iequals("fadd", str)) {
+        op = IBV_WR_ATOMIC_FETCH_AND_ADD;
+    } else if (boost::iequals("cas", str)) {
+        op = IBV_WR_ATOMIC_CMP_AND_SWP;
+    } else if (boost::iequals("send", str)) {
+        op = IBV_WR_SEND;
+    } else {
+        in.setstate(std::ios_base::failbit);
+    }
+    return in;
+}
+
+inline const char* opcode_name(ibv_wr_opcode op) {
+    switch (op) {
+    case IBV_WR_RDMA_READ:
+        return "read";
+    case IBV_WR_RDMA_WRITE:
+        return "write";
+    case IBV_WR_ATOMIC_FETCH_AND_ADD:
+        return "fadd";
+    case IBV_WR_ATOMIC_CMP_AND_SWP:
+        return "cas";
+    case IBV_WR_SEND:
+        return "send";
+    default:
+        return "?";
+    }
+}
+
+inline bool is_atomic(ibv_wr_opcode op) {
+    return op == IBV_WR_ATOMIC_CMP_AND_SWP ||
+           op == IBV_WR_ATOMIC_FETCH_AND_ADD;
+}
+
+/* One entry of a weighted op mix, e.g. read:64:90 */
+struct OpType {
+    ibv_wr_opcode opcode;
+    size_t size;
+    unsigned weight;
+};
+
+inline std::string op_name(const OpType& type) {
+    return std::string(opcode_name(type.opcode)) + "/" +
+           std::to_string(type.size);
+}
+
+/* op:size:weight[,op:size:weight...] */
+struct OpMix {
+    std::vector<OpType> types;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const OpMix& mix) {
+    for (size_t i = 0; i < mix.types.size(); i++) {
+        out << (i ? "," : "") << opcode_name(mix.types[i].opcode) << ":"
+            << mix.types[i].size << ":" << mix.types[i].weight;
+    }
+    return out;
+}
+
+inline std::istream& operator>>(std::istream& in, OpMix& mix) {
+    std::string str;
+    in >> str;
+    std::vector<std::string> entries;
+    boost::split(entries, str, boost::is_any_of(","));
+    mix.types.clear();
+    for (auto& entry : entries) {
+        std::vector<std::string> fields;
+        boost::split(fields, entry, boost::is_any_of(":"));
+        OpType type;
+        Bytes size;
+        std::stringstream op_ss(fields[0]);
+        std::stringstream size_ss(fields.size() > 1 ? fields[1] : "8");
+        std::stringstream weight_ss(fields.size() > 2 ? fields[2] : "1");
+        if (fields.size() > 3 || !(op_ss >> type.opcode) ||
+            !(size_ss >> size) || !(weight_ss >> type.weight) ||
+            !type.weight || type.opcode == IBV_WR_SEND) {
+            in.setstate(std::ios_base::failbit);
+            return in;
+        }
+        type.size = size.value;
+        mix.types.push_back(type);
+    }
+    if (mix.types.empty() || mix.types.size() > max_op_types) {
+        in.setstate(std::ios_base::failbit);
+    }
+    return in;
+}
+
+/* Location distribution over locations 0..n-1 */
+struct Distribution {
+    enum class Kind { UNIFORM, ZIPF, HOTSPOT, SEQUENTIAL } kind;
+    /* zipf skew, in (0, 1) */
+    double theta;
+    /* hotspot: hot_ops of all ops go to the first hot_set of locations */
+    double hot_set;
+    double hot_ops;
+    /* sequential */
+    size_t stride;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const Distribution& d) {
+    switch (d.kind) {
+    case Distribution::Kind::UNIFORM:
+        out << "uniform";
+        break;
+    case Distribution::Kind::ZIPF:
+        out << "zipf:" << d.theta;
+        break;
+    case Distribution::Kind::HOTSPOT:
+        out << "hotspot:" << d.hot_set << ":" << d.hot_ops;
+        break;
+    case Distribution::Kind::SEQUENTIAL:
+        out << "seq:" << d.stride;
+        break;
+    }
+    return out;
+}
+
+/* a whole option field as a number, no sign for unsigned ones */
+template <typename T>
+inline bool parse_field(const std::string& str, T& value) {
+    if (std::is_unsigned<T>::value && str.find('-') != std::string::npos) {
+        return false;
+    }
+    std::stringstream ss(str);
+    return ss >> value && ss.eof();
+}
+
+/* uniform | zipf[:theta] | hotspot[:set:ops] | seq[:stride] */
+inline std::istream& operator>>(std::istream& in, Distribution& d) {
+    std::string str;
+    in >> str;
+    std::vector<std::string> fields;
+    boost::split(fields, str, boost::is_any_of(":"));
+    d = {Distribution::Kind::UNIFORM, 0.99, 0.2, 0.8, 1};
+    bool valid = false;
+    if (boost::iequals("uniform", fields[0])) {
+        valid = fields.size() == 1;
+    } else if (boost::iequals("zipf", fields[0])) {
+        d.kind = Distribution::Kind::ZIPF;
+        valid = fields.size() == 1 ||
+                (fields.size() == 2 && parse_field(fields[1], d.theta));
+        valid &= d.theta > 0.0 && d.theta < 1.0;
+    } else if (boost::iequals("hotspot", fields[0])) {
+        d.kind = Distribution::Kind::HOTSPOT;
+        valid = fields.size() == 1 ||
+                (fields.size() == 3 && parse_field(fields[1], d.hot_set) &&
+                 parse_field(fields[2], d.hot_ops));
+        valid &= d.hot_set > 0.0 && d.hot_set <= 1.0 && d.hot_ops >= 0.0 &&
+                 d.hot_ops <= 1.0;
+    } else if (boost::iequals("seq", fields[0])) {
+        d.kind = Distribution::Kind::SEQUENTIAL;
+        valid = fields.size() == 1 ||
+                (fields.size() == 2 && parse_field(fields[1], d.stride));
+        valid &= d.stride > 0;
+    }
+    if (!valid) {
+        in.setstate(std::ios_base::failbit);
+    }
+    return in;
+}
+
+/* Zipfian ranks in O(1) per sample after an O(n) setup (Gray et al.,
+ * "Quickly generating billion-record synthetic databases"). Rank 0 is the
+ * most popular one. */
+class ZipfGenerator {
+  public:
+    ZipfGenerator(size_t n, double theta)
+        : n_(n), theta_(theta), zetan_(zeta(n, theta)),
+          alpha_(1.0 / (1.0 - theta)),
+          eta_((1.0 - std::pow(2.0 / n, 1.0 - theta)) /
+               (1.0 - zeta(2, theta) / zetan_)) {}
+
+    template <typename R> size_t operator()(R& r) {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(r);
+        double uz = u * zetan_;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < 1.0 + std::pow(0.5, theta_)) {
+            return std::min<size_t>(1, n_ - 1);
+        }
+        auto rank = static_cast<size_t>(
+            n_ * std::pow(eta_ * u - eta_ + 1.0, alpha_));
+        return std::min(rank, n_ - 1);
+    }
+
+  private:
+    static double zeta(size_t n, double theta) {
+        double sum = 0.0;
+        for (size_t i = 1; i <= n; i++) {
+            sum += 1.0 / std::pow(static_cast<double>(i), theta);
+        }
+        return sum;
+    }
+
+    size_t n_;
+    double theta_;
+    double zetan_;
+    double alpha_;
+    double eta_;
+};
+
+/* Precomputed next op, the hot loop only walks an array of these. */
+struct WorkloadOp {
+    uint32_t location;
+    uint16_t type;
+    /* index of the server the op goes to */
+    uint16_t target;
+};
+
+/* Builds a trace of length ops over nlocations locations. Op types are
+ * drawn by weight independently of the location. Uniform walks shuffled
+ * permutations, so with length == nlocations every location is accessed
+ * exactly once per pass. Zipf ranks are scrambled over the locations so
+ * hot locations are not adjacent. */
+inline std::vector<WorkloadOp> generate_trace(const Distribution& d,
+                                              size_t nlocations,
+                                              const OpMix& mix, size_t length,
+                                              uint64_t seed) {
+    std::mt19937_64 r(seed);
+    std::vector<WorkloadOp> trace(length);
+
+    std::vector<unsigned> weights;
+    for (auto& type : mix.types) {
+        weights.push_back(type.weight);
+    }
+    std::discrete_distribution<uint32_t> type_dist(weights.begin(),
+                                                   weights.end());
+    for (auto& op : trace) {
+        op.type = mix.types.size() > 1 ? type_dist(r) : 0;
+    }
+
+    switch (d.kind) {
+    case Distribution::Kind::UNIFORM: {
+        std::vector<uint32_t> permutation(nlocations);
+        std::iota(permutation.begin(), permutation.end(), 0);
+        for (size_t i = 0; i < length; i++) {
+            if (i % nlocations == 0) {
+                std::shuffle(permutation.begin(), permutation.end(), r);
+            }
+            trace[i].location = permutation[i % nlocations];
+        }
+        break;
+    }
+    case Distribution::Kind::ZIPF: {
+        std::vector<uint32_t> scramble(nlocations);
+        std::iota(scramble.begin(), scramble.end(), 0);
+        std::shuffle(scramble.begin(), scramble.end(), r);
+        ZipfGenerator zipf(nlocations, d.theta);
+        for (auto& op : trace) {
+            op.location = scramble[zipf(r)];
+        }
+        break;
+    }
+    case Distribution::Kind::HOTSPOT: {
+        size_t hot = std::max<size_t>(1, d.hot_set * nlocations);
+        std::bernoulli_distribution is_hot(d.hot_ops);
+        std::uniform_int_distribution<size_t> hot_dist(0, hot - 1);
+        std::uniform_int_distribution<size_t> cold_dist(
+            std::min(hot, nlocations - 1), nlocations - 1);
+        for (auto& op : trace) {
+            op.location = (hot == nlocations || is_hot(r)) ? hot_dist(r)
+                                                            : cold_dist(r);
+        }
+        break;
+    }
+    case Distribution::Kind::SEQUENTIAL:
+        for (size_t i = 0; i < length; i++) {
+            trace[i].location = (i * d.stride) % nlocations;
+        }
+        break;
+    }
+    return trace;
+}
+
+/* How a fan-out spreads locations over its servers */
+enum class ShardPolicy { RANGE, HASH };
+
+inline std::ostream& operator<<(std::ostream& out, const ShardPolicy& p) {
+    out << (p == ShardPolicy::RANGE ? "range" : "hash");
+    return out;
+}
+
+inline std::istream& operator>>(std::istream& in, ShardPolicy& p) {
+    std::string str;
+    in >> str;
+    if (boost::iequals("range", str)) {
+        p = ShardPolicy::RANGE;
+    } else if (boost::iequals("hash", str)) {
+        p = ShardPolicy::HASH;
+    } else {
+        in.setstate(std::ios_base::failbit);
+    }
+    return in;
+}
+
+/* Locations a single server has to hold */
+inline size_t shard_size(ShardPolicy policy, size_t nlocations,
+                         size_t ntargets) {
+    return policy == ShardPolicy::RANGE
+               ? (nlocations + ntargets - 1) / ntargets
+               : nlocations;
+}
+
+/* splitmix64 finalizer: neighbouring inputs give unrelated outputs */
+inline uint64_t mix64(uint64_t h) {
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+    return h ^ (h >> 31);
+}
+
+/* Assigns every op of a trace over nlocations locations to one of ntargets
+ * servers. Range gives each server a contiguous slice of shard_size
+ * locations and rebases the location onto it, hash picks the server by a
+ * hash of the location and keeps the location as is. */
+inline void shard_trace(std::vector<WorkloadOp>& trace, ShardPolicy policy,
+                        size_t nlocations, size_t ntargets) {
+    const size_t slice = shard_size(policy, nlocations, ntargets);
+    for (auto& op : trace) {
+        if (policy == ShardPolicy::RANGE) {
+            op.target = op.location / slice;
+            op.location -= op.target * slice;
+        } else {
+            /* neighbours land on unrelated servers */
+            op.target = mix64(op.location) % ntargets;
+        }
+    }
+}
+
+#endif /* WORKLOAD_H */
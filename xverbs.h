@@ -0,0 +1,124 @@
+#ifndef XVERBS_H
+#define XVERBS_H
+
+#include <cerrno>
+#include <cstdint>
+
+#include <infiniband/verbs.h>
+
+/* Extended verbs for the benchmark loop. The client's posting loop adds
+ * its wrs with add_wr_ex between an ibv_wr_start and an ibv_wr_complete
+ * (one doorbell) without building an ibv_send_wr first; the few posts off
+ * the hot path keep their ibv_send_wr chains and go through
+ * post_send_ex. Completions are polled into ibv_wc arrays. */
+
+/* Adds one wr to the batch opened by ibv_wr_start. compare_add and swap
+ * are only read by atomics, the sge by everything but an empty write. */
+inline void add_wr_ex(ibv_qp_ex* qpx, uint64_t wr_id, unsigned send_flags,
+                      ibv_wr_opcode opcode, uint32_t rkey,
+                      uint64_t remote_addr, uint64_t compare_add,
+                      uint64_t swap, const ibv_sge* sge) {
+    qpx->wr_id = wr_id;
+    qpx->wr_flags = send_flags & ~IBV_SEND_INLINE;
+    switch (opcode) {
+    case IBV_WR_RDMA_READ:
+        ibv_wr_rdma_read(qpx, rkey, remote_addr);
+        break;
+    case IBV_WR_RDMA_WRITE:
+        ibv_wr_rdma_write(qpx, rkey, remote_addr);
+        break;
+    case IBV_WR_ATOMIC_FETCH_AND_ADD:
+        ibv_wr_atomic_fetch_add(qpx, rkey, remote_addr, compare_add);
+        break;
+    case IBV_WR_ATOMIC_CMP_AND_SWP:
+        ibv_wr_atomic_cmp_swp(qpx, rkey, remote_addr, compare_add, swap);
+        break;
+    default:
+        ibv_wr_send(qpx);
+        break;
+    }
+    if (!sge) {
+        ibv_wr_set_sge_list(qpx, 0, nullptr);
+    } else if (send_flags & IBV_SEND_INLINE) {
+        ibv_wr_set_inline_data(qpx, reinterpret_cast<void*>(sge->addr),
+                               sge->length);
+    } else {
+        ibv_wr_set_sge(qpx, sge->lkey, sge->addr, sge->length);
+    }
+}
+
+/* The same for a wr built as an ibv_send_wr */
+inline void add_wr_ex(ibv_qp_ex* qpx, const ibv_send_wr& wr) {
+    const bool atomic = wr.opcode == IBV_WR_ATOMIC_FETCH_AND_ADD ||
+                        wr.opcode == IBV_WR_ATOMIC_CMP_AND_SWP;
+    add_wr_ex(qpx, wr.wr_id, wr.send_flags, wr.opcode,
+              atomic ? wr.wr.atomic.rkey : wr.wr.rdma.rkey,
+              atomic ? wr.wr.atomic.remote_addr : wr.wr.rdma.remote_addr,
+              wr.wr.atomic.compare_add, wr.wr.atomic.swap,
+              wr.num_sge ? wr.sg_list : nullptr);
+}
+
+/* Posts a chain of send wrs with a single ibv_wr_start/ibv_wr_complete,
+ * i.e. one doorbell. Returns 0 or an errno value like ibv_post_send. */
+inline int post_send_ex(ibv_qp_ex* qpx, ibv_send_wr* wr) {
+    ibv_wr_start(qpx);
+    for (; wr; wr = wr->next) {
+        if (wr->opcode != IBV_WR_RDMA_READ &&
+            wr->opcode != IBV_WR_RDMA_WRITE &&
+            wr->opcode != IBV_WR_ATOMIC_FETCH_AND_ADD &&
+            wr->opcode != IBV_WR_ATOMIC_CMP_AND_SWP &&
+            wr->opcode != IBV_WR_SEND) {
+            ibv_wr_abort(qpx);
+            return EINVAL;
+        }
+        add_wr_ex(qpx, *wr);
+    }
+    return ibv_wr_complete(qpx);
+}
+
+/* Polls up to n completions into wc like ibv_poll_cq. If ts is set the
+ * raw NIC completion timestamp of wc[i] is stored in ts[i]. */
+inline int poll_cq_ex(ibv_cq_ex* cq, int n, ibv_wc* wc, uint64_t* ts) {
+    ibv_poll_cq_attr attr = {};
+    int ret = ibv_start_poll(cq, &attr);
+    if (ret == ENOENT) {
+        return 0;
+    }
+    if (ret) {
+        errno = ret;
+        return -1;
+    }
+    int polled = 0;
+    do {
+        ibv_wc& w = wc[polled];
+        w.wr_id = cq->wr_id;
+        w.status = cq->status;
+        if (w.status == IBV_WC_SUCCESS) {
+            w.opcode = ibv_wc_read_opcode(cq);
+        }
+        if (ts) {
+            ts[polled] = ibv_wc_read_completion_ts(cq);
+        }
+        polled++;
+    } while (polled < n && (ret = ibv_next_poll(cq)) == 0);
+    ibv_end_poll(cq);
+    if (ret && ret != ENOENT) {
+        errno = ret;
+        return -1;
+    }
+    return polled;
+}
+
+/* Current raw NIC clock, in the units of ibv_wc_read_completion_ts */
+inline int read_nic_clock(ibv_context* context, uint64_t& cycles) {
+    ibv_values_ex values = {};
+    values.comp_mask = IBV_VALUES_MASK_RAW_CLOCK;
+    int ret = ibv_query_rt_values_ex(context, &values);
+    if (ret) {
+        return ret;
+    }
+    cycles = values.raw_clock.tv_sec * 1000000000ull + values.raw_clock.tv_nsec;
+    return 0;
+}
+
+#endif /* XVERBS_H */